@@ -31,8 +31,10 @@
  * matching is done on these IPs, the speed of the system is improved. These cache
  * entries expire every few hours, which is a reasonable expiry for any reasonable
  * sized network.
+ * An entry is either for a single IP address or, when the ban which caused it
+ * covers a whole CIDR range, for that range.
  */
-class CoreExport BanCacheHit
+class CoreExport BanCacheHit : public insp::intrusive_list_node<BanCacheHit>
 {
  public:
 	/** Type of cached ban
@@ -44,39 +46,73 @@ class CoreExport BanCacheHit
 	/** Time that the ban expires at
 	 */
 	time_t Expiry;
+	/** The IP address or range of IP addresses the entry is for
+	 */
+	irc::sockets::cidr_mask Range;
 
-	BanCacheHit(const std::string& type, const std::string& reason, time_t seconds);
+	BanCacheHit(const irc::sockets::cidr_mask& range, const std::string& type, const std::string& reason, time_t seconds);
 
 	bool IsPositive() const { return (!Reason.empty()); }
 };
 
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
+ * The number of entries is limited by \<performance:bancachesize>, when the cache is
+ * full the least recently used entry is removed to make room for a new one.
  */
 class CoreExport BanCacheManager
 {
+	/** Hashes the binary form of an IP address or range.
+	 */
+	struct RangeHash
+	{
+		size_t operator()(const irc::sockets::cidr_mask& range) const;
+	};
+
 	/** A container of ban cache items.
 	 */
-	typedef TR1NS::unordered_map<std::string, BanCacheHit*, TR1NS::hash<std::string> > BanCacheHash;
+	typedef TR1NS::unordered_map<irc::sockets::cidr_mask, BanCacheHit, RangeHash> BanCacheHash;
+
+	/** Identifies the length of ranges of one address family, e.g. (AF_INET6, 64).
+	 */
+	typedef std::pair<unsigned char, unsigned char> RangeLength;
 
 	BanCacheHash BanHash;
+
+	/** The entries in BanHash, from the least recently used to the most recently used one.
+	 */
+	insp::intrusive_list_tail<BanCacheHit> lru;
+
+	/** The number of entries in BanHash for each length of range which covers more than one
+	 * address. Lookups check these from the longest to the shortest.
+	 */
+	std::map<RangeLength, size_t, std::greater<RangeLength> > rangelengths;
+
 	bool RemoveIfExpired(BanCacheHash::iterator& it);
+	void Remove(BanCacheHash::iterator& it);
+	BanCacheHit* Find(const irc::sockets::cidr_mask& range);
 
  public:
 
 	/** Creates and adds a Ban Cache item.
-	 * @param ip The IP the item is for.
+	 * @param addr The IP address the item is for.
 	 * @param type The type of ban cache item. std::string. .empty() means it's a negative match (user is allowed freely).
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
 	 * @param seconds Number of seconds before nuking the bancache entry, the default is a day. This might seem long, but entries will be removed as G-lines/etc expire.
+	 * @param range If less than the number of bits in addr then the item is for the whole range of addresses
+	 * which have the first range bits of addr in common, e.g. 64 for an IPv6 /64.
+	 * @return The new item or NULL if addr is not an IP address or there already is an item for it.
 	 */
-	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds = 0);
-	BanCacheHit *GetHit(const std::string &ip);
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs& addr, const std::string &type, const std::string &reason, time_t seconds = 0, unsigned char range = 128);
+
+	/** Looks up the Ban Cache item for an IP address.
+	 * @param addr The IP address to look up.
+	 * @return The item for the address or for the smallest cached range the address is in, or NULL if there is none.
+	 */
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs& addr);
 
 	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
 	 * @param type The type of bancache entries to remove (e.g. 'G')
 	 * @param positive Remove either positive (true) or negative (false) hits.
 	 */
 	void RemoveEntries(const std::string& type, bool positive);
-
-	~BanCacheManager();
 };
@@ -282,15 +282,26 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	typedef std::vector<Param> ParamList;
 
  private:
-	typedef std::vector<std::pair<SerializedInfo, SerializedMessage> > SerializedList;
+	typedef std::vector<std::pair<SerializedInfo, StreamSocket::SendQueue::Element> > SerializedList;
+	typedef std::pair<const Serializer*, intptr_t> ProfileKey;
+	typedef insp::flat_map<ProfileKey, StreamSocket::SendQueue::Element> ProfileMap;
 
 	ParamList params;
 	TagMap tags;
 	std::string command;
 	bool msginit_done;
+	/** True if all tags on the message are profile tags, only valid once msginit_done is true. */
+	bool profiletags_only;
 	mutable SerializedList serlist;
+	/** Serialized messages by serializer and tag profile, only used if profiletags_only is true. */
+	mutable ProfileMap profilemap;
 	bool sideeffect;
 
+	/** Drop the serialized messages after the tags have changed, they may have been serialized
+	 * already, e.g. when a label or batch tag is added to a message which was sent before.
+	 */
+	void CoreExport TagsChanged();
+
  protected:
 	/** Set command string.
 	 * @param cmd Command string to set.
@@ -312,6 +323,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, profiletags_only(false)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -329,6 +341,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourcestr, Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, profiletags_only(false)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -400,6 +413,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void AddTag(const std::string& tagname, MessageTagProvider* tagprov, const std::string& val, void* tagdata = NULL)
 	{
 		tags.insert(std::make_pair(tagname, MessageTagData(tagprov, val, tagdata)));
+		TagsChanged();
 	}
 
 	/** Add all tags in a TagMap to the tags in this message. Existing tags will not be overwritten.
@@ -408,15 +422,17 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void AddTags(const ClientProtocol::TagMap& newtags)
 	{
 		tags.insert(newtags.begin(), newtags.end());
+		TagsChanged();
 	}
 
 	/** Get the message in a serialized form.
 	 * @param serializeinfo Information about which exact serialized form of the message is the caller asking for
 	 * (which serializer to use and which tags to include).
 	 * @return Serialized message according to serializeinfo. The returned reference remains valid until the
-	 * next call to this method.
+	 * next call to this method. The serialized message is stored in a shared buffer so it can be added to the
+	 * send queue of every recipient without being copied.
 	 */
-	const SerializedMessage& GetSerialized(const SerializedInfo& serializeinfo) const;
+	const StreamSocket::SendQueue::Element& GetSerialized(const SerializedInfo& serializeinfo) const;
 
 	/** Clear the parameter list and tags.
 	 */
@@ -435,6 +451,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void InvalidateCache()
 	{
 		serlist.clear();
+		profilemap.clear();
 	}
 
 	void CopyAll()
@@ -574,6 +591,14 @@ class ClientProtocol::MessageTagProvider : public Events::ModuleEventListener
 	 * @return True if the tag should be sent to the user, false otherwise.
 	 */
 	virtual bool ShouldSendTag(LocalUser* user, const MessageTagData& tagdata) = 0;
+
+	/** Check whether the result of ShouldSendTag() depends on nothing but the tag itself and the tag
+	 * profile of the user (see LocalUser::tagprofile), e.g. because it only checks a capability.
+	 * Messages which only have such tags are serialized once per tag profile instead of once per recipient.
+	 * The default implementation returns false.
+	 * @return True if ShouldSendTag() only depends on the tag profile of the user, false otherwise.
+	 */
+	virtual bool IsProfileTag() const { return false; }
 };
 
 /** Base class for client protocol event hooks.
@@ -711,9 +736,10 @@ class CoreExport ClientProtocol::Serializer : public DataProvider
 	 * @param msg Message to serialize.
 	 * @return Raw serialized message, only containing the appropriate tags for the user.
 	 * The reference is guaranteed to be valid as long as the Message object is alive and until the same
-	 * Message is serialized for another user.
+	 * Message is serialized for another user. The underlying buffer is shared between all users who
+	 * receive the same serialized form of the message.
 	 */
-	const SerializedMessage& SerializeForUser(LocalUser* user, Message& msg);
+	const StreamSocket::SendQueue::Element& SerializeForUser(LocalUser* user, Message& msg);
 
 	/** Serialize a high level protocol message into wire format.
 	 * @param msg High level message to serialize. Contains all necessary information about the message, including all possible tags.
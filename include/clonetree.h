@@ -0,0 +1,131 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Counts connections by IP address in a radix tree so the number of connections from a
+ * range of any length can be looked up without keeping a separate count for every length.
+ * Every node holds the counts of the range it covers, ranges with only a single address
+ * or a single more specific range below them share the node of that address or range.
+ */
+class CoreExport CloneTree
+{
+ public:
+	/** The number of connections from an address or range. */
+	struct Counts
+	{
+		unsigned int global;
+		unsigned int local;
+		Counts() : global(0), local(0) { }
+	};
+
+	/** A range of addresses and the number of connections from it. */
+	struct Range
+	{
+		irc::sockets::cidr_mask mask;
+		Counts counts;
+	};
+
+	typedef std::vector<Range> RangeList;
+
+ private:
+	struct Node
+	{
+		/** The range covered by this node. */
+		irc::sockets::cidr_mask prefix;
+
+		/** The number of connections from the range. */
+		Counts counts;
+
+		/** The node covering the next shorter range which has more than one range below it. */
+		Node* parent;
+
+		/** The nodes below this one, indexed by the first bit after the prefix. */
+		Node* children[2];
+
+		Node(const irc::sockets::cidr_mask& mask, Node* parentnode);
+	};
+
+	/** The roots of the trees for IPv4, IPv6 and UNIX socket connections. */
+	Node root4;
+	Node root6;
+	Node rootunix;
+
+	/** Counts which are returned for ranges without any connections. */
+	const Counts zerocounts;
+
+	/** Finds the root of the tree for an address family. */
+	Node* GetRoot(unsigned char family);
+
+	/** Finds the node which holds the counts of a range.
+	 * @return The node or NULL if there are no connections from the range.
+	 */
+	Node* Find(const irc::sockets::cidr_mask& range) const;
+
+	/** Removes a node and everything below it from the tree.
+	 * The counts of the node must already have been subtracted from the nodes above it.
+	 */
+	void Unlink(Node* node);
+
+	/** Deletes all nodes below a node. */
+	static void DeleteChildren(Node* node);
+
+	// Not copyable.
+	CloneTree(const CloneTree&);
+	CloneTree& operator=(const CloneTree&);
+
+ public:
+	CloneTree();
+	~CloneTree();
+
+	/** Adds a connection.
+	 * @param addr The address of the connection.
+	 * @param local True if the connection is to this server.
+	 */
+	void Add(const irc::sockets::sockaddrs& addr, bool local);
+
+	/** Removes a connection added with Add().
+	 * @param addr The address of the connection.
+	 * @param local True if the connection is to this server.
+	 */
+	void Remove(const irc::sockets::sockaddrs& addr, bool local);
+
+	/** Removes all connections from a range.
+	 * @param range The range to remove the connections of.
+	 */
+	void Erase(const irc::sockets::cidr_mask& range);
+
+	/** Removes all connections. */
+	void Clear();
+
+	/** Retrieves the number of connections from a range.
+	 * @param range The range to look up, this can have any length.
+	 * @return The counts of the range. The returned reference is volatile - you must assume that
+	 * it becomes invalid as soon as a connection is added or removed.
+	 */
+	const Counts& Get(const irc::sockets::cidr_mask& range) const;
+
+	/** Finds the ranges with the most connections. The ranges are found in descending order of
+	 * connections so only the ranges which are returned are visited.
+	 * @param ipv4len The length of the IPv4 ranges to count.
+	 * @param ipv6len The length of the IPv6 ranges to count.
+	 * @param mincount The minimum number of connections a range has to have.
+	 * @param max The maximum number of ranges to find or 0 for no limit.
+	 * @param out The list to append the ranges to.
+	 */
+	void GetTop(unsigned char ipv4len, unsigned char ipv6len, unsigned int mincount, size_t max, RangeList& out) const;
+};
@@ -37,6 +37,26 @@ class CoreExport CommandParser
  	typedef TR1NS::unordered_map<std::string, Command*, irc::insensitive, irc::StrHashComp> CommandMap;
 
  private:
+	/** Commands which are looked up without hashing their name as nearly every line a client sends is one of them.
+	 */
+	enum FastCommand
+	{
+		FAST_JOIN,
+		FAST_MODE,
+		FAST_NOTICE,
+		FAST_PING,
+		FAST_PONG,
+		FAST_PRIVMSG,
+		FAST_WHO,
+		FAST_MAX
+	};
+
+	/** Find the slot of a command in fastcmds.
+	 * @param commandname The uppercase name of the command.
+	 * @return The FastCommand slot of the command or -1 if the command is not one of them.
+	 */
+	static int FindFastSlot(const std::string& commandname);
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for.
 	 * @param command The name of the command.
@@ -48,6 +68,10 @@ class CoreExport CommandParser
 	 */
 	CommandMap cmdlist;
 
+	/** Handlers of the commands in FastCommand, NULL if a command is not loaded. These are also in cmdlist.
+	 */
+	Command* fastcmds[FAST_MAX];
+
  public:
 	/** Default constructor.
 	 */
@@ -377,6 +377,9 @@ class CoreExport ServerConfig
 	/** The number of seconds that the server clock can skip by before server operators are warned. */
 	time_t TimeSkipWarn;
 
+	/** The maximum number of entries in the ban cache. */
+	unsigned long BanCacheSize;
+
 	/** True if we're going to hide ban reasons for non-opers (e.g. G-lines,
 	 * K-lines, Z-lines)
 	 */
@@ -133,6 +133,9 @@ class Events::ModuleEventListener : private dynamic_reference_base::CaptureHook
  public:
 	static const unsigned int DefaultPriority = 100;
 
+	/** Call statistics of this listener, shown in /STATS h. */
+	HookStats hookstats;
+
 	/** Constructor
 	 * @param mod Module subscribing
 	 * @param eventid Identifier of the event to subscribe to
@@ -159,6 +162,9 @@ class Events::ModuleEventListener : private dynamic_reference_base::CaptureHook
 
 	/** Retrieves the priority of this event. */
 	unsigned int GetPriority() const { return eventpriority; }
+
+	/** Retrieves the identifier of the event this listener is subscribed to. */
+	const std::string& GetEventName() const { return prov.GetProvider(); }
 };
 
 inline bool Events::ModuleEventProvider::Comp::operator()(Events::ModuleEventListener* lhs, Events::ModuleEventListener* rhs) const
@@ -175,6 +181,21 @@ inline bool Events::ModuleEventProvider::ElementComp::operator()(Events::ModuleE
 	return std::less<ModuleEventListener*>()(lhs, rhs);
 }
 
+/** Calls a hook in all of the listeners of an event provider, used by FOREACH_MOD_CUSTOM.
+ * @param timer A statement which starts measuring the call or an empty statement.
+ */
+#define FOREACH_MOD_CUSTOM_LOOP(listenerclass, func, params, timer) \
+	for (::Events::ModuleEventProvider::SubscriberList::const_iterator _i = _handlers.begin(); _i != _handlers.end(); ++_i) \
+	{ \
+		listenerclass* _t = static_cast<listenerclass*>(*_i); \
+		const Module* _m = _t->GetModule(); \
+		if (_m && !_m->dying) \
+		{ \
+			timer \
+			_t->func params ; \
+		} \
+	}
+
 /**
  * Run the given hook provided by a module
  *
@@ -182,14 +203,27 @@ inline bool Events::ModuleEventProvider::ElementComp::operator()(Events::ModuleE
  */
 #define FOREACH_MOD_CUSTOM(prov, listenerclass, func, params) do { \
 	const ::Events::ModuleEventProvider::SubscriberList& _handlers = (prov).GetSubscribers(); \
+	if (HookTimer::profile) \
+		FOREACH_MOD_CUSTOM_LOOP(listenerclass, func, params, HookTimer _timer(&_t->hookstats);) \
+	else \
+		FOREACH_MOD_CUSTOM_LOOP(listenerclass, func, params, ;) \
+} while (0);
+
+/** Calls a hook in the listeners of an event provider until one of them returns a result, used by FIRST_MOD_RESULT_CUSTOM.
+ * @param timer A statement which starts measuring the call or an empty statement.
+ */
+#define FIRST_MOD_RESULT_CUSTOM_LOOP(listenerclass, func, result, params, timer) \
 	for (::Events::ModuleEventProvider::SubscriberList::const_iterator _i = _handlers.begin(); _i != _handlers.end(); ++_i) \
 	{ \
 		listenerclass* _t = static_cast<listenerclass*>(*_i); \
 		const Module* _m = _t->GetModule(); \
-		if (_m && !_m->dying) \
-			_t->func params ; \
-	} \
-} while (0);
+		if (!_m || _m->dying) \
+			continue; \
+		timer \
+		result = _t->func params ; \
+		if (result != MOD_RES_PASSTHRU) \
+			break; \
+	}
 
 /**
  * Run the given hook provided by a module until some module returns MOD_RES_ALLOW or MOD_RES_DENY.
@@ -201,14 +235,8 @@ inline bool Events::ModuleEventProvider::ElementComp::operator()(Events::ModuleE
 #define FIRST_MOD_RESULT_CUSTOM(prov, listenerclass, func, result, params) do { \
 	result = MOD_RES_PASSTHRU; \
 	const ::Events::ModuleEventProvider::SubscriberList& _handlers = (prov).GetSubscribers(); \
-	for (::Events::ModuleEventProvider::SubscriberList::const_iterator _i = _handlers.begin(); _i != _handlers.end(); ++_i) \
-	{ \
-		listenerclass* _t = static_cast<listenerclass*>(*_i); \
-		const Module* _m = _t->GetModule(); \
-		if (!_m || _m->dying) \
-			continue; \
-		result = _t->func params ; \
-		if (result != MOD_RES_PASSTHRU) \
-			break; \
-	} \
+	if (HookTimer::profile) \
+		FIRST_MOD_RESULT_CUSTOM_LOOP(listenerclass, func, result, params, HookTimer _timer(&_t->hookstats);) \
+	else \
+		FIRST_MOD_RESULT_CUSTOM_LOOP(listenerclass, func, result, params, ;) \
 } while (0);
@@ -88,9 +88,9 @@ struct fakederef
 #include "numeric.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
@@ -142,6 +142,15 @@ class serverstats
 	 * due to timeouts and other latency issues.
 	 */
 	unsigned long DnsBad;
+	/** Number of DNS queries answered from the cache
+	 */
+	unsigned long DnsCacheHits;
+	/** Number of DNS queries which were not in the cache
+	 */
+	unsigned long DnsCacheMisses;
+	/** Number of DNS cache entries removed to make room for new ones
+	 */
+	unsigned long DnsCacheEvictions;
 	/** Number of inbound connections seen
 	 */
 	unsigned long Connects;
@@ -173,7 +182,8 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), DnsCacheHits(0), DnsCacheMisses(0), DnsCacheEvictions(0),
+		Connects(0), Sent(0), Recv(0)
 	{
 	}
 };
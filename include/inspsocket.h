@@ -31,6 +31,7 @@
 #include "timer.h"
 
 class IOHook;
+class IOHookMiddle;
 
 /**
  * States which a socket may be in
@@ -106,6 +107,57 @@ class CoreExport SocketTimeout : public Timer
 	bool Tick(time_t now) CXX11_OVERRIDE;
 };
 
+/** Splits lines off the front of a receive queue. The lines are not copied out of the
+ * queue and the data which has been read is removed from the queue in one go when the
+ * reader is destroyed, so a read which holds many lines does not move the rest of the
+ * queue once for every line.
+ */
+class CoreExport RecvQLineReader
+{
+ private:
+	/** The receive queue which lines are read from. */
+	std::string& recvq;
+
+	/** The position in the receive queue of the first byte which has not been read yet. */
+	std::string::size_type pos;
+
+ public:
+	/** The start of the most recently read line, only valid until the receive queue is changed. */
+	const char* line;
+
+	/** The length of the most recently read line, not including the delimiter. */
+	size_t length;
+
+	/** Create a reader for a receive queue.
+	 * @param rq The receive queue to read lines from.
+	 */
+	RecvQLineReader(std::string& rq)
+		: recvq(rq)
+		, pos(0)
+		, line(NULL)
+		, length(0)
+	{
+	}
+
+	~RecvQLineReader()
+	{
+		Compact();
+	}
+
+	/** Read the next line from the receive queue into line and length.
+	 * @param delim The line delimiter.
+	 * @param skip The number of unread bytes which are already known not to contain the delimiter.
+	 * @return True if a line was read, false if the unread data does not contain a delimiter.
+	 */
+	bool GetNextLine(char delim = '\n', size_t skip = 0);
+
+	/** Retrieves the number of bytes in the receive queue which have not been read yet. */
+	size_t GetUnreadSize() const { return recvq.size() - pos; }
+
+	/** Remove the data which has been read from the receive queue. */
+	void Compact();
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
@@ -118,9 +170,118 @@ class CoreExport StreamSocket : public EventHandler
 	class SendQueue
 	{
 	 public:
-		/** One element of the queue, a continuous buffer
+		/** An immutable, reference counted buffer. A single buffer can be referenced
+		 * by the send queues of many sockets at once, e.g. when the same serialized
+		 * message is sent to every member of a channel.
 		 */
-		typedef std::string Element;
+		class Buffer : public refcountbase
+		{
+		 public:
+			/** The contents of the buffer. */
+			const std::string data;
+
+			/** Create a new buffer.
+			 * @param str The contents of the buffer.
+			 */
+			Buffer(const std::string& str)
+				: data(str)
+			{
+			}
+		};
+
+		/** One element of the queue, a continuous slice of a (possibly shared) buffer
+		 */
+		class Element
+		{
+		 public:
+			typedef std::string::size_type size_type;
+			typedef const char* const_iterator;
+
+			/** Create a new element which refers to a new buffer containing a copy of the given data.
+			 * @param str Data to copy into the new buffer.
+			 */
+			Element(const std::string& str)
+				: buffer(new Buffer(str))
+				, offset(0)
+				, stop(str.length())
+			{
+			}
+
+			/** Create a new element which refers to a new buffer containing a copy of the given data.
+			 * @param str Data to copy into the new buffer.
+			 * @param len Length of the data.
+			 */
+			Element(const char* str, size_type len)
+				: buffer(new Buffer(std::string(str, len)))
+				, offset(0)
+				, stop(len)
+			{
+			}
+
+			/** Create a new element which refers to an existing buffer.
+			 * @param buf Buffer to refer to.
+			 */
+			explicit Element(const Buffer* buf)
+				: buffer(buf)
+				, offset(0)
+				, stop(buf->data.length())
+			{
+			}
+
+			/** Create a new element which refers to a part of an existing buffer.
+			 * @param buf Buffer to refer to.
+			 * @param pos Offset within the buffer of the first byte of the element.
+			 * @param len Number of bytes in the element.
+			 */
+			Element(const Buffer* buf, size_type pos, size_type len)
+				: buffer(buf)
+				, offset(pos)
+				, stop(pos + len)
+			{
+			}
+
+			/** Retrieves a pointer to the first unsent byte of this element. */
+			const char* data() const { return buffer->data.data() + offset; }
+
+			/** Retrieves the number of unsent bytes in this element. */
+			size_type length() const { return stop - offset; }
+
+			/** @copydoc length */
+			size_type size() const { return length(); }
+
+			/** Determines whether there are no unsent bytes in this element. */
+			bool empty() const { return length() == 0; }
+
+			/** Retrieves an iterator to the first unsent byte of this element. */
+			const_iterator begin() const { return data(); }
+
+			/** Retrieves an iterator to one past the last byte of this element. */
+			const_iterator end() const { return buffer->data.data() + stop; }
+
+			/** Retrieves the buffer this element refers to. */
+			const Buffer* GetBuffer() const { return buffer; }
+
+			/** Creates an element which refers to a part of this element without copying any data.
+			 * @param pos Offset of the first byte of the new element relative to the first unsent byte of this element.
+			 * @param len Number of bytes in the new element.
+			 */
+			Element substr(size_type pos, size_type len) const { return Element(buffer, offset + pos, len); }
+
+			/** Removes bytes from the beginning of this element without modifying the underlying buffer.
+			 * @param n Number of bytes to remove.
+			 */
+			void remove_prefix(size_type n) { offset += n; }
+
+		 private:
+			/** The buffer this element is a slice of. */
+			reference<const Buffer> buffer;
+
+			/** The offset within the buffer of the first unsent byte. */
+			size_type offset;
+
+			/** The offset within the buffer of the byte after the last byte of this element. */
+			size_type stop;
+		};
 
 		/** Sequence container of buffers in the queue
 		 */
@@ -178,7 +339,7 @@ class CoreExport StreamSocket : public EventHandler
 		void erase_front(Element::size_type n)
 		{
 			nbytes -= n;
-			data.front().erase(0, n);
+			data.front().remove_prefix(n);
 		}
 
 		/** Insert a new buffer at the beginning of the queue
@@ -215,7 +376,7 @@ class CoreExport StreamSocket : public EventHandler
 		}
 
 	 private:
-	 	/** Private send queue. Note that individual strings may be shared.
+	 	/** Private send queue. Note that individual buffers may be shared.
 		 */
 		Container data;
 
@@ -301,6 +462,12 @@ class CoreExport StreamSocket : public EventHandler
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
 
+	/** Add a hook in front of all other hooks of this socket. It will be the first hook to see
+	 * the data written to the socket and the last one to see the data read from it.
+	 * @param hook The hook to add.
+	 */
+	void AddIOHookFront(IOHookMiddle* hook);
+
 	/** Flush the send queue
 	 */
 	void DoWrite();
@@ -339,6 +506,12 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+
+	/** Send the given (possibly shared) buffer out the socket, either now or when writes unblock.
+	 * Unlike WriteData(const std::string&) this does not copy the data.
+	 * @param data Data to send.
+	 */
+	void WriteData(const SendQueue::Element& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
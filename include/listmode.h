@@ -42,15 +42,34 @@ class CoreExport ListModeBase : public ModeHandler
 	typedef std::vector<ListItem> ModeList;
 
  private:
+	/** The entries of a list compiled for matching users against them, see MatchUser().
+	 */
+	class Matcher;
+
 	class ChanData
 	{
 	public:
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** The compiled list or NULL if the list changed since it was last compiled.
+		 */
+		Matcher* matcher;
+
+		ChanData() : maxitems(-1), matcher(NULL) { }
+		~ChanData();
+
+		/** Throws away the compiled list, called whenever the list changes.
+		 */
+		void ResetMatcher();
 	};
 
+	/** Returns the compiled list of the given channel, compiling it if needed.
+	 * @param cd The ChanData of the channel
+	 * @return The compiled list
+	 */
+	Matcher* GetMatcher(ChanData* cd);
+
 	/** The number of items a listmode's list may contain
 	 */
 	struct ListLimit
@@ -141,6 +160,47 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Determines whether a user matches an entry of the list on the given channel, the way
+	 * entries of the ban list match users. Only the nick!ident\@host matching done by the core
+	 * is performed, modules are not consulted. The list is compiled into indexes by host, IP
+	 * range and wildcard suffix the first time it is checked after a change.
+	 * @param channel The channel to check the list of
+	 * @param user The user to match against the list
+	 * @param type If zero, the entries which are hostmasks are checked. Otherwise the masks of
+	 * the extbans of this type are checked, e.g. the "*!*\@host" in "m:*!*\@host" for 'm'.
+	 * @return True if the user matches at least one entry, false otherwise
+	 */
+	bool MatchUser(Channel* channel, User* user, char type = 0);
+
+	/** Determines whether a nick!ident and a host which is not one of the hosts of the user, such
+	 * as a cloak, match an entry of the list on the given channel. Unlike MatchUser() the host is
+	 * only matched as a hostname, IP ranges are not checked.
+	 * @param channel The channel to check the list of
+	 * @param nickident The nick!ident to match against the list
+	 * @param host The host to match against the list
+	 * @param type If zero, the entries which are hostmasks are checked. Otherwise the masks of
+	 * the extbans of this type are checked, like in MatchUser().
+	 * @return True if the nick!ident and host match at least one entry, false otherwise
+	 */
+	bool MatchHost(Channel* channel, const std::string& nickident, const std::string& host, char type = 0);
+
+	/** Retrieves the extbans on the list of the given channel. These are the entries which only
+	 * modules can match, MatchUser() checks the rest.
+	 * @param channel The channel to get the extbans of
+	 * @param type If zero, every extban is returned as it is on the list, e.g. "R:account".
+	 * Otherwise the masks of the extbans of this type are returned, e.g. "R:account" for
+	 * "m:R:account" if the type is 'm'.
+	 * @return The extbans of the list, empty if there are none
+	 */
+	const std::vector<std::string>& GetExtBans(Channel* channel, char type = 0);
+
+	/** Retrieves a number which changes every time the result of MatchUser() for the given
+	 * channel may change for a user, i.e. whenever the list is recompiled.
+	 * @param channel The channel to get the match serial of
+	 * @return The match serial of the list or 0 if the channel has no list of this type
+	 */
+	unsigned long GetMatchSerial(Channel* channel);
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -57,6 +57,19 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 */
 	Id id;
 
+	/** Whether the user matched the ban list of the channel when it was last checked, only valid
+	 * while banserial and banuserserial are unchanged. See Channel::IsBanned().
+	 */
+	bool banned;
+
+	/** Match serial of the ban list when banned was last computed.
+	 */
+	unsigned long banserial;
+
+	/** Cache serial of the user when banned was last computed.
+	 */
+	unsigned long banuserserial;
+
 	/** Converts a string to a Membership::Id
 	 * @param str The string to convert
 	 * @return Raw value of type Membership::Id
@@ -71,7 +84,14 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 * Call Channel::JoinUser() or ForceJoin() to make a user join a channel instead of constructing
 	 * Membership objects directly.
 	 */
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c)
+		: user(u)
+		, chan(c)
+		, banned(false)
+		, banserial(0)
+		, banuserserial(0)
+	{
+	}
 
 	/** Check if this member has a given prefix mode set
 	 * @param pm Prefix mode to check
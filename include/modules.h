@@ -128,26 +128,38 @@ class ModResult
 	}
 };
 
-/**
- * This #define allows us to call a method in all
- * loaded modules in a readable simple way, e.g.:
- * 'FOREACH_MOD(OnConnect,(user));'
+/** Calls a method in all loaded modules, used by FOREACH_MOD.
+ * @param timer A statement which starts measuring the call or an empty statement.
  */
-#define FOREACH_MOD(y,x) do { \
-	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## y]; \
+#define FOREACH_MOD_LOOP(y,x,timer) \
 	for (Module::List::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
 		try \
 		{ \
 			if (!(*_i)->dying) \
+			{ \
+				timer \
 				(*_i)->y x ; \
+			} \
 		} \
 		catch (CoreException& modexcept) \
 		{ \
 			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason()); \
 		} \
-	} \
+	}
+
+/**
+ * This #define allows us to call a method in all
+ * loaded modules in a readable simple way, e.g.:
+ * 'FOREACH_MOD(OnConnect,(user));'
+ */
+#define FOREACH_MOD(y,x) do { \
+	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## y]; \
+	if (HookTimer::profile) \
+		FOREACH_MOD_LOOP(y, x, HookTimer _timer(&(*_i)->hookstats[I_ ## y]);) \
+	else \
+		FOREACH_MOD_LOOP(y, x, ;) \
 } while (0);
 
 /**
@@ -159,13 +171,16 @@ class ModResult
 #define DO_EACH_HOOK(n,v,args) \
 do { \
 	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## n]; \
+	const bool _profile = HookTimer::profile; \
 	for (Module::List::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
 		try \
 		{ \
-			if (!(*_i)->dying) \
-				v = (*_i)->n args;
+			if ((*_i)->dying) \
+				continue; \
+			HookTimer _timer(_profile ? &(*_i)->hookstats[I_ ## n] : NULL); \
+			v = (*_i)->n args;
 
 #define WHILE_EACH_HOOK(n) \
 		} \
@@ -176,6 +191,28 @@ do { \
 	} \
 } while(0)
 
+/** Calls a method in all loaded modules until one of them returns a result, used by FIRST_MOD_RESULT.
+ * @param timer A statement which starts measuring the call or an empty statement.
+ */
+#define FIRST_MOD_RESULT_LOOP(n,v,args,timer) \
+	for (Module::List::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
+	{ \
+		_next = _i+1; \
+		try \
+		{ \
+			if ((*_i)->dying) \
+				continue; \
+			timer \
+			v = (*_i)->n args; \
+			if (v != MOD_RES_PASSTHRU) \
+				break; \
+		} \
+		catch (CoreException& except_ ## n) \
+		{ \
+			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + (except_ ## n).GetReason()); \
+		} \
+	}
+
 /**
  * Module result iterator
  * Runs the given hook until some module returns a useful result.
@@ -185,12 +222,11 @@ do { \
  */
 #define FIRST_MOD_RESULT(n,v,args) do { \
 	v = MOD_RES_PASSTHRU; \
-	DO_EACH_HOOK(n,v,args) \
-	{ \
-		if (v != MOD_RES_PASSTHRU) \
-			break; \
-	} \
-	WHILE_EACH_HOOK(n); \
+	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## n]; \
+	if (HookTimer::profile) \
+		FIRST_MOD_RESULT_LOOP(n, v, args, HookTimer _timer(&(*_i)->hookstats[I_ ## n]);) \
+	else \
+		FIRST_MOD_RESULT_LOOP(n, v, args, ;) \
 } while (0)
 
 /** Holds a module's Version information.
@@ -305,9 +341,62 @@ enum Implementation
 	I_OnUserQuit,
 	I_OnUserRegister,
 	I_OnUserWrite,
+	I_OnUserWriteReady,
 	I_END
 };
 
+/** Statistics about the calls of a module hook or event listener, shown in /STATS h.
+ */
+struct CoreExport HookStats
+{
+	/** The number of times the hook was called. */
+	unsigned long calls;
+
+	/** The total time spent in the hook in nanoseconds. */
+	unsigned long long time;
+
+	HookStats()
+		: calls(0)
+		, time(0)
+	{
+	}
+};
+
+/** Counts a call of a module hook and adds the time until it goes out of scope.
+ * Used by FOREACH_MOD and friends when HookTimer::profile is true.
+ */
+class CoreExport HookTimer
+{
+	/** The statistics of the hook being called or NULL if the call isn't being measured. */
+	HookStats* const stats;
+
+	/** The time at which the call started. */
+	const unsigned long long start;
+
+ public:
+	/** Whether to measure the calls of hooks, set from \<performance:hookstats>. */
+	static bool profile;
+
+	HookTimer(HookStats* hookstats)
+		: stats(hookstats)
+		, start(hookstats ? Now() : 0)
+	{
+		if (stats)
+			stats->calls++;
+	}
+
+	~HookTimer()
+	{
+		if (stats)
+			stats->time += Now() - start;
+	}
+
+	/** Get the current time of a monotonic clock.
+	 * @return The current time in nanoseconds.
+	 */
+	static unsigned long long Now();
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -337,6 +426,17 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** If true, OnCheckBan() of this module only has to be called for the extbans when checking the
+	 * ban list of a channel in Channel::IsBanned(), e.g. because it only matches extbans. When any
+	 * module implementing OnCheckBan() leaves this false every entry is passed to it. Set this in
+	 * the constructor of the module.
+	 */
+	bool checkbanextbansonly;
+
+	/** Call statistics of the hooks of this module, indexed by Implementation.
+	 */
+	HookStats hookstats[I_END];
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -361,6 +461,12 @@ class CoreExport Module : public classbase, public usecountbase
 	/** Called when the hooks provided by a module need to be prioritised. */
 	virtual void Prioritize() { }
 
+	/** Called before the module is unloaded or reloaded to check whether it can be at the moment.
+	 * @param reason The reason the module can not be unloaded, shown to the user trying to unload it.
+	 * @return True if the module can be unloaded, false otherwise.
+	 */
+	virtual bool CanUnload(std::string& reason) { return true; }
+
 	/** This method is called when you should reload module specific configuration:
 	 * on boot, on a /REHASH and on module load.
 	 * @param status The current status, can be inspected for more information;
@@ -913,7 +1019,8 @@ class CoreExport Module : public classbase, public usecountbase
 	virtual ModResult OnCheckChannelBan(User* user, Channel* chan);
 
 	/**
-	 * Checks for a user's match of a single ban
+	 * Checks for a user's match of a single ban. When checking the ban list of a channel this
+	 * is only called for the extbans if every module implementing it sets checkbanextbansonly.
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
@@ -1030,6 +1137,13 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual ModResult OnUserWrite(LocalUser* user, ClientProtocol::Message& msg);
 
+	/** Called after the send queue of a local user has been written to their socket.
+	 * Modules which send a large reply in parts can use this to send the next part once
+	 * enough of the previous parts have been sent.
+	 * @param user The user whose send queue was written.
+	 */
+	virtual void OnUserWriteReady(LocalUser* user);
+
 	/** Called when a user connection has been unexpectedly disconnected.
 	 * @param user The user who has been unexpectedly disconnected.
 	 * @param error The type of error which caused this connection failure.
@@ -1156,6 +1270,12 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	 */
 	bool Attach(Implementation i, Module* mod);
 
+	/** Get the name of a hook.
+	 * @param hook The hook to get the name of.
+	 * @return The name of the hook as used in the Module class, e.g. "OnUserPreMessage".
+	 */
+	static const char* GetHookName(Implementation hook);
+
 	/** Detach an event from a module.
 	 * This is not required when your module unloads, as the core will
 	 * automatically detach your module from all events it is attached to.
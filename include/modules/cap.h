@@ -211,7 +211,13 @@ namespace Cap
 			if (!IsRegistered())
 				return;
 			Ext curr = extitem->get(user);
-			extitem->set(user, (val ? AddToMask(curr) : DelFromMask(curr)));
+			Ext caps = (val ? AddToMask(curr) : DelFromMask(curr));
+			extitem->set(user, caps);
+
+			// The message tags a user receives depend on their caps
+			LocalUser* const localuser = IS_LOCAL(user);
+			if (localuser)
+				localuser->tagprofile = caps;
 		}
 
 		/** Activate or deactivate the capability.
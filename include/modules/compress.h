@@ -0,0 +1,209 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "iohook.h"
+
+namespace Compress
+{
+	class Hook;
+	class HookProvider;
+	class MessageStream;
+	struct Stats;
+}
+
+/** Statistics about the data which was compressed or decompressed in one direction. */
+struct Compress::Stats
+{
+	/** The number of bytes before compression or after decompression. */
+	unsigned long long plain;
+
+	/** The number of bytes after compression or before decompression. */
+	unsigned long long compressed;
+
+	/** The time spent compressing or decompressing in nanoseconds. */
+	unsigned long long time;
+
+	Stats()
+		: plain(0)
+		, compressed(0)
+		, time(0)
+	{
+	}
+};
+
+/** An IOHook which compresses the data written to a socket and decompresses the data read from it.
+ * The hook starts out passing data through unchanged in both directions, each direction is switched
+ * to compression separately by the protocol using the hook at a point both ends agreed on.
+ */
+class Compress::Hook : public IOHookMiddle
+{
+ public:
+	/** Statistics about the data which went through the hook in one direction. */
+	typedef Compress::Stats Stats;
+
+ protected:
+	/** Statistics about the data written to the socket. */
+	Stats outstats;
+
+	/** Statistics about the data read from the socket. */
+	Stats instats;
+
+	/** Whether the data written to the socket is being compressed. */
+	bool compressing;
+
+	/** Whether the data read from the socket is being decompressed. */
+	bool decompressing;
+
+ public:
+	Hook(IOHookProvider* hookprov)
+		: IOHookMiddle(hookprov)
+		, compressing(false)
+		, decompressing(false)
+	{
+	}
+
+	/** Start compressing the data written to the socket. Data which has already been written to the
+	 * socket but is still in its send queue is sent uncompressed.
+	 * @param sock The socket this hook is attached to.
+	 */
+	virtual void StartCompression(StreamSocket* sock) = 0;
+
+	/** Start decompressing the data read from the socket.
+	 * @param sock The socket this hook is attached to.
+	 * @param data Data which has already been read from the socket but has not been processed yet. It is
+	 * replaced with the decompressed data.
+	 * @return True if the data was decompressed, false if it is not valid compressed data.
+	 */
+	virtual bool StartDecompression(StreamSocket* sock, std::string& data) = 0;
+
+	/** Determines whether the data written to the socket is being compressed. */
+	bool IsCompressing() const { return compressing; }
+
+	/** Determines whether the data read from the socket is being decompressed. */
+	bool IsDecompressing() const { return decompressing; }
+
+	/** Retrieves statistics about the data written to the socket. */
+	const Stats& GetOutStats() const { return outstats; }
+
+	/** Retrieves statistics about the data read from the socket. */
+	const Stats& GetInStats() const { return instats; }
+
+	/** Retrieves the name of the compression method used by this hook. */
+	const std::string& GetMethod() const;
+};
+
+/** Compresses and decompresses the separate messages of a protocol which frames messages itself, e.g.
+ * the permessage-deflate extension of WebSocket. Unlike a Hook this does not touch the socket at all,
+ * the protocol passes the payload of every message through the stream. The data is a raw deflate
+ * stream without any header, every compressed message ends with a sync flush.
+ */
+class Compress::MessageStream
+{
+ protected:
+	/** Statistics about the compressed messages. */
+	Stats outstats;
+
+	/** Statistics about the decompressed messages. */
+	Stats instats;
+
+ public:
+	/** The module which created this stream, the stream must be deleted before it is unloaded. */
+	Module* const creator;
+
+	MessageStream(Module* mod)
+		: creator(mod)
+	{
+	}
+
+	virtual ~MessageStream() { }
+
+	/** Compresses a message.
+	 * @param data The message to compress.
+	 * @param length The length of the message.
+	 * @param out The string to append the compressed message to, this ends with a sync flush.
+	 * @return True on success, false on error.
+	 */
+	virtual bool Compress(const char* data, size_t length, std::string& out) = 0;
+
+	/** Decompresses a part of a message.
+	 * @param data The compressed data.
+	 * @param length The length of the compressed data.
+	 * @param maxlength The maximum number of bytes the data may decompress to.
+	 * @param out The string to append the decompressed data to.
+	 * @return True on success, false if the data is invalid or decompresses to more than maxlength bytes.
+	 */
+	virtual bool Decompress(const char* data, size_t length, size_t maxlength, std::string& out) = 0;
+
+	/** Forgets the messages compressed so far so the next message does not refer to them. */
+	virtual void ResetCompression() = 0;
+
+	/** Forgets the messages decompressed so far, must be called when the remote end resets its compression. */
+	virtual void ResetDecompression() = 0;
+
+	/** Retrieves statistics about the compressed messages. */
+	const Stats& GetOutStats() const { return outstats; }
+
+	/** Retrieves statistics about the decompressed messages. */
+	const Stats& GetInStats() const { return instats; }
+};
+
+/** Provides compression hooks using a specific compression method. */
+class Compress::HookProvider : public IOHookProvider
+{
+ public:
+	/** The name of the compression method, e.g. "zlib". */
+	const std::string method;
+
+	HookProvider(Module* mod, const std::string& Method)
+		: IOHookProvider(mod, "compress/" + Method, IOHookProvider::IOH_UNKNOWN, true)
+		, method(Method)
+	{
+	}
+
+	/** Add a new compression hook in front of all other hooks of a socket.
+	 * @param sock The socket to add the hook to.
+	 * @return The new hook which does not compress anything until told to or NULL if it could
+	 * not be created, in which case an error is set on the socket.
+	 */
+	virtual Hook* AddHook(StreamSocket* sock) = 0;
+
+	/** Create a stream which compresses separate messages.
+	 * @param compressbits The base two logarithm of the window size used for compressing, from 9 to 15.
+	 * @param decompressbits The base two logarithm of the window size used for decompressing, from 9 to 15.
+	 * @return The new stream or NULL if the compression method does not support raw deflate streams.
+	 */
+	virtual MessageStream* CreateMessageStream(unsigned int compressbits, unsigned int decompressbits) { return NULL; }
+
+	/** Compression has to be negotiated by the protocol which uses it so it can not be
+	 * enabled on a listener or an outgoing connection directly.
+	 */
+	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
+	{
+	}
+
+	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE
+	{
+	}
+};
+
+inline const std::string& Compress::Hook::GetMethod() const
+{
+	IOHookProvider* hookprov = prov;
+	return static_cast<HookProvider*>(hookprov)->method;
+}
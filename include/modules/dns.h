@@ -32,6 +32,8 @@ namespace DNS
 		QUERY_A = 1,
 		/* A CNAME lookup */
 		QUERY_CNAME = 5,
+		/* Start of authority, returned with negative answers */
+		QUERY_SOA = 6,
 		/* Reverse DNS lookup */
 		QUERY_PTR = 12,
 		/* TXT */
@@ -77,6 +77,11 @@ class IRCv3::CapTag : public ClientProtocol::MessageTagProvider
 		return cap.get(user);
 	}
 
+	bool IsProfileTag() const CXX11_OVERRIDE
+	{
+		return true;
+	}
+
 	void OnPopulateTags(ClientProtocol::Message& msg) CXX11_OVERRIDE
 	{
 		T& tag = static_cast<T&>(*this);
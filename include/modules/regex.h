@@ -48,12 +48,38 @@ public:
 	}
 };
 
+/** A set of regular expressions which are all matched against a text at once. */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Finds the expressions in the set which match a text.
+	 * @param text The text to match the expressions against.
+	 * @param matches Filled with the indexes of the matching expressions in the vector the
+	 * set was created from, in ascending order.
+	 * @return True if at least one expression matched, false otherwise.
+	 */
+	virtual bool Matches(const std::string& text, std::vector<size_t>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Compiles a set of expressions which can be matched against a text in one pass.
+	 * @param exprs The expressions to compile.
+	 * @return A set of the expressions which must be deleted by the caller, or NULL if this
+	 * engine can not match multiple expressions at once.
+	 * @throw RegexException if any of the expressions is invalid.
+	 */
+	virtual RegexSet* CreateSet(const std::vector<std::string>& exprs)
+	{
+		return NULL;
+	}
 };
 
 class RegexException : public ModuleException
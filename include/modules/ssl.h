@@ -176,7 +176,8 @@ class SSLIOHook : public IOHook
 		tmp.reserve(std::min(targetsize, sendq.bytes())+1);
 		do
 		{
-			tmp.append(sendq.front());
+			const StreamSocket::SendQueue::Element& elem = sendq.front();
+			tmp.append(elem.data(), elem.length());
 			sendq.pop_front();
 		}
 		while (!sendq.empty() && tmp.length() < targetsize);
@@ -234,6 +235,152 @@ class SSLIOHook : public IOHook
 	virtual bool GetServerName(std::string& out) const = 0;
 };
 
+/** Work on a TLS (SSL) session which is done on a thread of an SSLWorkerPool.
+ * While the job is queued or running the session belongs to the worker and the
+ * IO hook must not use it.
+ */
+class SSLWorkerJob
+{
+ public:
+	virtual ~SSLWorkerJob() { }
+
+	/** Called on a worker thread to do the work. This must not touch anything
+	 * which belongs to the main thread such as sockets or the socket engine.
+	 */
+	virtual void Run() = 0;
+
+	/** Called on the main thread after Run() has returned. */
+	virtual void Finish() = 0;
+};
+
+/** A pool of threads which run TLS (SSL) handshakes off the main thread so that
+ * expensive key exchanges, for example during a reconnect storm after a netsplit,
+ * do not stall every other connection.
+ */
+class SSLWorkerPool
+{
+	class Worker : public SocketThread
+	{
+		typedef std::deque<SSLWorkerJob*> JobQueue;
+
+		/** Jobs waiting to be run, protected by the queue lock. */
+		JobQueue jobs;
+
+		/** Jobs which have been run but not finished, protected by the queue lock. */
+		JobQueue done;
+
+	 public:
+		void Submit(SSLWorkerJob* job)
+		{
+			LockQueue();
+			jobs.push_back(job);
+			UnlockQueueWakeup();
+		}
+
+		void Run() CXX11_OVERRIDE
+		{
+			LockQueue();
+			while (!GetExitFlag())
+			{
+				if (jobs.empty())
+				{
+					WaitForQueue();
+					continue;
+				}
+
+				SSLWorkerJob* job = jobs.front();
+				jobs.pop_front();
+				UnlockQueue();
+
+				job->Run();
+
+				LockQueue();
+				done.push_back(job);
+				NotifyParent();
+			}
+			UnlockQueue();
+		}
+
+		void OnNotify() CXX11_OVERRIDE
+		{
+			// Take all results at once so that the workers are not held up while they are finished
+			JobQueue finished;
+			LockQueue();
+			finished.swap(done);
+			UnlockQueue();
+
+			for (JobQueue::iterator i = finished.begin(); i != finished.end(); ++i)
+				(*i)->Finish();
+		}
+
+		/** Stop the thread and complete every job it was given on the main thread. */
+		void Stop()
+		{
+			join();
+			OnNotify();
+			for (JobQueue::iterator i = jobs.begin(); i != jobs.end(); ++i)
+			{
+				(*i)->Run();
+				(*i)->Finish();
+			}
+			jobs.clear();
+		}
+	};
+
+	typedef std::vector<Worker*> WorkerList;
+	WorkerList workers;
+
+	/** The index of the worker the next job will be given to. */
+	size_t nextworker;
+
+ public:
+	SSLWorkerPool()
+		: nextworker(0)
+	{
+	}
+
+	~SSLWorkerPool()
+	{
+		SetThreads(0);
+	}
+
+	/** Change the number of worker threads. Jobs given to the existing workers are
+	 * completed before this returns.
+	 * @param count The new number of worker threads, 0 to disable the pool.
+	 */
+	void SetThreads(size_t count)
+	{
+		if (count == workers.size())
+			return;
+
+		for (WorkerList::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			Worker* worker = *i;
+			worker->Stop();
+			delete worker;
+		}
+		workers.clear();
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			Worker* worker = new Worker;
+			ServerInstance->Threads.Start(worker);
+			workers.push_back(worker);
+		}
+	}
+
+	/** Determines whether the pool has any threads to run jobs on. */
+	bool IsEnabled() const { return !workers.empty(); }
+
+	/** Give a job to one of the worker threads. The pool must be enabled.
+	 * @param job The job to run. Its Finish() method is called on the main thread once it has run.
+	 */
+	void Submit(SSLWorkerJob* job)
+	{
+		workers[nextworker++ % workers.size()]->Submit(job);
+	}
+};
+
 /** Helper functions for obtaining TLS (SSL) client certificates and key fingerprints
  * from StreamSockets
  */
@@ -404,15 +404,22 @@ public:
 	 * number of events which occurred during this call.  This method will
 	 * dispatch events to their handlers by calling their
 	 * EventHandler::OnEventHandler*() methods.
+	 * @param wait If false then only events which have already occurred are
+	 * dispatched, this is used when the main loop has more work to do.
 	 * @return The number of events which have occurred.
 	 */
-	static int DispatchEvents();
+	static int DispatchEvents(bool wait = true);
 
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
 	 * to happen when writes have been pre-buffered.
 	 */
 	static void DispatchTrialWrites();
 
+	/** Checks whether any trial reads or writes are waiting to be dispatched.
+	 * @return True if DispatchTrialWrites() has work to do, false otherwise.
+	 */
+	static bool HasTrialWrites() { return !trials.empty(); }
+
 	/** Returns true if the file descriptors in the given event handler are
 	 * within sensible ranges which can be handled by the socket engine.
 	 */
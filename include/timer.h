@@ -38,7 +38,7 @@ class Module;
  * your object (which you have to override) will be called
  * at the given time.
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
 	/** The triggering time
 	 */
@@ -52,6 +52,12 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** The TimerManager slot this timer is currently scheduled in, or NULL if it is not scheduled
+	 */
+	insp::intrusive_list<Timer>* slot;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -119,16 +125,68 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel. The lowest level has a slot
+ * for each of the next 256 seconds, every higher level has 64 slots each covering
+ * 64 times the range of a slot in the level below it. When the lowest level wraps
+ * around the timers in the next slot of the level above are redistributed into the
+ * levels below. Adding and removing a timer is O(1) and does not allocate memory.
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+	typedef insp::intrusive_list<Timer> TimerList;
 
-	/** A list of all pending timers
+	/** Number of bits of the trigger time covered by the lowest level of the wheel
 	 */
-	TimerMap Timers;
+	static const unsigned int ROOT_BITS = 8;
+
+	/** Number of bits of the trigger time covered by each of the higher levels of the wheel
+	 */
+	static const unsigned int LEVEL_BITS = 6;
+
+	/** Number of higher levels in the wheel; timers further in the future than the
+	 * wheel covers (about 136 years) are kept in the last slot of the highest level
+	 */
+	static const unsigned int LEVELS = 4;
+
+	/** Slots of the lowest level, one per second
+	 */
+	TimerList root[1 << ROOT_BITS];
+
+	/** Slots of the higher levels
+	 */
+	TimerList levels[LEVELS][1 << LEVEL_BITS];
+
+	/** Timers which are being ticked by TickTimers()
+	 */
+	TimerList expiring;
+
+	/** The next second which has not yet been processed by TickTimers()
+	 */
+	time_t current;
+
+	/** The number of scheduled timers
+	 */
+	size_t count;
+
+	/** Put a timer into the slot corresponding to its trigger time
+	 * @param T The timer to schedule
+	 */
+	void Schedule(Timer* T);
+
+	/** Redistribute the timers in a slot of a higher level into the levels below it
+	 * @param list The slot to redistribute
+	 */
+	void Cascade(TimerList& list);
+
+	/** Redistribute all timers relative to a new current time, used when the clock jumps
+	 * @param TIME The new current time
+	 */
+	void Rebuild(time_t TIME);
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
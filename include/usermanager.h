@@ -28,19 +28,12 @@
 
 #include <list>
 
+#include "clonetree.h"
+
 class CoreExport UserManager : public fakederef<UserManager>
 {
  public:
-	struct CloneCounts
-	{
-		unsigned int global;
-		unsigned int local;
-		CloneCounts() : global(0), local(0) { }
-	};
-
-	/** Container that maps IP addresses to clone counts
-	 */
-	typedef std::map<irc::sockets::cidr_mask, CloneCounts> CloneMap;
+	typedef CloneTree::Counts CloneCounts;
 
 	/** Sequence container in which each element is a User*
 	 */
@@ -54,13 +47,9 @@ class CoreExport UserManager : public fakederef<UserManager>
 	typedef insp::intrusive_list<LocalUser> LocalList;
 
  private:
-	/** Map of IP addresses for clone counting
+	/** Tree of IP addresses for clone counting
 	 */
-	CloneMap clonemap;
-
-	/** A CloneCounts that contains zero for both local and global
-	 */
-	const CloneCounts zeroclonecounts;
+	CloneTree clones;
 
 	/** Local client list, a list containing only local clients
 	 */
@@ -100,10 +89,12 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	unsigned int unregistered_count;
 
-	/** Perform background user events for all local users such as PING checks, registration timeouts,
+	/** Perform background user events for a local user such as PING checks, registration timeouts,
 	 * penalty management and recvq processing for users who have data in their recvq due to throttling.
+	 * This is called by the UserBackgroundTimer of the user whenever one of these is due.
+	 * @param user The user to perform background events for
 	 */
-	void DoBackgroundUserStuff();
+	void DoBackgroundUserStuff(LocalUser* user);
 
 	/** Handle a client connection.
 	 * Creates a new LocalUser object, inserts it into the appropriate containers,
@@ -126,7 +117,7 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	void QuitUser(User* user, const std::string& quitreason, const std::string* operreason = NULL);
 
-	/** Add a user to the clone map
+	/** Add a user to the clone tree
 	 * @param user The user to add
 	 */
 	void AddClone(User* user);
@@ -138,10 +129,6 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	void RemoveCloneCounts(User *user);
 
-	/** Rebuild clone counts. Required when \<cidr> settings change.
-	 */
-	void RehashCloneCounts();
-
 	/** Return the number of local and global clones of this user
 	 * @param user The user to get the clone counts for
 	 * @return The clone counts of this user. The returned reference is volatile - you
@@ -150,10 +137,10 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	const CloneCounts& GetCloneCounts(User* user) const;
 
-	/** Return a map containing IP addresses and their clone counts
-	 * @return The clone count map
+	/** Return a tree containing the clone counts of all IP addresses and ranges
+	 * @return The clone count tree
 	 */
-	const CloneMap& GetCloneMap() const { return clonemap; }
+	const CloneTree& GetCloneTree() const { return clones; }
 
 	/** Return a count of all global users, unknown and known connections
 	 * @return The number of users on the network, including local unregistered users
@@ -255,6 +255,14 @@ class CoreExport User : public Extensible
 	 */
 	std::string cached_fullrealhost;
 
+	/** Cached nick!ident value, used when matching hostmasks
+	 */
+	std::string cached_nickident;
+
+	/** Incremented every time the cached values are invalidated
+	 */
+	unsigned long cacheserial;
+
 	/** Set by GetIPString() to avoid constantly re-grabbing IP via sockets voodoo.
 	 */
 	std::string cachedip;
@@ -419,11 +427,23 @@ class CoreExport User : public Extensible
 	 */
 	virtual const std::string& GetFullRealHost();
 
+	/** Returns the nick!ident of the user, the part of a hostmask before the host.
+	 * @return The nick!ident of the user
+	 */
+	const std::string& GetNickIdent();
+
 	/** This clears any cached results that are used for GetFullRealHost() etc.
 	 * The results of these calls are cached as generating them can be generally expensive.
 	 */
 	void InvalidateCache();
 
+	/** Retrieves a number which changes every time the nick, ident, hosts or IP address
+	 * of the user change. Results computed from these, such as whether the user matches
+	 * a hostmask, can be cached along with this number and reused while it is unchanged.
+	 * @return The current cache serial of the user
+	 */
+	unsigned long GetCacheSerial() const { return cacheserial; }
+
 	/** Returns whether this user is currently away or not. If true,
 	 * further information can be found in User::awaymsg and User::awaytime
 	 * @return True if the user is away, false otherwise
@@ -718,15 +738,17 @@ class CoreExport UserIOHandler : public StreamSocket
 	{
 	}
 	void OnDataReady() CXX11_OVERRIDE;
+	void OnEventHandlerWrite() CXX11_OVERRIDE;
 	bool OnSetEndPoint(const irc::sockets::sockaddrs& local, const irc::sockets::sockaddrs& remote) CXX11_OVERRIDE;
 	void OnError(BufferedSocketError error) CXX11_OVERRIDE;
 
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
-	 * @param data The data to add to the write buffer
+	 * @param data The data to add to the write buffer. If this refers to a shared buffer
+	 * then only a reference to it is added.
 	 */
-	void AddWriteBuf(const std::string &data);
+	void AddWriteBuf(const StreamSocket::SendQueue::Element& data);
 
 	/** Swaps the internals of this UserIOHandler with another one.
 	 * @param other A UserIOHandler to swap internals with.
@@ -734,14 +756,37 @@ class CoreExport UserIOHandler : public StreamSocket
 	void SwapInternals(UserIOHandler& other);
 };
 
+/** Runs the periodic checks of a local user such as penalty decay, ping timeouts and
+ * registration timeouts. The timer is scheduled for the next second at which any of
+ * these checks is due so only the users who have something to do are visited.
+ */
+class CoreExport UserBackgroundTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	UserBackgroundTimer(LocalUser* me)
+		: Timer(1, false)
+		, user(me)
+	{
+	}
+
+	bool Tick(time_t currtime) CXX11_OVERRIDE;
+
+	/** Reschedule the timer for the next time a check is due for the user.
+	 * @param force If true then always reschedule, otherwise only bring the timer forward.
+	 */
+	void Update(bool force = false);
+};
+
 typedef unsigned int already_sent_t;
 
 class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
 {
 	/** Add a serialized message to the send queue of the user.
-	 * @param serialized Bytes to add.
+	 * @param serialized Shared buffer containing the bytes to add.
 	 */
-	void Write(const ClientProtocol::SerializedMessage& serialized);
+	void Write(const StreamSocket::SendQueue::Element& serialized);
 
 	/** Send a protocol event to the user, consisting of one or more messages.
 	 * @param protoev Event to send, may contain any number of messages.
@@ -762,10 +807,20 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 
 	UserIOHandler eh;
 
+	/** Timer which runs the periodic checks of this user
+	 */
+	UserBackgroundTimer bgtimer;
+
 	/** Serializer to use when communicating with the user
 	 */
 	ClientProtocol::Serializer* serializer;
 
+	/** Identifies which message tags the user can receive, maintained by the cap module.
+	 * Users with the same tag profile get the same tags from every MessageTagProvider whose
+	 * IsProfileTag() returns true which lets a message be serialized once per profile.
+	 */
+	intptr_t tagprofile;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -124,6 +124,13 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Returns the host or IP mask which the host or IP address of a user has to match
+	 * for this line to match them. This is used by the XLineManager to find the lines
+	 * which can match a user without checking every line of a type.
+	 * @return The host mask of the line or NULL if it does not match users by host.
+	 */
+	virtual const std::string* GetHostMask() { return NULL; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -190,6 +197,8 @@ class CoreExport KLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	bool IsBurstable() CXX11_OVERRIDE;
 
 	/** Ident mask (ident part only)
@@ -236,6 +245,8 @@ class CoreExport GLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -280,6 +291,8 @@ class CoreExport ELine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -321,6 +334,8 @@ class CoreExport ZLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE;
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -403,6 +418,79 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** Indexes the X-lines of one type by their host mask so that the lines which can match a
+ * user or a pattern can be found without checking every line. Lines with a literal host
+ * mask are kept in a hash map, lines with a CIDR mask in a map of ranges which is searched
+ * once for each prefix length in use and lines with a mask that starts or ends with a single
+ * wildcard in hash maps which are searched once for each length in use. Only the lines with
+ * other wildcard masks or with no host mask at all have to be checked every time.
+ */
+class CoreExport XLineIndex
+{
+ public:
+	typedef std::vector<XLine*> LineList;
+
+ private:
+	typedef TR1NS::unordered_map<std::string, LineList> StringMap;
+	typedef std::map<std::string::size_type, size_t> LengthMap;
+	typedef std::map<irc::sockets::cidr_mask, LineList> CIDRMap;
+	typedef std::map<std::pair<unsigned char, unsigned char>, size_t> CIDRLengthMap;
+
+	/** Lines with a literal host mask or a CIDR mask, indexed by the lowercased mask */
+	StringMap literals;
+
+	/** Lines with a mask of the form literal*, indexed by the lowercased literal part */
+	StringMap prefixes;
+
+	/** Number of lines in prefixes for each length of the literal part */
+	LengthMap prefixlengths;
+
+	/** Lines with a mask of the form *literal, indexed by the lowercased literal part */
+	StringMap suffixes;
+
+	/** Number of lines in suffixes for each length of the literal part */
+	LengthMap suffixlengths;
+
+	/** Lines with a CIDR mask, indexed by the range */
+	CIDRMap cidrmasks;
+
+	/** Number of lines in cidrmasks for each address family and prefix length */
+	CIDRLengthMap cidrlengths;
+
+	/** Lines which have to be checked against everything */
+	LineList wildcards;
+
+	/** Find the lines which can match a host or an IP address.
+	 * @param host The host or IP address to find the lines for
+	 * @param out The list to add the lines to
+	 */
+	void FindHost(const std::string& host, LineList& out) const;
+
+ public:
+	/** Add a line to the index.
+	 * @param line The line to add
+	 */
+	void Add(XLine* line);
+
+	/** Remove a line from the index.
+	 * @param line The line to remove
+	 */
+	void Remove(XLine* line);
+
+	/** Find the lines which can match a user. The lines still have to be checked with XLine::Matches().
+	 * @param user The user to find the lines for
+	 * @param out The list to add the lines to, every line is added at most once
+	 */
+	void Find(User* user, LineList& out) const;
+
+	/** Find the lines which can match a pattern. The lines still have to be checked with XLine::Matches().
+	 * @param pattern A pattern string specific to the X-line type
+	 * @param out The list to add the lines to, every line is added at most once
+	 * @return False if the pattern can not be looked up in the index and every line has to be checked
+	 */
+	bool Find(const std::string& pattern, LineList& out) const;
+};
+
 /** XLineManager is a class used to manage G-lines, K-lines, E-lines, Z-lines and Q-lines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -414,17 +502,46 @@ class CoreExport XLineManager
 	 */
 	std::vector<XLine *> pending_lines;
 
+	/** Index of the lines which are being applied to the local users
+	 */
+	XLineIndex applying_lines;
+
+	/** UUIDs of the local users which the lines in applying_lines have not been applied to yet
+	 */
+	std::vector<std::string> applying_users;
+
+	/** Whether ApplyLines() has been called since the lines in pending_lines were last moved to applying_lines
+	 */
+	bool apply_requested;
+
 	/** Current xline factories
 	 */
 	XLineFactMap line_factory;
 
 	/** Container of all lines, this is a map of maps which
-	 * allows for fast lookup for add/remove of a line, and
-	 * the shortest possible timed O(n) for checking a user
-	 * against a line.
+	 * allows for fast lookup for add/remove of a line. Matching
+	 * users against lines is done using line_indexes.
 	 */
 	XLineContainer lookup_lines;
 
+	typedef std::map<std::string, XLineIndex> IndexMap;
+
+	/** Indexes of the lines in lookup_lines by type
+	 */
+	IndexMap line_indexes;
+
+	/** Apply the lines in applying_lines to some of the users in applying_users.
+	 * This stops after a fixed amount of work so a large number of lines or users
+	 * does not stop the main loop from handling I/O for a long time.
+	 */
+	void ApplyLinesSlice();
+
+	/** Remove a line from the containers and delete it.
+	 * @param container Iterator to the first level of entries the map
+	 * @param item Iterator to the second level of entries in the map
+	 */
+	void RemoveLine(ContainerIter container, LookupIter item);
+
  public:
 
 	/** Constructor
@@ -525,10 +642,25 @@ class CoreExport XLineManager
 
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
-	 * CPU time.
+	 * CPU time. The lines are applied to as many users as fit into one
+	 * slice right away and to the rest by ContinueApplyLines() over the
+	 * next main loop iterations. Lines added while a pass is in progress
+	 * are applied once it has finished.
 	 */
 	void ApplyLines();
 
+	/** Continue applying lines to the users which have not been checked yet.
+	 * Once every user has been checked the lines which have been added since
+	 * the last pass are indexed and a new pass over the local users starts.
+	 * This is called by the main loop.
+	 */
+	void ContinueApplyLines();
+
+	/** Determines whether lines are still being applied to users.
+	 * @return True if ContinueApplyLines() has work to do.
+	 */
+	bool IsApplyingLines() const { return apply_requested || !applying_users.empty(); }
+
 	/** DEPRECATED: use the `bool InvokeStats(const std::string&, Stats::Context&)` overload instead. */
 	DEPRECATED_METHOD(void InvokeStats(const std::string& type, unsigned int numeric, Stats::Context& stats));
 
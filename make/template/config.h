@@ -55,4 +55,7 @@
  /** Whether the eventfd() function was available at compile time. */
  %define HAS_EVENTFD
 
+ /** Whether the socket engine sends and receives data itself. */
+ %define HAS_SOCKETENGINE_IO
+
 #endif
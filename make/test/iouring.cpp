@@ -0,0 +1,30 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+int main() {
+	// This only checks that the definitions used by the socket engine exist. Whether the
+	// kernel supports everything the socket engine needs is checked when it is initialised.
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	struct io_uring_probe probe;
+	long syscalls[] = { __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register };
+	int constants[] = { IORING_OP_RECV, IORING_OP_SEND, IORING_REGISTER_PBUF_RING, IORING_REGISTER_PROBE, IORING_FEAT_NODROP, IOSQE_BUFFER_SELECT };
+	return (sizeof(params) + sizeof(reg) + sizeof(probe) + sizeof(syscalls) + sizeof(constants) == 0);
+}
@@ -24,26 +24,54 @@
 
 #include "inspircd.h"
 
-BanCacheHit::BanCacheHit(const std::string& type, const std::string& reason, time_t seconds)
+BanCacheHit::BanCacheHit(const irc::sockets::cidr_mask& range, const std::string& type, const std::string& reason, time_t seconds)
 	: Type(type)
 	, Reason(reason)
 	, Expiry(ServerInstance->Time() + seconds)
+	, Range(range)
 {
 }
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+size_t BanCacheManager::RangeHash::operator()(const irc::sockets::cidr_mask& range) const
 {
-	BanCacheHit*& b = BanHash[ip];
-	if (b != NULL) // can't have two cache entries on the same IP, sorry..
+	// Unused bits are always zero so hashing all of them is fine.
+	size_t t = range.type * 131 + range.length;
+	for (size_t i = 0; i < sizeof(range.bits); ++i)
+		t = 31 * t + range.bits[i];
+	return t;
+}
+
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs& addr, const std::string &type, const std::string &reason, time_t seconds, unsigned char range)
+{
+	if (addr.family() != AF_INET && addr.family() != AF_INET6)
+		return NULL;
+
+	const irc::sockets::cidr_mask key(addr, range);
+	const bool single = (key.length == (addr.family() == AF_INET ? 32 : 128));
+
+	// Can't have two cache entries on the same IP, sorry.. If the IP is in a cached range then
+	// that entry is used for it, this also keeps a negative hit from overriding a ranged ban.
+	if (single ? GetHit(addr) != NULL : Find(key) != NULL)
 		return NULL;
 
-	b = new BanCacheHit(type, reason, (seconds ? seconds : 86400));
+	const size_t maxsize = ServerInstance->Config->BanCacheSize;
+	while (BanHash.size() >= maxsize && !lru.empty())
+	{
+		BanCacheHash::iterator it = BanHash.find(lru.front()->Range);
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Cache is full, removing the least recently used hit on " + it->first.str());
+		Remove(it);
+	}
+
+	BanCacheHit* b = &BanHash.insert(std::make_pair(key, BanCacheHit(key, type, reason, (seconds ? seconds : 86400)))).first->second;
+	lru.push_back(b);
+	if (!single)
+		rangelengths[RangeLength(key.type, key.length)]++;
 	return b;
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+BanCacheHit* BanCacheManager::Find(const irc::sockets::cidr_mask& range)
 {
-	BanCacheHash::iterator i = this->BanHash.find(ip);
+	BanCacheHash::iterator i = this->BanHash.find(range);
 
 	if (i == this->BanHash.end())
 		return NULL; // free and safe
@@ -51,20 +79,60 @@ BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
 	if (RemoveIfExpired(i))
 		return NULL; // expired
 
-	return i->second; // hit.
+	// Keep the entries in order of use so the stalest one is removed when the cache is full.
+	BanCacheHit* b = &i->second;
+	lru.erase(b);
+	lru.push_back(b);
+	return b; // hit.
+}
+
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs& addr)
+{
+	if (addr.family() != AF_INET && addr.family() != AF_INET6)
+		return NULL;
+
+	BanCacheHit* b = Find(irc::sockets::cidr_mask(addr, 128));
+	if (b)
+		return b;
+
+	// Check the ranges from the smallest to the largest one.
+	for (std::map<RangeLength, size_t, std::greater<RangeLength> >::const_iterator i = rangelengths.begin(); i != rangelengths.end(); )
+	{
+		const RangeLength rangelength = i->first;
+		++i; // Find() can remove the current length if the entry it finds has expired.
+
+		if (rangelength.first != addr.family())
+			continue;
+
+		b = Find(irc::sockets::cidr_mask(addr, rangelength.second));
+		if (b)
+			return b;
+	}
+
+	return NULL;
 }
 
 bool BanCacheManager::RemoveIfExpired(BanCacheHash::iterator& it)
 {
-	if (ServerInstance->Time() < it->second->Expiry)
+	if (ServerInstance->Time() < it->second.Expiry)
 		return false;
 
-	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + it->first + " is out of date, removing!");
-	delete it->second;
-	it = BanHash.erase(it);
+	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + it->first.str() + " is out of date, removing!");
+	Remove(it);
 	return true;
 }
 
+void BanCacheManager::Remove(BanCacheHash::iterator& it)
+{
+	const irc::sockets::cidr_mask& range = it->first;
+	std::map<RangeLength, size_t, std::greater<RangeLength> >::iterator len = rangelengths.find(RangeLength(range.type, range.length));
+	if (len != rangelengths.end() && !--len->second)
+		rangelengths.erase(len);
+
+	lru.erase(&it->second);
+	it = BanHash.erase(it);
+}
+
 void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 {
 	if (positive)
@@ -77,7 +145,7 @@ void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 		if (RemoveIfExpired(i))
 			continue; // updates the iterator if expired
 
-		BanCacheHit* b = i->second;
+		BanCacheHit* b = &i->second;
 		bool remove = false;
 
 		if (positive)
@@ -94,17 +162,10 @@ void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 		if (remove)
 		{
 			/* we need to remove this one. */
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first);
-			delete b;
-			i = BanHash.erase(i);
+			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first.str());
+			Remove(i);
 		}
 		else
 			++i;
 	}
 }
-
-BanCacheManager::~BanCacheManager()
-{
-	for (BanCacheHash::iterator n = BanHash.begin(); n != BanHash.end(); ++n)
-		delete n->second;
-}
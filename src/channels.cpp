@@ -31,6 +31,47 @@
 namespace
 {
 	ChanModeReference ban(NULL, "ban");
+
+	/** Checks the entries of a ban list one by one with Channel::CheckBan().
+	 * @param chan The channel the ban list belongs to.
+	 * @param user The user to check.
+	 * @param bans The ban list to check.
+	 * @param type If zero, all entries are checked. Otherwise only the extbans of this type are.
+	 * @return True if any of the checked entries matched the user, false otherwise.
+	 */
+	bool CheckBans(Channel* chan, User* user, const ListModeBase::ModeList& bans, char type)
+	{
+		for (ListModeBase::ModeList::const_iterator it = bans.begin(); it != bans.end(); ++it)
+		{
+			if (!type)
+			{
+				if (chan->CheckBan(user, it->mask))
+					return true;
+				continue;
+			}
+
+			if (it->mask.length() <= 2 || it->mask[0] != type || it->mask[1] != ':')
+				continue;
+
+			if (chan->CheckBan(user, it->mask.substr(2)))
+				return true;
+		}
+		return false;
+	}
+
+	/** Determines whether every module implementing OnCheckBan() only has to see the extbans of a ban list.
+	 * @return True if every module implementing OnCheckBan() has set Module::checkbanextbansonly, false otherwise.
+	 */
+	bool CheckBanExtBansOnly()
+	{
+		const Module::List& handlers = ServerInstance->Modules->EventHandlers[I_OnCheckBan];
+		for (Module::List::const_iterator i = handlers.begin(); i != handlers.end(); ++i)
+		{
+			if (!(*i)->checkbanextbansonly)
+				return false;
+		}
+		return true;
+	}
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
@@ -313,15 +354,55 @@ bool Channel::IsBanned(User* user)
 		return false;
 
 	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	if (!bans)
+		return false;
+
+	if (!ServerInstance->Modules->EventHandlers[I_OnCheckBan].empty())
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		if (CheckBanExtBansOnly())
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			// Only modules can match extbans, the other entries are matched by the compiled list below.
+			const std::vector<std::string>& extbans = banlm->GetExtBans(this);
+			for (std::vector<std::string>::const_iterator it = extbans.begin(); it != extbans.end(); ++it)
+			{
+				FIRST_MOD_RESULT(OnCheckBan, result, (user, this, *it));
+				if (result == MOD_RES_DENY)
+					return true;
+
+				if (result == MOD_RES_ALLOW)
+					return CheckBans(this, user, *bans, 0);
+			}
+		}
+		else
+		{
+			// Modules can match any entry in their own way so they see every entry.
+			for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+			{
+				FIRST_MOD_RESULT(OnCheckBan, result, (user, this, it->mask));
+				if (result == MOD_RES_DENY)
+					return true;
+
+				// A module has overridden the core matching of an entry, this can't be
+				// expressed with the compiled list so check the entries one by one.
+				if (result == MOD_RES_ALLOW)
+					return CheckBans(this, user, *bans, 0);
+			}
 		}
 	}
-	return false;
+
+	// Whether a member matches the core part of the ban list is cached until either changes.
+	Membership* memb = GetUser(user);
+	if (!memb)
+		return banlm->MatchUser(this, user);
+
+	const unsigned long serial = banlm->GetMatchSerial(this);
+	if ((memb->banserial != serial) || (memb->banuserserial != user->GetCacheSerial()))
+	{
+		memb->banned = banlm->MatchUser(this, user);
+		memb->banserial = serial;
+		memb->banuserserial = user->GetCacheSerial();
+	}
+	return memb->banned;
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
@@ -339,9 +420,8 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	if (at == std::string::npos)
 		return false;
 
-	const std::string nickIdent = user->nick + "!" + user->ident;
 	std::string prefix(mask, 0, at);
-	if (InspIRCd::Match(nickIdent, prefix, NULL))
+	if (InspIRCd::Match(user->GetNickIdent(), prefix, NULL))
 	{
 		std::string suffix(mask, at + 1);
 		if (InspIRCd::Match(user->GetRealHost(), suffix, NULL) ||
@@ -364,18 +444,26 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 		return MOD_RES_PASSTHRU;
 
 	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	if (!bans)
+		return MOD_RES_PASSTHRU;
+
+	if (!ServerInstance->Modules->EventHandlers[I_OnCheckBan].empty())
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+		const std::vector<std::string>& masks = banlm->GetExtBans(this, type);
+		for (std::vector<std::string>::const_iterator it = masks.begin(); it != masks.end(); ++it)
 		{
-			if (it->mask.length() <= 2 || it->mask[0] != type || it->mask[1] != ':')
-				continue;
-
-			if (CheckBan(user, it->mask.substr(2)))
+			FIRST_MOD_RESULT(OnCheckBan, rv, (user, this, *it));
+			if (rv == MOD_RES_DENY)
 				return MOD_RES_DENY;
+
+			// A module has overridden the core matching of a mask, this can't be
+			// expressed with the compiled list so check the masks one by one.
+			if (rv == MOD_RES_ALLOW)
+				return CheckBans(this, user, *bans, type) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 		}
 	}
-	return MOD_RES_PASSTHRU;
+
+	return banlm->MatchUser(this, user, type) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 }
 
 /* Channel::PartUser
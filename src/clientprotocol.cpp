@@ -59,17 +59,49 @@ ClientProtocol::TagSelection ClientProtocol::Serializer::MakeTagWhitelist(LocalU
 	return tagwl;
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
+const StreamSocket::SendQueue::Element& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
 {
 	if (!msg.msginit_done)
 	{
 		msg.msginit_done = true;
 		FOREACH_MOD_CUSTOM(evprov, MessageTagProvider, OnPopulateTags, (msg));
+		msg.TagsChanged();
+	}
+
+	if (!msg.profiletags_only)
+		return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+
+	// Everyone with the same tag profile gets the same tags so the tag whitelist only has to be
+	// built for the first recipient with a given profile.
+	const Message::ProfileKey key(this, user->tagprofile);
+	Message::ProfileMap::const_iterator it = msg.profilemap.find(key);
+	if (it != msg.profilemap.end())
+		return it->second;
+
+	const StreamSocket::SendQueue::Element& serialized = msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+	return msg.profilemap.insert(std::make_pair(key, serialized)).first->second;
+}
+
+void ClientProtocol::Message::TagsChanged()
+{
+	InvalidateCache();
+
+	// Until the message is initialized the tags are not final, they are checked once it is.
+	if (!msginit_done)
+		return;
+
+	profiletags_only = true;
+	for (TagMap::const_iterator i = tags.begin(); i != tags.end(); ++i)
+	{
+		if (!i->second.tagprov->IsProfileTag())
+		{
+			profiletags_only = false;
+			break;
+		}
 	}
-	return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
+const StreamSocket::SendQueue::Element& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
 {
 	// First check if the serialized line they're asking for is in the cache
 	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
@@ -79,8 +111,10 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(
 			return i->second;
 	}
 
-	// Not cached, generate it and put it in the cache for later use
-	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
+	// Not cached, generate it and put it in the cache for later use. The serialized message is stored
+	// in a shared buffer so every recipient's sendq can reference it instead of holding its own copy.
+	const StreamSocket::SendQueue::Element serialized(serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl));
+	serlist.push_back(std::make_pair(serializeinfo, serialized));
 	return serlist.back().second;
 }
 
@@ -0,0 +1,304 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include <queue>
+
+namespace
+{
+	/** Retrieves a bit of a range, bit 0 is the most significant bit of the address. */
+	inline bool GetBit(const irc::sockets::cidr_mask& mask, unsigned int bit)
+	{
+		return mask.bits[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	/** Determines how many of the leading bits of two ranges are the same.
+	 * @param max The number of bits to compare.
+	 */
+	unsigned int CommonLength(const irc::sockets::cidr_mask& a, const irc::sockets::cidr_mask& b, unsigned int max)
+	{
+		for (unsigned int bit = 0; bit < max; bit += 8)
+		{
+			unsigned char diff = a.bits[bit / 8] ^ b.bits[bit / 8];
+			if (!diff)
+				continue;
+
+			while (!(diff & 0x80))
+			{
+				diff <<= 1;
+				bit++;
+			}
+			return std::min(bit, max);
+		}
+		return max;
+	}
+
+	/** Shortens a range to the given length. */
+	irc::sockets::cidr_mask Truncate(const irc::sockets::cidr_mask& mask, unsigned int length)
+	{
+		irc::sockets::cidr_mask out(mask);
+		out.length = length;
+		for (unsigned int i = 0; i < sizeof(out.bits); ++i)
+		{
+			if (i * 8 >= length)
+				out.bits[i] = 0;
+			else if (i * 8 + 8 > length)
+				out.bits[i] &= (0xFF00 >> (length % 8)) & 0xFF;
+		}
+		return out;
+	}
+
+	/** Creates the range covering all addresses of an address family. */
+	irc::sockets::cidr_mask RootMask(unsigned char family)
+	{
+		irc::sockets::cidr_mask mask;
+		mask.type = family;
+		mask.length = 0;
+		memset(mask.bits, 0, sizeof(mask.bits));
+		return mask;
+	}
+}
+
+CloneTree::Node::Node(const irc::sockets::cidr_mask& mask, Node* parentnode)
+	: prefix(mask)
+	, parent(parentnode)
+{
+	children[0] = children[1] = NULL;
+}
+
+CloneTree::CloneTree()
+	: root4(RootMask(AF_INET), NULL)
+	, root6(RootMask(AF_INET6), NULL)
+	, rootunix(RootMask(AF_UNIX), NULL)
+{
+}
+
+CloneTree::~CloneTree()
+{
+	DeleteChildren(&root4);
+	DeleteChildren(&root6);
+	DeleteChildren(&rootunix);
+}
+
+CloneTree::Node* CloneTree::GetRoot(unsigned char family)
+{
+	switch (family)
+	{
+		case AF_INET:
+			return &root4;
+		case AF_INET6:
+			return &root6;
+		case AF_UNIX:
+			return &rootunix;
+	}
+	return NULL;
+}
+
+CloneTree::Node* CloneTree::Find(const irc::sockets::cidr_mask& range) const
+{
+	Node* node = const_cast<CloneTree*>(this)->GetRoot(range.type);
+	if (!node)
+		return NULL;
+
+	// Find the first node which covers the range or a part of it.
+	while (node->prefix.length < range.length)
+	{
+		node = node->children[GetBit(range, node->prefix.length)];
+		if (!node)
+			return NULL;
+
+		const unsigned int length = std::min(node->prefix.length, range.length);
+		if (CommonLength(node->prefix, range, length) < length)
+			return NULL;
+	}
+	return node->counts.global ? node : NULL;
+}
+
+void CloneTree::Unlink(Node* node)
+{
+	Node* parent = node->parent;
+	parent->children[parent->children[1] == node] = NULL;
+	DeleteChildren(node);
+	delete node;
+
+	// Nodes other than the roots only exist to join two ranges so the remaining child takes the place of the parent.
+	Node* grandparent = parent->parent;
+	if (!grandparent)
+		return;
+
+	Node* other = parent->children[0] ? parent->children[0] : parent->children[1];
+	grandparent->children[grandparent->children[1] == parent] = other;
+	other->parent = grandparent;
+	delete parent;
+}
+
+void CloneTree::DeleteChildren(Node* node)
+{
+	for (unsigned int i = 0; i < 2; ++i)
+	{
+		Node* child = node->children[i];
+		if (!child)
+			continue;
+
+		DeleteChildren(child);
+		delete child;
+		node->children[i] = NULL;
+	}
+}
+
+void CloneTree::Add(const irc::sockets::sockaddrs& addr, bool local)
+{
+	const irc::sockets::cidr_mask mask(addr, 128);
+	Node* node = GetRoot(mask.type);
+	if (!node)
+		return;
+
+	for (;;)
+	{
+		node->counts.global++;
+		if (local)
+			node->counts.local++;
+
+		if (node->prefix.length >= mask.length)
+			return;
+
+		Node*& child = node->children[GetBit(mask, node->prefix.length)];
+		if (!child)
+		{
+			child = new Node(mask, node);
+		}
+		else
+		{
+			const unsigned int common = CommonLength(child->prefix, mask, child->prefix.length);
+			if (common < child->prefix.length)
+			{
+				// The address is not within the range of the child so a node for
+				// the range they have in common is inserted above the child.
+				Node* split = new Node(Truncate(mask, common), node);
+				split->counts = child->counts;
+				split->children[GetBit(child->prefix, common)] = child;
+				child->parent = split;
+				child = split;
+			}
+		}
+		node = child;
+	}
+}
+
+void CloneTree::Remove(const irc::sockets::sockaddrs& addr, bool local)
+{
+	const irc::sockets::cidr_mask mask(addr, 128);
+	Node* node = Find(mask);
+	if (!node || node->prefix.length != mask.length)
+		return;
+
+	for (Node* n = node; n; n = n->parent)
+	{
+		n->counts.global--;
+		if (local && n->counts.local)
+			n->counts.local--;
+	}
+
+	if (!node->counts.global && node->parent)
+		Unlink(node);
+}
+
+void CloneTree::Erase(const irc::sockets::cidr_mask& range)
+{
+	Node* node = Find(range);
+	if (!node)
+		return;
+
+	for (Node* n = node->parent; n; n = n->parent)
+	{
+		n->counts.global -= node->counts.global;
+		n->counts.local -= node->counts.local;
+	}
+
+	if (node->parent)
+	{
+		Unlink(node);
+	}
+	else
+	{
+		DeleteChildren(node);
+		node->counts = Counts();
+	}
+}
+
+void CloneTree::Clear()
+{
+	Node* roots[] = { &root4, &root6, &rootunix };
+	for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); ++i)
+	{
+		DeleteChildren(roots[i]);
+		roots[i]->counts = Counts();
+	}
+}
+
+const CloneTree::Counts& CloneTree::Get(const irc::sockets::cidr_mask& range) const
+{
+	const Node* node = Find(range);
+	return node ? node->counts : zerocounts;
+}
+
+void CloneTree::GetTop(unsigned char ipv4len, unsigned char ipv6len, unsigned int mincount, size_t max, RangeList& out) const
+{
+	// A range never has more connections than the ranges containing it so always
+	// looking at the range with the most connections next finds them in order.
+	typedef std::pair<unsigned int, const Node*> QueueEntry;
+	std::priority_queue<QueueEntry> queue;
+	const Node* roots[] = { &root4, &root6, &rootunix };
+	for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); ++i)
+	{
+		if (roots[i]->counts.global && roots[i]->counts.global >= mincount)
+			queue.push(QueueEntry(roots[i]->counts.global, roots[i]));
+	}
+
+	size_t found = 0;
+	while (!queue.empty())
+	{
+		const Node* node = queue.top().second;
+		queue.pop();
+
+		unsigned int length = 0;
+		if (node->prefix.type == AF_INET)
+			length = std::min<unsigned int>(ipv4len, 32);
+		else if (node->prefix.type == AF_INET6)
+			length = std::min<unsigned int>(ipv6len, 128);
+
+		if (node->prefix.length >= length)
+		{
+			Range range;
+			range.mask = Truncate(node->prefix, length);
+			range.counts = node->counts;
+			out.push_back(range);
+
+			if (max && ++found >= max)
+				return;
+			continue;
+		}
+
+		for (unsigned int i = 0; i < 2; ++i)
+		{
+			const Node* child = node->children[i];
+			if (child && child->counts.global >= mincount)
+				queue.push(QueueEntry(child->counts.global, child));
+		}
+	}
+}
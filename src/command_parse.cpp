@@ -109,8 +109,43 @@ bool CommandParser::LoopCall(User* user, Command* handler, const CommandBase::Pa
 	return true;
 }
 
+int CommandParser::FindFastSlot(const std::string& commandname)
+{
+	const char* const name = commandname.c_str();
+	switch (commandname.length())
+	{
+		case 3:
+			if (!memcmp(name, "WHO", 3))
+				return FAST_WHO;
+			break;
+		case 4:
+			if (!memcmp(name, "PING", 4))
+				return FAST_PING;
+			if (!memcmp(name, "PONG", 4))
+				return FAST_PONG;
+			if (!memcmp(name, "JOIN", 4))
+				return FAST_JOIN;
+			if (!memcmp(name, "MODE", 4))
+				return FAST_MODE;
+			break;
+		case 6:
+			if (!memcmp(name, "NOTICE", 6))
+				return FAST_NOTICE;
+			break;
+		case 7:
+			if (!memcmp(name, "PRIVMSG", 7))
+				return FAST_PRIVMSG;
+			break;
+	}
+	return -1;
+}
+
 Command* CommandParser::GetHandler(const std::string &commandname)
 {
+	const int slot = FindFastSlot(commandname);
+	if ((slot >= 0) && (fastcmds[slot]))
+		return fastcmds[slot];
+
 	CommandMap::iterator n = cmdlist.find(commandname);
 	if (n != cmdlist.end())
 		return n->second;
@@ -321,6 +356,10 @@ void CommandParser::RemoveCommand(Command* x)
 	CommandMap::iterator n = cmdlist.find(x->name);
 	if (n != cmdlist.end() && n->second == x)
 		cmdlist.erase(n);
+
+	const int slot = FindFastSlot(x->name);
+	if ((slot >= 0) && (fastcmds[slot] == x))
+		fastcmds[slot] = NULL;
 }
 
 void CommandParser::ProcessBuffer(LocalUser* user, const std::string& buffer)
@@ -342,6 +381,10 @@ bool CommandParser::AddCommand(Command *f)
 	if (cmdlist.find(f->name) == cmdlist.end())
 	{
 		cmdlist[f->name] = f;
+
+		const int slot = FindFastSlot(f->name);
+		if (slot >= 0)
+			fastcmds[slot] = f;
 		return true;
 	}
 	return false;
@@ -349,6 +392,7 @@ bool CommandParser::AddCommand(Command *f)
 
 CommandParser::CommandParser()
 {
+	std::fill(fastcmds, fastcmds + FAST_MAX, static_cast<Command*>(NULL));
 }
 
 std::string CommandParser::TranslateUIDs(const std::vector<TranslateType>& to, const CommandBase::Params& source, bool prefix_final, CommandBase* custom_translator)
@@ -393,6 +393,8 @@ void ServerConfig::Fill()
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getUInt("somaxconn", SOMAXCONN);
 	TimeSkipWarn = ConfValue("performance")->getDuration("timeskipwarn", 2, 0, 30);
+	BanCacheSize = ConfValue("performance")->getUInt("bancachesize", 50000, 1);
+	HookTimer::profile = ConfValue("performance")->getBool("hookstats");
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = server->getString("description", "Configure Me", 1);
 	Network = server->getString("network", "Network", 1);
@@ -717,7 +719,6 @@ void ConfigReaderThread::Finish()
 		 * XXX: The order of these is IMPORTANT, do not reorder them without testing
 		 * thoroughly!!!
 		 */
-		ServerInstance->Users.RehashCloneCounts();
 		ServerInstance->XLines->CheckELines();
 		ServerInstance->XLines->ApplyLines();
 		User* user = ServerInstance->FindUUID(TheUserUID);
@@ -153,6 +153,7 @@ class Packet : public Query
 
 		uint16_t rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
+		const unsigned short rdstart = pos;
 
 		switch (record.type)
 		{
@@ -210,8 +211,38 @@ class Packet : public Query
 
 				break;
 			}
+			case QUERY_SOA:
+			{
+				const std::string mname = this->UnpackName(input, input_size, pos);
+				const std::string rname = this->UnpackName(input, input_size, pos);
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack soa resource record");
+
+				// Serial, refresh, retry, expire and minimum in the same order as the packet
+				record.rdata = mname + " " + rname;
+				for (unsigned int i = 0; i < 5; ++i)
+				{
+					uint32_t value = (static_cast<uint32_t>(input[pos]) << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
+					record.rdata += " " + ConvToStr(value);
+					pos += 4;
+				}
+
+				// The record length must cover everything read above and may not extend past the packet
+				if (rdstart + rdlength < pos || rdstart + rdlength > input_size)
+					throw Exception("Invalid soa resource record length");
+
+				pos = rdstart + rdlength;
+				break;
+			}
 			default:
+			{
+				// Skip over record types we do not understand so that following records can be read
+				if (pos + rdlength > input_size)
+					throw Exception("Unable to unpack resource record");
+
+				pos += rdlength;
 				break;
+			}
 		}
 
 		if (!record.name.empty() && !record.rdata.empty())
@@ -229,6 +260,8 @@ class Packet : public Query
 	RequestId id;
 	/* Flags on the packet */
 	unsigned short flags;
+	/* Records from the authority section, used for caching negative answers */
+	std::vector<ResourceRecord> authorities;
 
 	Packet() : id(0), flags(0)
 	{
@@ -268,6 +301,37 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		// The authority section is only needed to cache negative answers, a broken one must not fail the request
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+				this->authorities.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+		}
+		catch (Exception& ex)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Ignoring authority section: " + ex.GetReason());
+			this->authorities.clear();
+		}
+	}
+
+	/** Determine how long a negative answer may be cached for, see RFC 2308 section 5.
+	 * @param ttl Set to the lesser of the TTL and the minimum field of the SOA record.
+	 * @return True if the packet carries a SOA record, false if it can not be cached.
+	 */
+	bool GetNegativeTTL(unsigned int& ttl) const
+	{
+		for (std::vector<ResourceRecord>::const_iterator i = this->authorities.begin(); i != this->authorities.end(); ++i)
+		{
+			const ResourceRecord& rr = *i;
+			if (rr.type != QUERY_SOA)
+				continue;
+
+			const unsigned int minimum = ConvToNum<unsigned int>(rr.rdata.substr(rr.rdata.rfind(' ') + 1));
+			ttl = std::min(rr.ttl, minimum);
+			return true;
+		}
+		return false;
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -344,20 +408,66 @@ class Packet : public Query
 
 class MyManager : public Manager, public Timer, public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	struct CacheEntry
+	{
+		Query query;
+		time_t expires;
+
+		CacheEntry(const Query& q, time_t e) : query(q), expires(e) { }
+	};
+
+	/** Cache entries ordered from most to least recently used
+	 */
+	typedef std::list<CacheEntry> cache_list;
+	typedef TR1NS::unordered_map<Question, cache_list::iterator, Question::hash> cache_map;
+	cache_list cachelru;
 	cache_map cache;
 
+	/** Requests that are waiting on the answer to the same question, keyed by the question sent
+	 * to the nameserver. The first request owns the id the query was sent with.
+	 */
+	typedef TR1NS::unordered_map<Question, std::vector<DNS::Request*>, Question::hash> inflight_map;
+	inflight_map inflight;
+
+	/** Requests which are currently being given an answer, entries are set to NULL when deleted
+	 */
+	std::vector<DNS::Request*>* delivering;
+
 	irc::sockets::sockaddrs myserver;
 	bool unloading;
 
 	/** Maximum number of entries in cache
 	 */
-	static const unsigned int MAX_CACHE_SIZE = 1000;
+	unsigned long maxcachesize;
+
+	static bool IsExpired(const CacheEntry& entry, time_t now = ServerInstance->Time())
+	{
+		return (entry.expires < now);
+	}
+
+	static void Deliver(DNS::Request* req, const Query& query)
+	{
+		if (query.error != ERROR_NONE)
+			req->OnError(&query);
+		else
+			req->OnLookupComplete(&query);
+	}
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	void EraseCache(cache_list::iterator it)
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		this->cache.erase(it->query.question);
+		this->cachelru.erase(it);
+	}
+
+	/** Remove least recently used entries until there is room for the given number of entries
+	 */
+	void ShrinkCache(unsigned long size)
+	{
+		while (this->cachelru.size() > size)
+		{
+			ServerInstance->stats.DnsCacheEvictions++;
+			EraseCache(--this->cachelru.end());
+		}
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -369,84 +479,75 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			ServerInstance->stats.DnsCacheMisses++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		cache_list::iterator entry = it->second;
+		if (IsExpired(*entry))
 		{
-			this->cache.erase(it);
+			ServerInstance->stats.DnsCacheMisses++;
+			EraseCache(entry);
 			return false;
 		}
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: Using cached result for " + question.name);
+		ServerInstance->stats.DnsCacheHits++;
+		this->cachelru.splice(this->cachelru.begin(), this->cachelru, entry);
+
+		// The request may start new lookups which change the cache so give it a copy
+		Query record(entry->query);
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		Deliver(req, record);
 		return true;
 	}
 
 	/** Add a record to the dns cache
 	 * @param r The record
 	 */
-	void AddCache(Query& r)
+	void AddCache(const Packet& r)
 	{
-		if (cache.size() >= MAX_CACHE_SIZE)
-			cache.clear();
+		if (!maxcachesize)
+			return;
 
 		// Determine the lowest TTL value and use that as the TTL of the cache entry
 		unsigned int cachettl = UINT_MAX;
-		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+		if (r.error == ERROR_NONE)
 		{
-			const ResourceRecord& rr = *i;
-			if (rr.ttl < cachettl)
-				cachettl = rr.ttl;
+			for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+			{
+				const ResourceRecord& rr = *i;
+				if (rr.ttl < cachettl)
+					cachettl = rr.ttl;
+			}
 		}
+		else if (r.error != ERROR_DOMAIN_NOT_FOUND && r.error != ERROR_NO_RECORDS)
+			return;
+		else if (!r.GetNegativeTTL(cachettl))
+			return;
 
 		cachettl = std::min(cachettl, (unsigned int)5*60);
-		ResourceRecord& rr = r.answers.front();
-		// Set TTL to what we've determined to be the lowest
-		rr.ttl = cachettl;
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.question] = r;
-	}
 
- public:
-	DNS::Request* requests[MAX_REQUEST_ID+1];
+		cache_map::iterator it = this->cache.find(r.question);
+		if (it != this->cache.end())
+			EraseCache(it->second);
+		ShrinkCache(maxcachesize - 1);
 
-	MyManager(Module* c) : Manager(c), Timer(5*60, true)
-		, unloading(false)
-	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-			requests[i] = NULL;
-		ServerInstance->Timers.AddTimer(this);
-	}
+		Query query(r.question);
+		query.answers = r.answers;
+		query.error = r.error;
+		this->cachelru.push_front(CacheEntry(query, ServerInstance->Time() + cachettl));
+		this->cache[r.question] = this->cachelru.begin();
 
-	~MyManager()
-	{
-		// Ensure Process() will fail for new requests
-		unloading = true;
-
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* request = requests[i];
-			if (!request)
-				continue;
-
-			Query rr(request->question);
-			rr.error = ERROR_UNKNOWN;
-			request->OnError(&rr);
-
-			delete request;
-		}
+		const std::string result = (r.error == ERROR_NONE ? r.answers.front().rdata : GetErrorStr(r.error));
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + r.question.name + " -> " + result + " ttl: " + ConvToStr(cachettl));
 	}
 
-	void Process(DNS::Request* req) CXX11_OVERRIDE
+	/** Find an unused request id
+	 */
+	RequestId AllocateId()
 	{
-		if ((unloading) || (req->creator->dying))
-			throw Exception("Module is being unloaded");
-
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type) + " to " + this->myserver.addr());
-
-		/* Create an id */
 		unsigned int tries = 0;
 		int id;
 		do
@@ -475,12 +576,92 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 		while (this->requests[id]);
 
-		req->id = id;
-		this->requests[req->id] = req;
+		return id;
+	}
+
+ public:
+	DNS::Request* requests[MAX_REQUEST_ID+1];
+
+	MyManager(Module* c) : Manager(c), Timer(5*60, true)
+		, delivering(NULL)
+		, unloading(false)
+		, maxcachesize(1000)
+	{
+		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
+			requests[i] = NULL;
+		ServerInstance->Timers.AddTimer(this);
+	}
+
+	~MyManager()
+	{
+		// Ensure Process() will fail for new requests
+		unloading = true;
+
+		FailRequests(NULL, ERROR_UNKNOWN);
+	}
+
+	/** Fail all pending requests created by a module
+	 * @param mod The module to fail the requests of or NULL for all requests
+	 * @param error The error to give to the requests
+	 */
+	void FailRequests(Module* mod, Error error)
+	{
+		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
+		{
+			// Deleting a request may hand its id to another request waiting on the same answer
+			DNS::Request* request;
+			while ((request = requests[i]) && (!mod || request->creator == mod))
+			{
+				Query rr(request->question);
+				rr.error = error;
+				request->OnError(&rr);
+
+				delete request;
+			}
+		}
+
+		// Whatever is left are requests waiting on the answer to a query sent for another module
+		while (DNS::Request* request = FindWaitingRequest(mod))
+		{
+			Query rr(request->question);
+			rr.error = error;
+			request->OnError(&rr);
+
+			delete request;
+		}
+	}
+
+	/** Find a request which waits on the answer to a query sent for another request
+	 * @param mod The module which created the request or NULL for any module
+	 */
+	DNS::Request* FindWaitingRequest(Module* mod)
+	{
+		for (inflight_map::const_iterator i = inflight.begin(); i != inflight.end(); ++i)
+		{
+			for (std::vector<DNS::Request*>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+			{
+				if (!mod || (*j)->creator == mod)
+					return *j;
+			}
+		}
+		return NULL;
+	}
+
+	void SetCacheSize(unsigned long size)
+	{
+		maxcachesize = size;
+		ShrinkCache(maxcachesize);
+	}
+
+	void Process(DNS::Request* req) CXX11_OVERRIDE
+	{
+		if ((unloading) || (req->creator->dying))
+			throw Exception("Module is being unloaded");
+
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type) + " to " + this->myserver.addr());
 
 		Packet p;
 		p.flags = QUERYFLAGS_RD;
-		p.id = req->id;
 		p.question = req->question;
 
 		unsigned char buffer[524];
@@ -499,6 +680,26 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Update name in the original request so question checking works for PTR queries
 		req->question.name = p.question.name;
 
+		if (req->use_cache)
+		{
+			std::vector<DNS::Request*>& waiting = inflight[req->question];
+			waiting.push_back(req);
+			if (waiting.size() > 1)
+			{
+				// The same question has already been sent, share its answer instead of asking again
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Waiting on the answer of an identical request");
+				req->id = waiting.front()->id;
+				ServerInstance->Timers.AddTimer(req);
+				return;
+			}
+		}
+
+		req->id = AllocateId();
+		this->requests[req->id] = req;
+
+		buffer[0] = req->id >> 8;
+		buffer[1] = req->id & 0xFF;
+
 		if (SocketEngine::SendTo(this, buffer, len, 0, this->myserver) != len)
 			throw Exception("DNS: Unable to send query");
 
@@ -508,8 +709,37 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 	void RemoveRequest(DNS::Request* req) CXX11_OVERRIDE
 	{
-		if (requests[req->id] == req)
+		const bool owner = (requests[req->id] == req);
+		if (owner)
 			requests[req->id] = NULL;
+
+		if (delivering)
+			std::replace(delivering->begin(), delivering->end(), req, static_cast<DNS::Request*>(NULL));
+
+		if (!req->use_cache)
+			return;
+
+		inflight_map::iterator it = inflight.find(req->question);
+		if (it == inflight.end())
+			return;
+
+		std::vector<DNS::Request*>& waiting = it->second;
+		std::vector<DNS::Request*>::iterator i = std::find(waiting.begin(), waiting.end(), req);
+		if (i == waiting.end())
+			return;
+
+		waiting.erase(i);
+		if (waiting.empty())
+		{
+			inflight.erase(it);
+		}
+		else if (owner)
+		{
+			// Let the next request in line take over the query that was sent
+			DNS::Request* next = waiting.front();
+			next->id = req->id;
+			requests[next->id] = next;
+		}
 	}
 
 	std::string GetErrorStr(Error e) CXX11_OVERRIDE
@@ -552,6 +782,8 @@ class MyManager : public Manager, public Timer, public EventHandler
 				return "CNAME";
 			case QUERY_PTR:
 				return "PTR";
+			case QUERY_SOA:
+				return "SOA";
 			case QUERY_TXT:
 				return "TXT";
 			default:
@@ -616,14 +848,12 @@ class MyManager : public Manager, public Timer, public EventHandler
 		{
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_MALFORMED;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received a nonstandard query");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
 		}
 		else if (!(recv_packet.flags & QUERYFLAGS_QR) || (recv_packet.flags & QUERYFLAGS_RCODE))
 		{
@@ -657,39 +887,59 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = error;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "No resource records returned");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
 		}
 		else
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Lookup complete for " + request->question.name);
 			ServerInstance->stats.DnsGood++;
-			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
 		}
 
 		ServerInstance->stats.Dns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+		// Cache first so that lookups started by the requests below are answered from it
+		if (valid)
+			this->AddCache(recv_packet);
+
+		// Take every request waiting on this answer so that new requests send a query of their own
+		std::vector<DNS::Request*> waiting;
+		inflight_map::iterator it = inflight.find(request->question);
+		if (request->use_cache && it != inflight.end() && it->second.front() == request)
+		{
+			waiting.swap(it->second);
+			inflight.erase(it);
+		}
+		else
+			waiting.push_back(request);
+
+		this->requests[recv_packet.id] = NULL;
+		this->delivering = &waiting;
+		for (std::vector<DNS::Request*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
+		{
+			DNS::Request* req = *i;
+			if (!req)
+				continue;
+
+			Deliver(req, recv_packet);
+			delete req;
+		}
+		this->delivering = NULL;
 	}
 
 	bool Tick(time_t now) CXX11_OVERRIDE
 	{
 		unsigned long expired = 0;
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		for (cache_list::iterator it = this->cachelru.begin(); it != this->cachelru.end(); )
 		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
+			if (IsExpired(*it, now))
 			{
 				expired++;
-				this->cache.erase(it++);
+				EraseCache(it++);
 			}
 			else
 				++it;
@@ -710,6 +960,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			// Remove all entries from the cache.
 			cache.clear();
+			cachelru.clear();
 		}
 
 		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
@@ -840,6 +1091,7 @@ class ModuleDNS : public Module
 		DNSServer = tag->getString("server");
 		SourceIP = tag->getString("sourceip");
 		SourcePort = tag->getUInt("sourceport", 0, 0, UINT16_MAX);
+		this->manager.SetCacheSize(tag->getUInt("cachesize", 1000));
 
 		if (DNSServer.empty())
 			FindDNSServer();
@@ -850,21 +1102,7 @@ class ModuleDNS : public Module
 
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
-
-			if (req->creator == mod)
-			{
-				Query rr(req->question);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
-
-				delete req;
-			}
-		}
+		this->manager.FailRequests(mod, ERROR_UNLOADED);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
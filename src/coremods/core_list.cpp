@@ -26,9 +26,143 @@
 
 #include "inspircd.h"
 
+/** Orders the channels on the network by their user count so LIST can be sent in order of
+ * user count a part at a time and a user count constraint only covers the requested range.
+ */
+class ChannelSizeIndex
+{
+ public:
+	/** The position of a channel in the index. */
+	typedef std::pair<size_t, Channel*> Key;
+
+ private:
+	typedef std::set<Key> SizeSet;
+	typedef std::map<Channel*, size_t> EntryMap;
+
+	/** Channels ordered by their user count. */
+	SizeSet sizes;
+
+	/** The user counts all indexed channels are indexed under. */
+	EntryMap entries;
+
+	/** Channels whose user count has changed since they were indexed. Some of the events which mark a
+	 * channel as changed are fired before the user count changes so they are indexed on the next query.
+	 */
+	std::set<Channel*> changed;
+
+	/** Adds a channel to the index or moves it to its current user count. */
+	void Index(Channel* chan)
+	{
+		const size_t users = chan->GetUserCounter();
+		std::pair<EntryMap::iterator, bool> res = entries.insert(std::make_pair(chan, users));
+		if (!res.second)
+		{
+			sizes.erase(Key(res.first->second, chan));
+			res.first->second = users;
+		}
+		sizes.insert(Key(users, chan));
+	}
+
+ public:
+	/** Marks a channel as changed. */
+	void Change(Channel* chan)
+	{
+		changed.insert(chan);
+	}
+
+	/** Removes a channel from the index. */
+	void Remove(Channel* chan)
+	{
+		EntryMap::iterator it = entries.find(chan);
+		if (it != entries.end())
+		{
+			sizes.erase(Key(it->second, chan));
+			entries.erase(it);
+		}
+		changed.erase(chan);
+	}
+
+	/** Indexes the channels which have changed since they were last indexed again. */
+	void Refresh()
+	{
+		for (std::set<Channel*>::const_iterator i = changed.begin(); i != changed.end(); ++i)
+			Index(*i);
+		changed.clear();
+
+		// Channels can be created without anyone joining them (e.g. permanent channels) so
+		// those which have never been indexed are looked for when the counts differ.
+		const chan_hash& chans = ServerInstance->GetChans();
+		if (entries.size() == chans.size())
+			return;
+
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		{
+			if (!entries.count(i->second))
+				Index(i->second);
+		}
+	}
+
+	/** Finds the channel which comes next in descending order of user count.
+	 * The channel at \p pos does not have to exist any more.
+	 * @param pos The position to search from, replaced with the position of the next channel.
+	 * @return True if a channel was found, false if there are no channels left.
+	 */
+	bool Next(Key& pos) const
+	{
+		SizeSet::const_iterator it = sizes.lower_bound(pos);
+		if (it == sizes.begin())
+			return false;
+
+		pos = *--it;
+		return true;
+	}
+};
+
+/** The state of a LIST which is being sent to a user. */
+struct ListCursor
+{
+	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
+	// to search for a channel creation time that is lower or higher than val
+	// respectively.
+	time_t mincreationtime;
+	time_t maxcreationtime;
+
+	// M: Searching based on mask.
+	// N: Searching based on !mask.
+	bool match_name_topic;
+	bool match_inverted;
+	std::string match;
+
+	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
+	// search for a topic time that is lower or higher than val respectively.
+	time_t mintopictime;
+	time_t maxtopictime;
+
+	// U: Searching based on user count within the channel, via the "<val" and
+	// ">val" modifiers to search for a channel that has less than or more than
+	// val users respectively.
+	size_t minusers;
+	size_t maxusers;
+
+	// The position of the last channel which was looked at in the channel size index.
+	ChannelSizeIndex::Key pos;
+
+	ListCursor()
+		: mincreationtime(0)
+		, maxcreationtime(0)
+		, match_name_topic(false)
+		, match_inverted(false)
+		, mintopictime(0)
+		, maxtopictime(0)
+		, minusers(0)
+		, maxusers(0)
+	{
+	}
+};
+
 /** Handle /LIST.
  */
-class CommandList : public Command
+class CommandList : public SplitCommand
 {
  private:
 	ChanModeReference secretmode;
@@ -46,161 +180,182 @@ class CommandList : public Command
 		return ServerInstance->Time() - (minutes * 60);
 	}
 
+	/** Sends the LIST entry of a channel to a user if it matches the constraints of their LIST. */
+	void ShowChannel(LocalUser* user, Channel* chan, const ListCursor& cursor, bool has_privs);
+
  public:
 	// Whether to show modes in the LIST response.
 	bool showmodes;
 
+	// The channels on the network ordered by their user count.
+	ChannelSizeIndex sizeindex;
+
+	// The LIST which is being sent to a user.
+	SimpleExtItem<ListCursor> cursorext;
+
 	CommandList(Module* parent)
-		: Command(parent,"LIST", 0, 0)
+		: SplitCommand(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, cursorext("list_cursor", ExtensionItem::EXT_USER, parent)
 	{
 		allow_empty_last_param = false;
 		Penalty = 5;
 	}
 
+	/** Sends the next part of the LIST a user is receiving. The LIST is sent until the send queue
+	 * of the user reaches their soft send queue limit, the rest is sent as their send queue drains.
+	 * @param user The user receiving the LIST.
+	 * @param cursor The state of the LIST.
+	 */
+	void Continue(LocalUser* user, ListCursor& cursor);
+
 	/** Handle command.
 	 * @param parameters The parameters to the command
 	 * @param user The user issuing the command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
-	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE;
 };
 
 
 /** Handle /LIST
  */
-CmdResult CommandList::Handle(User* user, const Params& parameters)
+CmdResult CommandList::HandleLocal(LocalUser* user, const Params& parameters)
 {
-	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
-	// to search for a channel creation time that is lower or higher than val
-	// respectively.
-	time_t mincreationtime = 0;
-	time_t maxcreationtime = 0;
-
-	// M: Searching based on mask.
-	// N: Searching based on !mask.
-	bool match_name_topic = false;
-	bool match_inverted = false;
-	const char* match = NULL;
-
-	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
-	// search for a topic time that is lower or higher than val respectively.
-	time_t mintopictime = 0;
-	time_t maxtopictime = 0;
-
-	// U: Searching based on user count within the channel, via the "<val" and
-	// ">val" modifiers to search for a channel that has less than or more than
-	// val users respectively.
-	size_t minusers = 0;
-	size_t maxusers = 0;
+	// If the user is still receiving a previous LIST end it before starting a new one.
+	if (cursorext.get(user))
+	{
+		cursorext.unset(user);
+		user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	}
 
+	ListCursor* cursor = new ListCursor;
 	for (Params::const_iterator iter = parameters.begin(); iter != parameters.end(); ++iter)
 	{
 		const std::string& constraint = *iter;
 		if (constraint[0] == '<')
 		{
-			maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
+			cursor->maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
 		}
 		else if (constraint[0] == '>')
 		{
-			minusers = ConvToNum<size_t>(constraint.c_str() + 1);
+			cursor->minusers = ConvToNum<size_t>(constraint.c_str() + 1);
 		}
 		else if (!constraint.compare(0, 2, "C<", 2) || !constraint.compare(0, 2, "c<", 2))
 		{
-			mincreationtime = ParseMinutes(constraint);
+			cursor->mincreationtime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "C>", 2) || !constraint.compare(0, 2, "c>", 2))
 		{
-			maxcreationtime = ParseMinutes(constraint);
+			cursor->maxcreationtime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "T<", 2) || !constraint.compare(0, 2, "t<", 2))
 		{
-			mintopictime = ParseMinutes(constraint);
+			cursor->mintopictime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "T>", 2) || !constraint.compare(0, 2, "t>", 2))
 		{
-			maxtopictime = ParseMinutes(constraint);
+			cursor->maxtopictime = ParseMinutes(constraint);
 		}
 		else
 		{
 			// If the glob is prefixed with ! it is inverted.
-			match = constraint.c_str();
-			if (match[0] == '!')
+			cursor->match = constraint;
+			if (cursor->match[0] == '!')
 			{
-				match_inverted = true;
-				match += 1;
+				cursor->match_inverted = true;
+				cursor->match.erase(0, 1);
 			}
 
 			// Ensure that the user didn't just run "LIST !".
-			if (match[0])
-				match_name_topic = true;
+			if (!cursor->match.empty())
+				cursor->match_name_topic = true;
 		}
 	}
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
+	// Channels are sent in descending order of user count starting below the maximum if one was given.
+	cursor->pos = ChannelSizeIndex::Key(cursor->maxusers ? cursor->maxusers : std::numeric_limits<size_t>::max(), NULL);
+	cursorext.set(user, cursor);
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	Continue(user, *cursor);
+	return CMD_SUCCESS;
+}
+
+void CommandList::Continue(LocalUser* user, ListCursor& cursor)
+{
+	sizeindex.Refresh();
+
+	const bool has_privs = user->HasPrivPermission("channels/auspex");
+	const unsigned long budget = user->MyClass->GetSendqSoftMax();
+	while (user->eh.getSendQSize() < budget)
 	{
-		Channel* const chan = i->second;
+		// Stop when there are no channels left with more than the minimum user count.
+		if (!sizeindex.Next(cursor.pos) || (cursor.minusers && cursor.pos.first <= cursor.minusers))
+		{
+			cursorext.unset(user);
+			user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+			return;
+		}
 
-		// Check the user count if a search has been specified.
-		const size_t users = chan->GetUserCounter();
-		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
-			continue;
+		ShowChannel(user, cursor.pos.second, cursor, has_privs);
+	}
+}
 
-		// Check the creation ts if a search has been specified.
-		const time_t creationtime = chan->age;
-		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
-			continue;
+void CommandList::ShowChannel(LocalUser* user, Channel* chan, const ListCursor& cursor, bool has_privs)
+{
+	// Check the user count if a search has been specified.
+	const size_t users = chan->GetUserCounter();
+	if ((cursor.minusers && users <= cursor.minusers) || (cursor.maxusers && users >= cursor.maxusers))
+		return;
 
-		// Check the topic ts if a search has been specified.
-		const time_t topictime = chan->topicset;
-		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
-			continue;
+	// Check the creation ts if a search has been specified.
+	const time_t creationtime = chan->age;
+	if ((cursor.mincreationtime && creationtime <= cursor.mincreationtime) || (cursor.maxcreationtime && creationtime >= cursor.maxcreationtime))
+		return;
 
-		// Attempt to match a glob pattern.
-		if (match_name_topic)
-		{
-			bool matches = InspIRCd::Match(chan->name, match) || InspIRCd::Match(chan->topic, match);
+	// Check the topic ts if a search has been specified.
+	const time_t topictime = chan->topicset;
+	if ((cursor.mintopictime && (!topictime || topictime <= cursor.mintopictime)) || (cursor.maxtopictime && (!topictime || topictime >= cursor.maxtopictime)))
+		return;
 
-			// The user specified an match that we did not match.
-			if (!matches && !match_inverted)
-				continue;
+	// Attempt to match a glob pattern.
+	if (cursor.match_name_topic)
+	{
+		bool matches = InspIRCd::Match(chan->name, cursor.match) || InspIRCd::Match(chan->topic, cursor.match);
 
-			// The user specified an inverted match that we did match.
-			if (matches && match_inverted)
-				continue;
-		}
+		// The user specified an match that we did not match.
+		if (!matches && !cursor.match_inverted)
+			return;
+
+		// The user specified an inverted match that we did match.
+		if (matches && cursor.match_inverted)
+			return;
+	}
 
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (has_privs || chan->HasUser(user));
+	// if the channel is not private/secret, OR the user is on the channel anyway
+	bool n = (has_privs || chan->HasUser(user));
 
-		// If we're not in the channel and +s is set on it, we want to ignore it
-		if ((n) || (!chan->IsModeSet(secretmode)))
+	// If we're not in the channel and +s is set on it, we want to ignore it
+	if ((n) || (!chan->IsModeSet(secretmode)))
+	{
+		if ((!n) && (chan->IsModeSet(privatemode)))
 		{
-			if ((!n) && (chan->IsModeSet(privatemode)))
-			{
-				// Channel is private (+p) and user is outside/not privileged
-				user->WriteNumeric(RPL_LIST, '*', users, "");
-			}
-			else if (showmodes)
-			{
-				// Show the list response with the modes and topic.
-				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
-			}
-			else
-			{
-				// Show the list response with just the modes.
-				user->WriteNumeric(RPL_LIST, chan->name, users, chan->topic);
-			}
+			// Channel is private (+p) and user is outside/not privileged
+			user->WriteNumeric(RPL_LIST, '*', users, "");
+		}
+		else if (showmodes)
+		{
+			// Show the list response with the modes and topic.
+			user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
+		}
+		else
+		{
+			// Show the list response with just the modes.
+			user->WriteNumeric(RPL_LIST, chan->name, users, chan->topic);
 		}
 	}
-	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
-
-	return CMD_SUCCESS;
 }
 
 class CoreModList : public Module
@@ -226,6 +381,40 @@ class CoreModList : public Module
 		tokens["SAFELIST"];
 	}
 
+	void OnUserWriteReady(LocalUser* user) CXX11_OVERRIDE
+	{
+		// Send the next part of a LIST once half of the previous one has been sent.
+		ListCursor* cursor = cmd.cursorext.get(user);
+		if (cursor && user->eh.getSendQSize() < user->MyClass->GetSendqSoftMax() / 2)
+			cmd.Continue(user, *cursor);
+	}
+
+	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& except) CXX11_OVERRIDE
+	{
+		cmd.sizeindex.Change(memb->chan);
+	}
+
+	void OnUserPart(Membership* memb, std::string& partmessage, CUList& except) CXX11_OVERRIDE
+	{
+		cmd.sizeindex.Change(memb->chan);
+	}
+
+	void OnUserKick(User* source, Membership* memb, const std::string& reason, CUList& except) CXX11_OVERRIDE
+	{
+		cmd.sizeindex.Change(memb->chan);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			cmd.sizeindex.Change((*i)->chan);
+	}
+
+	void OnChannelDelete(Channel* chan) CXX11_OVERRIDE
+	{
+		cmd.sizeindex.Remove(chan);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides the LIST command", VF_VENDOR|VF_CORE);
@@ -130,7 +130,8 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 		}
 	}
 
-	parseoutput.cmd.assign(token);
+	// The token is not needed anymore so hand its buffer over instead of copying it.
+	parseoutput.cmd.swap(token);
 
 	// Build the parameter map. We intentionally do not respect the RFC 1459
 	// thirteen parameter limit here.
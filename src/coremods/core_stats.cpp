@@ -68,6 +68,14 @@ class CommandStats : public Command
 	}
 };
 
+static std::string FormatHookStats(const std::string& modname, const std::string& hookname, const HookStats& hs)
+{
+	std::string row = InspIRCd::Format("%s %s calls %lu", modname.c_str(), hookname.c_str(), hs.calls);
+	if (hs.time)
+		row.append(InspIRCd::Format(" time %lluus avg %lluns", hs.time / 1000, hs.time / hs.calls));
+	return row;
+}
+
 static void GenerateStatsLl(Stats::Context& stats)
 {
 	stats.AddRow(211, InspIRCd::Format("nick[ident@%s] sendq cmds_out bytes_out cmds_in bytes_in time_open", (stats.GetSymbol() == 'l' ? "host" : "ip")));
@@ -234,6 +242,50 @@ void CommandStats::DoStats(Stats::Context& stats)
 		}
 		break;
 
+		/* stats h (module hook call statistics) */
+		case 'h':
+		{
+			const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+			for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+			{
+				Module* mod = i->second;
+				for (unsigned int hook = 0; hook < I_END; ++hook)
+				{
+					// Skip the hooks which the module does not implement, these were called once before being detached.
+					const HookStats& hs = mod->hookstats[hook];
+					if (hs.calls && stdalgo::isin(ServerInstance->Modules->EventHandlers[hook], mod))
+						stats.AddRow(249, FormatHookStats(i->first, ModuleManager::GetHookName(static_cast<Implementation>(hook)), hs));
+				}
+			}
+
+			// Event providers are named event/<name>, like ModuleEventListener we rely on that to
+			// find them. Several providers may share one subscriber list, only show each list once.
+			std::set<const Events::ModuleEventProvider::SubscriberList*> seen;
+			const std::multimap<std::string, ServiceProvider*, irc::insensitive_swo>& providers = ServerInstance->Modules->DataProviders;
+			for (std::multimap<std::string, ServiceProvider*, irc::insensitive_swo>::const_iterator i = providers.lower_bound("event/"); i != providers.end(); ++i)
+			{
+				if (i->first.compare(0, 6, "event/"))
+					break;
+
+				const Events::ModuleEventProvider* evprov = static_cast<Events::ModuleEventProvider*>(i->second);
+				const Events::ModuleEventProvider::SubscriberList& subscribers = evprov->GetSubscribers();
+				if (!seen.insert(&subscribers).second)
+					continue;
+
+				for (Events::ModuleEventProvider::SubscriberList::const_iterator j = subscribers.begin(); j != subscribers.end(); ++j)
+				{
+					const Events::ModuleEventListener* listener = *j;
+					if (!listener->hookstats.calls)
+						continue;
+
+					// Listeners which are part of the core do not belong to a module.
+					const Module* mod = listener->GetModule();
+					stats.AddRow(249, FormatHookStats(mod ? mod->ModuleSourceFile : "core", listener->GetEventName(), listener->hookstats));
+				}
+			}
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
@@ -318,6 +370,7 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "unknown commands "+ConvToStr(ServerInstance->stats.Unknown));
 			stats.AddRow(249, "nick collisions "+ConvToStr(ServerInstance->stats.Collisions));
 			stats.AddRow(249, "dns requests "+ConvToStr(ServerInstance->stats.DnsGood+ServerInstance->stats.DnsBad)+" succeeded "+ConvToStr(ServerInstance->stats.DnsGood)+" failed "+ConvToStr(ServerInstance->stats.DnsBad));
+			stats.AddRow(249, "dns cache hits "+ConvToStr(ServerInstance->stats.DnsCacheHits)+" misses "+ConvToStr(ServerInstance->stats.DnsCacheMisses)+" evictions "+ConvToStr(ServerInstance->stats.DnsCacheEvictions));
 			stats.AddRow(249, "connection count "+ConvToStr(ServerInstance->stats.Connects));
 			stats.AddRow(249, InspIRCd::Format("bytes sent %5.2fK recv %5.2fK",
 				ServerInstance->stats.Sent / 1024.0, ServerInstance->stats.Recv / 1024.0));
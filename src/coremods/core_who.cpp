@@ -111,6 +111,226 @@ struct WhoData : public Who::Request
 	}
 };
 
+/** Indexes the users on the network by the fields which WHO queries commonly match against so
+ * a query can start from the users which can possibly match instead of scanning every user.
+ * The indexes only narrow down the candidates, each candidate is still checked against the query.
+ */
+class WhoIndex
+{
+ public:
+	typedef std::multimap<std::string, User*> StringIndex;
+	typedef std::multimap<Server*, User*> ServerIndex;
+
+ private:
+	/** The positions of a user in the indexes. */
+	struct Entry
+	{
+		StringIndex::iterator displayhost;
+		StringIndex::iterator realhost;
+		StringIndex::iterator ip;
+		StringIndex::iterator account;
+		ServerIndex::iterator server;
+	};
+	typedef std::map<User*, Entry> EntryMap;
+
+	/** The positions of all indexed users. */
+	EntryMap entries;
+
+	/** Users who have changed since they were indexed. Some of the events which mark a user as changed
+	 * are fired before the change is made so these users are indexed again on the next query.
+	 */
+	std::set<User*> changed;
+
+	/** Displayed hosts, reversed so users can be looked up by host suffix. */
+	StringIndex displayhosts;
+
+	/** Real hosts, reversed so users can be looked up by host suffix. */
+	StringIndex realhosts;
+
+	/** IP addresses. */
+	StringIndex ips;
+
+	/** Account names. */
+	StringIndex accounts;
+
+	/** The servers users are connected to. */
+	ServerIndex servers;
+
+	/** Converts a string to the form it is indexed in. */
+	static std::string MapString(const std::string& str, unsigned const char* map, bool reverse)
+	{
+		std::string out;
+		out.reserve(str.length());
+		for (std::string::const_iterator i = str.begin(); i != str.end(); ++i)
+			out.push_back(map[static_cast<unsigned char>(*i)]);
+		if (reverse)
+			std::reverse(out.begin(), out.end());
+		return out;
+	}
+
+	/** Adds the current details of a user to the indexes. */
+	void Insert(User* user, Entry& entry)
+	{
+		entry.displayhost = displayhosts.insert(std::make_pair(MapString(user->GetDisplayedHost(), ascii_case_insensitive_map, true), user));
+		entry.realhost = realhosts.insert(std::make_pair(MapString(user->GetRealHost(), ascii_case_insensitive_map, true), user));
+		entry.ip = ips.insert(std::make_pair(MapString(user->GetIPString(), ascii_case_insensitive_map, false), user));
+		entry.server = servers.insert(std::make_pair(user->server, user));
+
+		const AccountExtItem* accountext = GetAccountExtItem();
+		const std::string* account = accountext ? accountext->get(user) : NULL;
+		if (account)
+			entry.account = accounts.insert(std::make_pair(MapString(*account, national_case_insensitive_map, false), user));
+		else
+			entry.account = accounts.end();
+	}
+
+	/** Removes a user from the indexes. */
+	void Erase(const Entry& entry)
+	{
+		displayhosts.erase(entry.displayhost);
+		realhosts.erase(entry.realhost);
+		ips.erase(entry.ip);
+		servers.erase(entry.server);
+		if (entry.account != accounts.end())
+			accounts.erase(entry.account);
+	}
+
+	/** Finds the users whose key in an index starts with the given prefix. */
+	static void FindPrefix(const StringIndex& index, const std::string& prefix, std::vector<User*>& out)
+	{
+		for (StringIndex::const_iterator i = index.lower_bound(prefix); i != index.end(); ++i)
+		{
+			if (i->first.compare(0, prefix.length(), prefix))
+				break;
+			out.push_back(i->second);
+		}
+	}
+
+ public:
+	/** Adds a fully connected user to the indexes. */
+	void Add(User* user)
+	{
+		std::pair<EntryMap::iterator, bool> res = entries.insert(std::make_pair(user, Entry()));
+		if (res.second)
+			Insert(user, res.first->second);
+	}
+
+	/** Removes a user from the indexes. */
+	void Remove(User* user)
+	{
+		EntryMap::iterator it = entries.find(user);
+		if (it == entries.end())
+			return;
+
+		Erase(it->second);
+		entries.erase(it);
+		changed.erase(user);
+	}
+
+	/** Marks an indexed user as changed. */
+	void Change(User* user)
+	{
+		if (entries.count(user))
+			changed.insert(user);
+	}
+
+	/** Indexes the users who have changed since they were last indexed again. */
+	void Refresh()
+	{
+		for (std::set<User*>::const_iterator i = changed.begin(); i != changed.end(); ++i)
+		{
+			Entry& entry = entries[*i];
+			Erase(entry);
+			Insert(*i, entry);
+		}
+		changed.clear();
+	}
+
+	/** Finds the users whose displayed or real host can match a glob pattern.
+	 * @return False if the pattern does not end in any literal text so the index can not be used.
+	 */
+	bool FindHosts(const std::string& mask, bool real, std::vector<User*>& out) const
+	{
+		const std::string::size_type wildcard = mask.find_last_of("*?");
+		const std::string suffix = (wildcard == std::string::npos) ? mask : mask.substr(wildcard + 1);
+		if (suffix.empty())
+			return false;
+
+		FindPrefix(real ? realhosts : displayhosts, MapString(suffix, ascii_case_insensitive_map, true), out);
+		return true;
+	}
+
+	/** Finds the users whose IP address can match a glob pattern or an IPv4 CIDR range.
+	 * @return False if the pattern does not start with any literal text so the index can not be used.
+	 */
+	bool FindIPs(const std::string& mask, std::vector<User*>& out) const
+	{
+		// Masks in the ident@ip form are matched against the IP after the @ in a way that is not indexed.
+		if (mask.find('@') != std::string::npos)
+			return false;
+
+		std::string prefix = mask.substr(0, mask.find_first_of("*?"));
+		const std::string::size_type slash = mask.rfind('/');
+		if (slash != std::string::npos)
+		{
+			// The address of a CIDR range has no wildcards. The users in the range have the octets
+			// which are entirely covered by the prefix length in common.
+			irc::sockets::sockaddrs sa;
+			if (!irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+				return false;
+			if (sa.family() != AF_INET)
+				return false;
+
+			const std::string addr = sa.addr();
+			const unsigned int octets = ConvToNum<unsigned int>(mask.substr(slash + 1)) / 8;
+			std::string::size_type length = 0;
+			for (unsigned int i = 0; i < octets; ++i)
+			{
+				const std::string::size_type dot = addr.find('.', length);
+				length = (dot == std::string::npos) ? addr.length() : dot + 1;
+			}
+
+			// The glob match is tried too so the literal text of the mask has to start with the octets.
+			prefix.assign(addr, 0, length);
+			if (mask.compare(0, prefix.length(), prefix))
+				return false;
+		}
+
+		if (prefix.empty())
+			return false;
+
+		FindPrefix(ips, MapString(prefix, ascii_case_insensitive_map, false), out);
+		return true;
+	}
+
+	/** Finds the users whose account name can match a glob pattern.
+	 * @return False if the pattern does not start with any literal text so the index can not be used.
+	 */
+	bool FindAccounts(const std::string& mask, std::vector<User*>& out) const
+	{
+		const std::string prefix = mask.substr(0, mask.find_first_of("*?"));
+		if (prefix.empty())
+			return false;
+
+		FindPrefix(accounts, MapString(prefix, national_case_insensitive_map, false), out);
+		return true;
+	}
+
+	/** Finds the users on servers whose name matches a glob pattern. */
+	void FindServers(const std::string& mask, std::vector<User*>& out) const
+	{
+		for (ServerIndex::const_iterator i = servers.begin(); i != servers.end(); i = servers.upper_bound(i->first))
+		{
+			if (!InspIRCd::Match(i->first->GetName(), mask, ascii_case_insensitive_map))
+				continue;
+
+			std::pair<ServerIndex::const_iterator, ServerIndex::const_iterator> range = servers.equal_range(i->first);
+			for (ServerIndex::const_iterator j = range.first; j != range.second; ++j)
+				out.push_back(j->second);
+		}
+	}
+};
+
 class CommandWho : public SplitCommand
 {
  private:
@@ -167,7 +387,15 @@ class CommandWho : public SplitCommand
 	template<typename T>
 	void WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data);
 
+	/** Finds the users which can match a WHO request using the indexes.
+	 * @return False if the request can not be narrowed down by an index.
+	 */
+	bool FindCandidates(LocalUser* source, WhoData& data, std::vector<User*>& out);
+
  public:
+	/** Indexes of the users on the network. */
+	WhoIndex index;
+
 	CommandWho(Module* parent)
 		: SplitCommand(parent, "WHO", 1, 3)
 		, secretmode(parent, "secret")
@@ -188,6 +416,7 @@ class CommandWho : public SplitCommand
 
 template<> User* CommandWho::GetUser(UserManager::OperList::const_iterator& t) { return *t; }
 template<> User* CommandWho::GetUser(user_hash::const_iterator& t) { return t->second; }
+template<> User* CommandWho::GetUser(UserManager::LocalList::const_iterator& t) { return *t; }
 
 bool CommandWho::MatchChannel(LocalUser* source, Membership* memb, WhoData& data)
 {
@@ -238,6 +467,10 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 	if (data.flags['l'] && source_can_see_server && !lu)
 		return false;
 
+	// Only show operators if the oper flag has been specified.
+	if (data.flags['o'] && !user->IsOper())
+		return false;
+
 	// The source wants to match against users' away messages.
 	bool match = false;
 	if (data.flags['A'])
@@ -408,6 +641,46 @@ void CommandWho::WhoUsers(LocalUser* source, const std::vector<std::string>& par
 	}
 }
 
+bool CommandWho::FindCandidates(LocalUser* source, WhoData& data, std::vector<User*>& out)
+{
+	// The flags are checked in the same order as MatchUser checks them.
+	if (data.flags['A'])
+		return false;
+
+	index.Refresh();
+	if (data.flags['a'])
+		return index.FindAccounts(data.matchtext, out);
+
+	if (data.flags['h'])
+	{
+		// If the source asks for real hosts without being able to see them the hosts
+		// which are matched differ between users so the index can not be used.
+		const bool real = data.flags['x'];
+		if (real && !source->HasPrivPermission("users/auspex"))
+			return false;
+		return index.FindHosts(data.matchtext, real, out);
+	}
+
+	if (data.flags['i'])
+		return index.FindIPs(data.matchtext, out);
+
+	if (data.flags['m'] || data.flags['n'] || data.flags['p'] || data.flags['r'])
+		return false;
+
+	if (data.flags['s'])
+	{
+		// If the source can not see server names every user is on the same server.
+		bool show_real_server_name = ServerInstance->Config->HideServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
+		if (!show_real_server_name)
+			return false;
+
+		index.FindServers(data.matchtext, out);
+		return true;
+	}
+
+	return false;
+}
+
 void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>& parameters, Membership* memb, User* user, WhoData& data)
 {
 	if (!memb)
@@ -563,13 +836,33 @@ CmdResult CommandWho::HandleLocal(LocalUser* user, const Params& parameters)
 	if (chan)
 		WhoChannel(user, parameters, chan, data);
 
-	// If we only want to match against opers we only have to iterate the oper list.
-	else if (data.flags['o'])
-		WhoUsers(user, parameters, ServerInstance->Users->all_opers, data);
-
-	// Otherwise we have to use the global user list.
+	// Otherwise use the smallest list of users which contains every user who can match.
 	else
-		WhoUsers(user, parameters, ServerInstance->Users->GetUsers(), data);
+	{
+		std::vector<User*> candidates;
+		const bool indexed = FindCandidates(user, data, candidates);
+		size_t best = indexed ? candidates.size() : ServerInstance->Users->GetUsers().size();
+
+		// If we only want to match against opers we only have to iterate the oper list.
+		const UserManager::OperList& opers = ServerInstance->Users->all_opers;
+		const bool use_opers = data.flags['o'] && opers.size() <= best;
+		if (use_opers)
+			best = opers.size();
+
+		// If we only want to match against local users we only have to iterate the local user list.
+		const UserManager::LocalList& locals = ServerInstance->Users->GetLocalUsers();
+		const bool source_can_see_server = ServerInstance->Config->HideServer.empty() || user->HasPrivPermission("users/auspex");
+		const bool use_locals = data.flags['l'] && source_can_see_server && locals.size() < best;
+
+		if (use_locals)
+			WhoUsers(user, parameters, locals, data);
+		else if (use_opers)
+			WhoUsers(user, parameters, opers, data);
+		else if (indexed)
+			WhoUsers(user, parameters, candidates, data);
+		else
+			WhoUsers(user, parameters, ServerInstance->Users->GetUsers(), data);
+	}
 
 	// Send the results to the source.
 	for (std::vector<Numeric::Numeric>::const_iterator n = data.results.begin(); n != data.results.end(); ++n)
@@ -581,15 +874,61 @@ CmdResult CommandWho::HandleLocal(LocalUser* user, const Params& parameters)
 	return CMD_SUCCESS;
 }
 
-class CoreModWho : public Module
+class CoreModWho
+	: public Module
+	, public AccountEventListener
 {
  private:
 	CommandWho cmd;
 
  public:
 	CoreModWho()
-		: cmd(this)
+		: AccountEventListener(this)
+		, cmd(this)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		const user_hash& users = ServerInstance->Users->GetUsers();
+		for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			User* user = i->second;
+			if (user->registered == REG_ALL && !user->quitting)
+				cmd.index.Add(user);
+		}
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		// The user may have been disconnected by a module which handled this event before us.
+		if (!user->quitting)
+			cmd.index.Add(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		cmd.index.Remove(user);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		cmd.index.Change(user);
+	}
+
+	void OnChangeRealHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		cmd.index.Change(user);
+	}
+
+	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
+	{
+		cmd.index.Change(user);
+	}
+
+	void OnAccountChange(User* user, const std::string& newaccount) CXX11_OVERRIDE
 	{
+		cmd.index.Change(user);
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
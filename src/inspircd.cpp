@@ -691,7 +691,6 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnGarbageCollect, ());
 
 			Timers.TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
@@ -708,7 +707,10 @@ void InspIRCd::Run()
 		 * dispatched to their handlers.
 		 */
 		SocketEngine::DispatchTrialWrites();
-		SocketEngine::DispatchEvents();
+		SocketEngine::DispatchEvents(!XLines->IsApplyingLines() && !SocketEngine::HasTrialWrites());
+
+		/* apply the rest of a large batch of X-lines a bit at a time */
+		XLines->ContinueApplyLines();
 
 		/* if any users were quit, take them out */
 		GlobalCulls.Apply();
@@ -140,14 +140,36 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	RecvQLineReader reader(recvq);
+	if (!reader.GetNextLine(delim))
 		return false;
-	line.assign(recvq, 0, i);
-	recvq.erase(0, i + 1);
+	line.assign(reader.line, reader.length);
 	return true;
 }
 
+bool RecvQLineReader::GetNextLine(char delim, size_t skip)
+{
+	if (pos + skip >= recvq.size())
+		return false;
+
+	// memchr is vectorised by the C library which makes it much faster than a byte by byte search.
+	const char* const start = recvq.data() + pos;
+	const char* const eol = static_cast<const char*>(memchr(start + skip, delim, recvq.size() - pos - skip));
+	if (!eol)
+		return false;
+
+	line = start;
+	length = eol - start;
+	pos += length + 1;
+	return true;
+}
+
+void RecvQLineReader::Compact()
+{
+	recvq.erase(0, std::min(pos, recvq.size()));
+	pos = 0;
+}
+
 int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
 {
 	if (!hook)
@@ -156,9 +178,10 @@ int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
 	IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
 	if (iohm)
 	{
-		// Call the next hook to put data into the recvq of the current hook
+		// Call the next hook to put data into the recvq of the current hook. If nothing new
+		// was read the current hook is still called when it has data left over to process.
 		const int ret = HookChainRead(iohm->GetNextHook(), iohm->GetRecvQ());
-		if (ret <= 0)
+		if ((ret < 0) || ((ret == 0) && (iohm->GetRecvQ().empty())))
 			return ret;
 	}
 	return hook->OnStreamSocketRead(this, rq);
@@ -383,6 +406,21 @@ void StreamSocket::WriteData(const std::string &data)
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const SendQueue::Element& data)
+{
+	if (!HasFd())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %.*s",
+			(int)data.length(), data.data());
+		return;
+	}
+
+	/* Append a reference to the (possibly shared) buffer to the back of the queue ready for writing */
+	sendq.push_back(data);
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
@@ -544,6 +582,12 @@ void StreamSocket::AddIOHook(IOHook* newhook)
 	lasthook->SetNextHook(newhook);
 }
 
+void StreamSocket::AddIOHookFront(IOHookMiddle* newhook)
+{
+	newhook->SetNextHook(iohook);
+	iohook = newhook;
+}
+
 size_t StreamSocket::getSendQSize() const
 {
 	size_t ret = sendq.bytes();
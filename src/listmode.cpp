@@ -33,6 +33,335 @@ ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modech
 	list = true;
 }
 
+namespace
+{
+	/** The match serial given to the most recently compiled list. */
+	unsigned long lastmatchserial = 0;
+
+	/** Returned by ListModeBase::GetExtBans() for channels without a list. */
+	const std::vector<std::string> noextbans;
+
+	/** Determines whether a host part of a hostmask is a CIDR range that MatchCIDR() would accept.
+	 * @param range The host part to check.
+	 * @return True if range is a CIDR range, false otherwise.
+	 */
+	bool IsCIDRRange(const std::string& range)
+	{
+		const std::string::size_type slash = range.rfind('/');
+		if ((slash == std::string::npos) || (slash == range.length() - 1)
+			|| (range.find_first_not_of("0123456789", slash + 1) != std::string::npos)
+			|| (range.find_first_not_of("0123456789abcdefABCDEF.:") < slash))
+			return false;
+
+		irc::sockets::sockaddrs sa;
+		return irc::sockets::aptosa(range.substr(0, slash), 0, sa);
+	}
+
+	/** Determines whether a string ends with the given text, using the national case mapping.
+	 * @param str The string to check.
+	 * @param tail The text the string should end with.
+	 * @return True if str ends with tail, false otherwise.
+	 */
+	bool EndsWith(const std::string& str, const std::string& tail)
+	{
+		if (str.length() < tail.length())
+			return false;
+
+		std::string::const_iterator i = str.end() - tail.length();
+		for (std::string::const_iterator j = tail.begin(); j != tail.end(); ++i, ++j)
+		{
+			if (national_case_insensitive_map[static_cast<unsigned char>(*i)] != national_case_insensitive_map[static_cast<unsigned char>(*j)])
+				return false;
+		}
+		return true;
+	}
+}
+
+/** The hostmasks of a list split up by the kind of their host part. A user matches a hostmask
+ * when their nick!ident matches the part before the first \@ and either their real host, their
+ * displayed host or their IP address matches the host part. Instead of checking every entry,
+ * literal host parts are looked up by the hosts of the user, CIDR ranges by the IP address of
+ * the user and wildcard host parts are only fully matched if the hosts end with the right text.
+ */
+class ListModeBase::Matcher
+{
+	/** Maps literal host parts to the nick!ident parts of the entries with that host part. */
+	typedef TR1NS::unordered_multimap<std::string, std::string, irc::insensitive, irc::StrHashComp> LiteralMap;
+
+	/** Maps CIDR ranges to the nick!ident parts of the entries with that range as their host part. */
+	typedef std::multimap<irc::sockets::cidr_mask, std::string> RangeMap;
+
+	/** An entry with wildcards in its host part. */
+	struct WildEntry
+	{
+		/** The nick!ident part of the entry. */
+		std::string prefix;
+
+		/** The host part of the entry. */
+		std::string host;
+
+		/** The text after the last wildcard of the host part. */
+		std::string tail;
+	};
+
+	/** The entries of one kind, either the hostmasks or the masks of the extbans of one type. */
+	struct MaskSet
+	{
+		LiteralMap literals;
+		RangeMap ranges;
+
+		/** The distinct lengths of the keys in ranges. */
+		std::vector<unsigned char> rangelengths;
+
+		std::vector<WildEntry> wildcards;
+
+		/** The masks of the extbans of this type as they are on the list, unused for the hostmasks. */
+		std::vector<std::string> masks;
+
+		void Add(const std::string& mask);
+		bool Match(User* user) const;
+		bool MatchHost(const std::string& nickident, const std::string& host) const;
+		bool MatchLiteral(const std::string& host, const std::string& nickident) const;
+	};
+
+	/** The entries which are hostmasks. */
+	MaskSet hostmasks;
+
+	/** The masks of the extbans, by extban type. */
+	insp::flat_map<char, MaskSet> extbans;
+
+	/** Every extban on the list. */
+	std::vector<std::string> extbanlist;
+
+	/** Retrieves the entries of the given kind.
+	 * @param type Zero for the hostmasks or the type of the extbans.
+	 * @return The entries of the given kind or NULL if there are none.
+	 */
+	const MaskSet* GetSet(char type) const
+	{
+		if (!type)
+			return &hostmasks;
+
+		insp::flat_map<char, MaskSet>::const_iterator i = extbans.find(type);
+		return (i != extbans.end()) ? &i->second : NULL;
+	}
+
+ public:
+	/** The national case mapping at the time the list was compiled. */
+	const unsigned char* const casemap;
+
+	/** The match serial of this compiled list. */
+	const unsigned long serial;
+
+	Matcher(const ModeList& list)
+		: casemap(national_case_insensitive_map)
+		, serial(++lastmatchserial)
+	{
+		for (ModeList::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			const std::string& mask = i->mask;
+			if (mask.length() <= 2)
+				continue;
+
+			if (mask[1] == ':')
+			{
+				MaskSet& set = extbans[mask[0]];
+				set.masks.push_back(mask.substr(2));
+				set.Add(set.masks.back());
+				extbanlist.push_back(mask);
+			}
+			else
+				hostmasks.Add(mask);
+		}
+	}
+
+	bool Match(User* user, char type) const
+	{
+		const MaskSet* set = GetSet(type);
+		return set && set->Match(user);
+	}
+
+	bool MatchHost(const std::string& nickident, const std::string& host, char type) const
+	{
+		const MaskSet* set = GetSet(type);
+		return set && set->MatchHost(nickident, host);
+	}
+
+	const std::vector<std::string>& GetExtBans(char type) const
+	{
+		if (!type)
+			return extbanlist;
+
+		const MaskSet* set = GetSet(type);
+		return set ? set->masks : noextbans;
+	}
+};
+
+void ListModeBase::Matcher::MaskSet::Add(const std::string& mask)
+{
+	// Masks which are this short can't match anything, see Channel::CheckBan().
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+		return;
+
+	const std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	const std::string prefix(mask, 0, at);
+	const std::string host(mask, at + 1);
+
+	// Like MatchCIDR() only use the part after the last @ as the IP range.
+	const std::string range(host, host.rfind('@') + 1);
+	if (IsCIDRRange(range))
+	{
+		const irc::sockets::cidr_mask cidr(range);
+		ranges.insert(std::make_pair(cidr, prefix));
+		if (!stdalgo::isin(rangelengths, cidr.length))
+			rangelengths.push_back(cidr.length);
+	}
+
+	const std::string::size_type wild = host.find_last_of("*?");
+	if (wild == std::string::npos)
+	{
+		literals.insert(std::make_pair(host, prefix));
+		return;
+	}
+
+	WildEntry entry;
+	entry.prefix = prefix;
+	entry.host = host;
+	entry.tail.assign(host, wild + 1, std::string::npos);
+	wildcards.push_back(entry);
+}
+
+bool ListModeBase::Matcher::MaskSet::MatchLiteral(const std::string& host, const std::string& nickident) const
+{
+	std::pair<LiteralMap::const_iterator, LiteralMap::const_iterator> matches = literals.equal_range(host);
+	for (LiteralMap::const_iterator i = matches.first; i != matches.second; ++i)
+	{
+		if (InspIRCd::Match(nickident, i->second))
+			return true;
+	}
+	return false;
+}
+
+bool ListModeBase::Matcher::MaskSet::Match(User* user) const
+{
+	const std::string& nickident = user->GetNickIdent();
+	const std::string& realhost = user->GetRealHost();
+	const std::string& displayhost = user->GetDisplayedHost();
+	const std::string& ip = user->GetIPString();
+
+	if (!literals.empty())
+	{
+		if (MatchLiteral(realhost, nickident) || MatchLiteral(ip, nickident))
+			return true;
+		if ((displayhost != realhost) && MatchLiteral(displayhost, nickident))
+			return true;
+	}
+
+	const int family = user->client_sa.family();
+	if ((family == AF_INET) || (family == AF_INET6))
+	{
+		for (std::vector<unsigned char>::const_iterator i = rangelengths.begin(); i != rangelengths.end(); ++i)
+		{
+			const irc::sockets::cidr_mask cidr(user->client_sa, *i);
+			std::pair<RangeMap::const_iterator, RangeMap::const_iterator> matches = ranges.equal_range(cidr);
+			for (RangeMap::const_iterator j = matches.first; j != matches.second; ++j)
+			{
+				if (InspIRCd::Match(nickident, j->second))
+					return true;
+			}
+		}
+	}
+
+	for (std::vector<WildEntry>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		const WildEntry& entry = *i;
+		if (!entry.tail.empty() && !EndsWith(realhost, entry.tail) && !EndsWith(displayhost, entry.tail) && !EndsWith(ip, entry.tail))
+			continue;
+
+		if (!InspIRCd::Match(nickident, entry.prefix))
+			continue;
+
+		if (InspIRCd::Match(realhost, entry.host) || InspIRCd::Match(displayhost, entry.host) || InspIRCd::Match(ip, entry.host))
+			return true;
+	}
+	return false;
+}
+
+bool ListModeBase::Matcher::MaskSet::MatchHost(const std::string& nickident, const std::string& host) const
+{
+	if (MatchLiteral(host, nickident))
+		return true;
+
+	for (std::vector<WildEntry>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		const WildEntry& entry = *i;
+		if (EndsWith(host, entry.tail) && InspIRCd::Match(nickident, entry.prefix) && InspIRCd::Match(host, entry.host))
+			return true;
+	}
+	return false;
+}
+
+ListModeBase::ChanData::~ChanData()
+{
+	delete matcher;
+}
+
+void ListModeBase::ChanData::ResetMatcher()
+{
+	delete matcher;
+	matcher = NULL;
+}
+
+ListModeBase::Matcher* ListModeBase::GetMatcher(ChanData* cd)
+{
+	// The literal host index depends on the case mapping so recompile if it has changed.
+	if ((cd->matcher) && (cd->matcher->casemap != national_case_insensitive_map))
+		cd->ResetMatcher();
+
+	if (!cd->matcher)
+		cd->matcher = new Matcher(cd->list);
+	return cd->matcher;
+}
+
+bool ListModeBase::MatchUser(Channel* channel, User* user, char type)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return false;
+
+	return GetMatcher(cd)->Match(user, type);
+}
+
+bool ListModeBase::MatchHost(Channel* channel, const std::string& nickident, const std::string& host, char type)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return false;
+
+	return GetMatcher(cd)->MatchHost(nickident, host, type);
+}
+
+const std::vector<std::string>& ListModeBase::GetExtBans(Channel* channel, char type)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return noextbans;
+
+	return GetMatcher(cd)->GetExtBans(type);
+}
+
+unsigned long ListModeBase::GetMatchSerial(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return 0;
+
+	return GetMatcher(cd)->serial;
+}
+
 void ListModeBase::DisplayList(User* user, Channel* channel)
 {
 	ChanData* cd = extItem.get(channel);
@@ -205,6 +534,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->ResetMatcher();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -223,6 +553,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 				if (parameter == it->mask)
 				{
 					stdalgo::vector::swaperase(cd->list, it);
+					cd->ResetMatcher();
 					return MODEACTION_ALLOW;
 				}
 			}
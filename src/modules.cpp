@@ -55,11 +55,122 @@ Version::Version(const std::string &desc, int flags, const std::string& linkdata
 {
 }
 
+bool HookTimer::profile = false;
+
+unsigned long long HookTimer::Now()
+{
+#if defined HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#elif defined _WIN32
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return counter.QuadPart * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+namespace
+{
+	/** The names of the hooks in Implementation, in the same order. */
+	const char* const hooknames[] =
+	{
+		"On005Numeric",
+		"OnAcceptConnection",
+		"OnAddLine",
+		"OnBackgroundTimer",
+		"OnBuildNeighborList",
+		"OnChangeHost",
+		"OnChangeRealHost",
+		"OnChangeIdent",
+		"OnChangeRealName",
+		"OnChannelDelete",
+		"OnChannelPreDelete",
+		"OnCheckBan",
+		"OnCheckChannelBan",
+		"OnCheckInvite",
+		"OnCheckKey",
+		"OnCheckLimit",
+		"OnCheckReady",
+		"OnCommandBlocked",
+		"OnConnectionFail",
+		"OnDecodeMetaData",
+		"OnDelLine",
+		"OnExpireLine",
+		"OnExtBanCheck",
+		"OnGarbageCollect",
+		"OnKill",
+		"OnLoadModule",
+		"OnMode",
+		"OnModuleRehash",
+		"OnNumeric",
+		"OnOper",
+		"OnPassCompare",
+		"OnPostCommand",
+		"OnPostConnect",
+		"OnPostDeoper",
+		"OnPostJoin",
+		"OnPostOper",
+		"OnPostTopicChange",
+		"OnPreChangeHost",
+		"OnPreChangeRealName",
+		"OnPreCommand",
+		"OnPreMode",
+		"OnPreRehash",
+		"OnPreTopicChange",
+		"OnRawMode",
+		"OnSendSnotice",
+		"OnServiceAdd",
+		"OnServiceDel",
+		"OnSetConnectClass",
+		"OnSetUserIP",
+		"OnShutdown",
+		"OnUnloadModule",
+		"OnUserConnect",
+		"OnUserDisconnect",
+		"OnUserInit",
+		"OnUserInvite",
+		"OnUserJoin",
+		"OnUserKick",
+		"OnUserMessage",
+		"OnUserMessageBlocked",
+		"OnUserPart",
+		"OnUserPostInit",
+		"OnUserPostMessage",
+		"OnUserPostNick",
+		"OnUserPreInvite",
+		"OnUserPreJoin",
+		"OnUserPreKick",
+		"OnUserPreMessage",
+		"OnUserPreNick",
+		"OnUserPreQuit",
+		"OnUserQuit",
+		"OnUserRegister",
+		"OnUserWrite",
+		"OnUserWriteReady"
+	};
+
+	// Fails to compile if a hook is added to or removed from Implementation without updating the list above
+	typedef char hooknames_match_implementation[(sizeof(hooknames) / sizeof(hooknames[0]) == I_END) ? 1 : -1];
+}
+
+const char* ModuleManager::GetHookName(Implementation hook)
+{
+	return hooknames[hook];
+}
+
 // These declarations define the behavours of the base class Module (which does nothing at all)
 
 Module::Module()
 	: ModuleDLLManager(NULL)
 	, dying(false)
+	, checkbanextbansonly(false)
 {
 }
 
@@ -151,6 +262,7 @@ void		Module::OnSetUserIP(LocalUser*) { DetachEvent(I_OnSetUserIP); }
 void		Module::OnServiceAdd(ServiceProvider&) { DetachEvent(I_OnServiceAdd); }
 void		Module::OnServiceDel(ServiceProvider&) { DetachEvent(I_OnServiceDel); }
 ModResult	Module::OnUserWrite(LocalUser*, ClientProtocol::Message&) { DetachEvent(I_OnUserWrite); return MOD_RES_PASSTHRU; }
+void		Module::OnUserWriteReady(LocalUser*) { DetachEvent(I_OnUserWriteReady); }
 ModResult	Module::OnConnectionFail(LocalUser*, BufferedSocketError) { DetachEvent(I_OnConnectionFail); return MOD_RES_PASSTHRU; }
 void		Module::OnShutdown(const std::string& reason) { DetachEvent(I_OnShutdown); }
 
@@ -348,6 +460,14 @@ bool ModuleManager::CanUnload(Module* mod)
 		return false;
 	}
 
+	std::string reason;
+	if (!mod->CanUnload(reason))
+	{
+		LastModuleError = "Module " + mod->ModuleSourceFile + " cannot be unloaded at the moment: " + reason;
+		ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, LastModuleError);
+		return false;
+	}
+
 	mod->dying = true;
 	return true;
 }
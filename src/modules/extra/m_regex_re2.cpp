@@ -43,6 +43,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 #ifdef __GNUC__
 # pragma GCC diagnostic pop
@@ -67,6 +68,120 @@ class RE2Regex : public Regex
 	}
 };
 
+namespace
+{
+	/** Matches a set of expressions against some text.
+	 * @param set The set to match.
+	 * @param text The text to match the set against.
+	 * @param hits The vector to store the indices of the matching expressions in.
+	 * @param error Set to the RE2::Set::ErrorKind of the failure if nothing matched.
+	 * @return True if any of the expressions matched, false otherwise.
+	 */
+	template <typename SetType>
+	bool MatchSet(const SetType& set, const std::string& text, std::vector<int>& hits, int& error, typename SetType::ErrorInfo*)
+	{
+		typename SetType::ErrorInfo errorinfo;
+		errorinfo.kind = SetType::kNoError;
+		const bool ret = set.Match(text, &hits, &errorinfo);
+		error = errorinfo.kind;
+		return ret;
+	}
+
+	// Older versions of RE2 do not report why matching a set failed.
+	template <typename SetType>
+	bool MatchSet(const SetType& set, const std::string& text, std::vector<int>& hits, int& error, ...)
+	{
+		error = 0;
+		return set.Match(text, &hits);
+	}
+}
+
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set regexcl;
+	std::vector<int> hits;
+
+	/** The expressions in the set, compiled separately only if matching the whole set fails. */
+	std::vector<std::string> expressions;
+	std::vector<RE2Regex*> fallback;
+
+	/** Whether the failure of matching the whole set has been logged. */
+	bool loggedfailure;
+
+	static RE2::Options GetOptions()
+	{
+		RE2::Options options;
+		options.set_log_errors(false);
+		// A set of many filters needs a much larger DFA than a single expression.
+		options.set_max_mem(64 << 20);
+		return options;
+	}
+
+	/** Match the expressions one at a time, used when the DFA of the set runs out of memory. */
+	bool MatchSeparately(const std::string& text, std::vector<size_t>& matches)
+	{
+		if (fallback.empty())
+		{
+			for (std::vector<std::string>::const_iterator i = expressions.begin(); i != expressions.end(); ++i)
+				fallback.push_back(new RE2Regex(*i));
+		}
+
+		for (size_t i = 0; i < fallback.size(); ++i)
+		{
+			if (fallback[i]->Matches(text))
+				matches.push_back(i);
+		}
+		return !matches.empty();
+	}
+
+ public:
+	RE2RegexSet(const std::vector<std::string>& exprs)
+		: regexcl(GetOptions(), RE2::ANCHOR_BOTH)
+		, expressions(exprs)
+		, loggedfailure(false)
+	{
+		for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+		{
+			std::string error;
+			if (regexcl.Add(*i, &error) < 0)
+				throw RegexException(*i, error);
+		}
+
+		if (!regexcl.Compile())
+			throw RegexException("(set of " + ConvToStr(exprs.size()) + " expressions)", "out of memory");
+	}
+
+	~RE2RegexSet()
+	{
+		stdalgo::delete_all(fallback);
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		int error;
+		if (!MatchSet(regexcl, text, hits, error, NULL))
+		{
+			if (!error)
+				return false;
+
+			// Not matching anything would silently skip every expression in the set.
+			if (!loggedfailure)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Matching a set of %lu expressions failed (error %d), matching them separately instead",
+					(unsigned long)expressions.size(), error);
+				loggedfailure = true;
+			}
+			return MatchSeparately(text, matches);
+		}
+
+		// RE2 does not return the matches in any particular order.
+		std::sort(hits.begin(), hits.end());
+		matches.assign(hits.begin(), hits.end());
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -75,6 +190,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(exprs);
+	}
 };
 
 class ModuleRegexRE2 : public Module
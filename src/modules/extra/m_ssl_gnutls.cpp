@@ -125,8 +125,6 @@ typedef gnutls_connection_end_t inspircd_gnutls_session_init_flags_t;
 #define INSPIRCD_GNUTLS_HAS_CORK
 #endif
 
-static Module* thismod;
-
 class RandGen
 {
  public:
@@ -724,10 +722,90 @@ namespace GnuTLS
 	};
 }
 
+class GnuTLSIOHook;
+
+namespace GnuTLS
+{
+	/** The state of a session which is shared by the IO hook, the transport functions and the
+	 * worker threads. While the session is with a worker the transport functions read from and
+	 * write to the buffers in here instead of the socket.
+	 */
+	class Session : public SSLWorkerJob
+	{
+	 public:
+		/** The GnuTLS session. */
+		gnutls_session_t const sess;
+
+		/** The IO hook of the session or NULL if it went away while the session was with a worker. */
+		GnuTLSIOHook* hook;
+
+		/** The socket the session is on. */
+		StreamSocket* const sock;
+
+		/** Keeps the profile of the session alive for as long as the session exists. */
+		const reference<IOHookProvider> prov;
+
+		/** The credentials of the profile, used by the certificate callback. */
+		X509Credentials& cred;
+
+		/** Whether the session is with a worker thread. */
+		bool working;
+
+		/** Data received from the socket which GnuTLS has not read yet. */
+		std::string input;
+
+		/** Data written by GnuTLS on a worker thread which has not been sent yet. */
+		std::string output;
+
+		/** The return value of the last handshake done by a worker. */
+		int result;
+
+		Session(gnutls_session_t session, GnuTLSIOHook* iohook, StreamSocket* socket, IOHookProvider* hookprov, X509Credentials& credentials)
+			: sess(session)
+			, hook(iohook)
+			, sock(socket)
+			, prov(hookprov)
+			, cred(credentials)
+			, working(false)
+			, result(GNUTLS_E_SUCCESS)
+		{
+		}
+
+		/** Send the output of a worker to the socket.
+		 * @return 1 if everything was sent, 0 if the socket would block, -1 on error.
+		 */
+		int Flush()
+		{
+			if (output.empty())
+				return 1;
+
+			int ret = SocketEngine::Send(sock, output.data(), output.size(), 0);
+			if (ret > 0)
+				output.erase(0, ret);
+			else if (!SocketEngine::IgnoreError())
+				return -1;
+
+			if (output.empty())
+				return 1;
+
+			SocketEngine::ChangeEventMask(sock, FD_WRITE_WILL_BLOCK);
+			return 0;
+		}
+
+		void Run() CXX11_OVERRIDE
+		{
+			result = gnutls_handshake(sess);
+		}
+
+		void Finish() CXX11_OVERRIDE;
+	};
+}
+
 class GnuTLSIOHook : public SSLIOHook
 {
  private:
 	gnutls_session_t sess;
+	GnuTLS::Session* session;
 	issl_status status;
 #ifdef INSPIRCD_GNUTLS_HAS_CORK
 	size_t gbuffersize;
@@ -735,19 +813,68 @@ class GnuTLSIOHook : public SSLIOHook
 
 	void CloseSession()
 	{
-		if (this->sess)
+		if (this->session)
 		{
-			gnutls_bye(this->sess, GNUTLS_SHUT_WR);
-			gnutls_deinit(this->sess);
+			if (session->working)
+			{
+				// The worker owns the session at the moment, it is freed when the worker is done with it
+				session->hook = NULL;
+			}
+			else
+			{
+				gnutls_bye(this->sess, GNUTLS_SHUT_WR);
+				gnutls_deinit(this->sess);
+				delete session;
+			}
 		}
 		sess = NULL;
+		session = NULL;
 		certificate = NULL;
 		status = ISSL_NONE;
 	}
 
+	// Gives the session to a worker thread if the peer has sent anything to process. Returns 0 if the
+	// handshake is in progress, -1 if it failed
+	int OffloadHandshake(StreamSocket* user)
+	{
+		status = ISSL_HANDSHAKING;
+
+		// A worker already has the session, OnWorkerDone() resumes the socket
+		if (session->working)
+			return 0;
+
+		char* buffer = ServerInstance->GetReadBuffer();
+		int ret = SocketEngine::Recv(user, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (ret > 0)
+		{
+			session->input.append(buffer, ret);
+		}
+		else if ((ret == 0) || (!SocketEngine::IgnoreError()))
+		{
+			user->SetError(ret ? SocketEngine::LastError() : "Connection closed");
+			CloseSession();
+			return -1;
+		}
+		else if (session->input.empty())
+		{
+			// Nothing to do until the peer sends more
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+			return 0;
+		}
+
+		// The socket is left alone until the worker is done
+		session->working = true;
+		SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		GetWorkerPool().Submit(session);
+		return 0;
+	}
+
 	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
-	int Handshake(StreamSocket* user)
+	int Handshake(StreamSocket* user, bool mayoffload = true)
 	{
+		if (mayoffload && GetWorkerPool().IsEnabled())
+			return OffloadHandshake(user);
+
 		int ret = gnutls_handshake(this->sess);
 
 		if (ret < 0)
@@ -898,6 +1025,31 @@ info_done_dealloc:
 	// Returns 1 if application I/O should proceed, 0 if it must wait for the underlying protocol to progress, -1 on fatal error
 	int PrepareIO(StreamSocket* sock)
 	{
+		// The session must not be touched while a worker has it, OnWorkerDone() resumes the socket
+		if ((session) && (session->working))
+			return 0;
+
+		if ((session) && (!session->output.empty()))
+		{
+			// Whatever a worker wrote for the session has to be sent before anything else
+			int ret = session->Flush();
+			if (ret < 0)
+			{
+				sock->SetError(SocketEngine::LastError());
+				CloseSession();
+				return -1;
+			}
+			if (ret == 0)
+			{
+				SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				return 0;
+			}
+
+			// Data which came in after the handshake may be waiting in the session
+			if (!session->input.empty())
+				SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_READ);
+		}
+
 		if (status == ISSL_HANDSHAKEN)
 			return 1;
 		else if (status == ISSL_HANDSHAKING)
@@ -955,12 +1107,18 @@ info_done_dealloc:
 
 	static ssize_t gnutls_pull_wrapper(gnutls_transport_ptr_t session_wrap, void* buffer, size_t size)
 	{
-		StreamSocket* sock = reinterpret_cast<StreamSocket*>(session_wrap);
-#ifdef _WIN32
-		GnuTLSIOHook* session = static_cast<GnuTLSIOHook*>(sock->GetModHook(thismod));
-#endif
+		GnuTLS::Session* session = reinterpret_cast<GnuTLS::Session*>(session_wrap);
+		if (!session->input.empty())
+		{
+			// Data which was read from the socket while the session was with a worker
+			const size_t len = std::min(size, session->input.size());
+			memcpy(buffer, session->input.data(), len);
+			session->input.erase(0, len);
+			return len;
+		}
 
-		if (sock->GetEventMask() & FD_READ_WILL_BLOCK)
+		StreamSocket* sock = session->sock;
+		if ((session->working) || (sock->GetEventMask() & FD_READ_WILL_BLOCK))
 		{
 #ifdef _WIN32
 			gnutls_transport_set_errno(session->sess, EAGAIN);
@@ -989,36 +1147,62 @@ info_done_dealloc:
 		return rv;
 	}
 
-#ifdef INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
-	static ssize_t VectorPush(gnutls_transport_ptr_t transportptr, const giovec_t* iov, int iovcnt)
+	// Returns 1 if the socket can be written to, otherwise sets the error for GnuTLS and returns -1
+	static int PrepareWrite(GnuTLS::Session* session)
 	{
-		StreamSocket* sock = reinterpret_cast<StreamSocket*>(transportptr);
+		int ret = -1;
+		if (!(session->sock->GetEventMask() & FD_WRITE_WILL_BLOCK))
+		{
+			// Data written by a worker must go out first
+			ret = session->Flush();
+			if (ret != 0)
+			{
 #ifdef _WIN32
-		GnuTLSIOHook* session = static_cast<GnuTLSIOHook*>(sock->GetModHook(thismod));
+				// See gnutls_pull_wrapper() for more info about the usage of gnutls_transport_set_errno() on Windows
+				if (ret < 0)
+					gnutls_transport_set_errno(session->sess, errno);
 #endif
+				return ret;
+			}
+		}
 
-		if (sock->GetEventMask() & FD_WRITE_WILL_BLOCK)
-		{
 #ifdef _WIN32
-			gnutls_transport_set_errno(session->sess, EAGAIN);
+		gnutls_transport_set_errno(session->sess, EAGAIN);
 #else
-			errno = EAGAIN;
+		errno = EAGAIN;
 #endif
-			return -1;
+		return -1;
+	}
+
+#ifdef INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
+	static ssize_t VectorPush(gnutls_transport_ptr_t transportptr, const giovec_t* iov, int iovcnt)
+	{
+		GnuTLS::Session* session = reinterpret_cast<GnuTLS::Session*>(transportptr);
+
+		int size = 0;
+		for (int i = 0; i < iovcnt; i++)
+			size += iov[i].iov_len;
+
+		if (session->working)
+		{
+			// Called on a worker thread, the data is sent by the main thread when the worker is done
+			for (int i = 0; i < iovcnt; i++)
+				session->output.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+			return size;
 		}
 
+		if (PrepareWrite(session) < 0)
+			return -1;
+
 		// Cast the giovec_t to iovec not to IOVector so the correct function is called on Windows
+		StreamSocket* sock = session->sock;
 		int ret = SocketEngine::WriteV(sock, reinterpret_cast<const iovec*>(iov), iovcnt);
 #ifdef _WIN32
-		// See the function above for more info about the usage of gnutls_transport_set_errno() on Windows
+		// See gnutls_pull_wrapper() for more info about the usage of gnutls_transport_set_errno() on Windows
 		if (ret < 0)
 			gnutls_transport_set_errno(session->sess, SocketEngine::IgnoreError() ? EAGAIN : errno);
 #endif
 
-		int size = 0;
-		for (int i = 0; i < iovcnt; i++)
-			size += iov[i].iov_len;
-
 		if (ret < size)
 			SocketEngine::ChangeEventMask(sock, FD_WRITE_WILL_BLOCK);
 		return ret;
@@ -1027,21 +1211,18 @@ info_done_dealloc:
 #else // INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
 	static ssize_t gnutls_push_wrapper(gnutls_transport_ptr_t session_wrap, const void* buffer, size_t size)
 	{
-		StreamSocket* sock = reinterpret_cast<StreamSocket*>(session_wrap);
-#ifdef _WIN32
-		GnuTLSIOHook* session = static_cast<GnuTLSIOHook*>(sock->GetModHook(thismod));
-#endif
-
-		if (sock->GetEventMask() & FD_WRITE_WILL_BLOCK)
+		GnuTLS::Session* session = reinterpret_cast<GnuTLS::Session*>(session_wrap);
+		if (session->working)
 		{
-#ifdef _WIN32
-			gnutls_transport_set_errno(session->sess, EAGAIN);
-#else
-			errno = EAGAIN;
-#endif
-			return -1;
+			// Called on a worker thread, the data is sent by the main thread when the worker is done
+			session->output.append(static_cast<const char*>(buffer), size);
+			return size;
 		}
 
+		if (PrepareWrite(session) < 0)
+			return -1;
+
+		StreamSocket* sock = session->sock;
 		int rv = SocketEngine::Send(sock, reinterpret_cast<const char *>(buffer), size, 0);
 
 #ifdef _WIN32
@@ -1066,13 +1247,15 @@ info_done_dealloc:
 	GnuTLSIOHook(IOHookProvider* hookprov, StreamSocket* sock, inspircd_gnutls_session_init_flags_t flags)
 		: SSLIOHook(hookprov)
 		, sess(NULL)
+		, session(NULL)
 		, status(ISSL_NONE)
 #ifdef INSPIRCD_GNUTLS_HAS_CORK
 		, gbuffersize(0)
 #endif
 	{
 		gnutls_init(&sess, flags);
-		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(sock));
+		session = new GnuTLS::Session(sess, this, sock, hookprov, GetProfile().GetX509Credentials());
+		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(session));
 #ifdef INSPIRCD_GNUTLS_HAS_VECTOR_PUSH
 		gnutls_transport_set_vec_push_function(sess, VectorPush);
 #else
@@ -1082,7 +1265,30 @@ info_done_dealloc:
 		GetProfile().SetupSession(sess);
 
 		sock->AddIOHook(this);
-		Handshake(sock);
+
+		// Nothing has been received yet so this is cheap, except for generating the client hello
+		Handshake(sock, false);
+	}
+
+	/** Called on the main thread when a worker has done a handshake step for the session. */
+	void OnWorkerDone()
+	{
+		StreamSocket* sock = session->sock;
+		const int ret = session->result;
+		if (ret == GNUTLS_E_SUCCESS)
+		{
+			status = ISSL_HANDSHAKEN;
+			VerifyCertificate();
+		}
+		else if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+		{
+			sock->SetError("Handshake Failed - " + std::string(gnutls_strerror(ret)));
+			CloseSession();
+		}
+
+		// Continue via the usual event handlers, they send the output of the worker and
+		// read the next part of the handshake, the first application data or report the error
+		SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -1104,8 +1310,8 @@ info_done_dealloc:
 			if (ret > 0)
 			{
 				reader.appendto(recvq);
-				// Schedule a read if there is still data in the GnuTLS buffer
-				if (gnutls_record_check_pending(sess) > 0)
+				// Schedule a read if there is still data in the GnuTLS buffer or left over from a worker
+				if ((gnutls_record_check_pending(sess) > 0) || (!session->input.empty()))
 					SocketEngine::ChangeEventMask(user, FD_ADD_TRIAL_READ);
 				return 1;
 			}
@@ -1221,9 +1427,24 @@ info_done_dealloc:
 	}
 
 	GnuTLS::Profile& GetProfile();
+	SSLWorkerPool& GetWorkerPool();
 	bool IsHandshakeDone() const { return (status == ISSL_HANDSHAKEN); }
 };
 
+void GnuTLS::Session::Finish()
+{
+	working = false;
+	if (hook)
+	{
+		hook->OnWorkerDone();
+		return;
+	}
+
+	// The socket was closed while the session was with the worker
+	gnutls_deinit(sess);
+	delete this;
+}
+
 int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_datum_t* req_ca_rdn, int nreqs, const gnutls_pk_algorithm_t* sign_algos, int sign_algos_length, cert_cb_last_param_type* st)
 {
 #ifndef GNUTLS_NEW_CERT_CALLBACK_API
@@ -1232,8 +1453,9 @@ int GnuTLS::X509Credentials::cert_callback(gnutls_session_t sess, const gnutls_d
 	st->cert_type = GNUTLS_CRT_X509;
 	st->key_type = GNUTLS_PRIVKEY_X509;
 #endif
-	StreamSocket* sock = reinterpret_cast<StreamSocket*>(gnutls_transport_get_ptr(sess));
-	GnuTLS::X509Credentials& cred = static_cast<GnuTLSIOHook*>(sock->GetModHook(thismod))->GetProfile().GetX509Credentials();
+	// This can be called on a worker thread so the credentials are taken from the session
+	GnuTLS::Session* session = reinterpret_cast<GnuTLS::Session*>(gnutls_transport_get_ptr(sess));
+	GnuTLS::X509Credentials& cred = session->cred;
 
 	st->ncerts = cred.certs.size();
 	st->cert.x509 = cred.certs.raw();
@@ -1287,6 +1509,11 @@ class ModuleSSLGnuTLS : public Module
 	GnuTLS::Init libinit;
 	ProfileList profiles;
 
+ public:
+	SSLWorkerPool workers;
+
+ private:
+
 	void ReadProfiles()
 	{
 		// First, store all profiles in a new, temporary container. If no problems occur, swap the two
@@ -1363,7 +1590,6 @@ class ModuleSSLGnuTLS : public Module
 #ifndef GNUTLS_HAS_RND
 		gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
 #endif
-		thismod = this;
 	}
 
 	void init() CXX11_OVERRIDE
@@ -1373,6 +1599,11 @@ class ModuleSSLGnuTLS : public Module
 		ServerInstance->GenRandom = RandGen::Call;
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		workers.SetThreads(ServerInstance->Config->ConfValue("sslworkers")->getUInt("threads", 0, 0, 64));
+	}
+
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
 	{
 		if (!irc::equals(param, "tls") && !irc::equals(param, "ssl"))
@@ -1391,6 +1622,8 @@ class ModuleSSLGnuTLS : public Module
 
 	~ModuleSSLGnuTLS()
 	{
+		// Let the workers finish while the sessions they are working on can still be freed
+		workers.SetThreads(0);
 		ServerInstance->GenRandom = &InspIRCd::DefaultGenRandom;
 	}
 
@@ -1423,4 +1656,10 @@ class ModuleSSLGnuTLS : public Module
 	}
 };
 
+SSLWorkerPool& GnuTLSIOHook::GetWorkerPool()
+{
+	Module* mod = prov->creator;
+	return static_cast<ModuleSSLGnuTLS*>(mod)->workers;
+}
+
 MODULE_INIT(ModuleSSLGnuTLS)
@@ -103,7 +103,6 @@
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
 static int exdataindex;
 
 char* get_error()
@@ -531,6 +530,87 @@ static BIO_METHOD biomethods =
 static BIO_METHOD* biomethods;
 #endif
 
+class OpenSSLIOHook;
+
+namespace OpenSSL
+{
+	/** The state of a session which is shared by the IO hook, the BIO and the worker threads.
+	 * While the session is with a worker the BIO reads from and writes to the buffers in
+	 * here instead of the socket.
+	 */
+	class Session : public SSLWorkerJob
+	{
+	 public:
+		/** The OpenSSL session. */
+		SSL* const sess;
+
+		/** The IO hook of the session or NULL if it went away while the session was with a worker. */
+		OpenSSLIOHook* hook;
+
+		/** The socket the session is on. */
+		StreamSocket* const sock;
+
+		/** Whether the session is with a worker thread. */
+		bool working;
+
+		/** Whether the peer certificate was self signed, set by OnVerify(). */
+		bool selfsigned;
+
+		/** Data received from the socket which OpenSSL has not read yet. */
+		std::string input;
+
+		/** Data written by OpenSSL on a worker thread which has not been sent yet. */
+		std::string output;
+
+		/** The return value of the last handshake done by a worker. */
+		int result;
+
+		/** The error of the last handshake done by a worker. */
+		int error;
+
+		Session(SSL* session, OpenSSLIOHook* iohook, StreamSocket* socket)
+			: sess(session)
+			, hook(iohook)
+			, sock(socket)
+			, working(false)
+			, selfsigned(false)
+			, result(0)
+			, error(SSL_ERROR_NONE)
+		{
+		}
+
+		/** Send the output of a worker to the socket.
+		 * @return 1 if everything was sent, 0 if the socket would block, -1 on error.
+		 */
+		int Flush()
+		{
+			if (output.empty())
+				return 1;
+
+			int ret = SocketEngine::Send(sock, output.data(), output.size(), 0);
+			if (ret > 0)
+				output.erase(0, ret);
+			else if (!SocketEngine::IgnoreError())
+				return -1;
+
+			if (output.empty())
+				return 1;
+
+			SocketEngine::ChangeEventMask(sock, FD_WRITE_WILL_BLOCK);
+			return 0;
+		}
+
+		void Run() CXX11_OVERRIDE
+		{
+			ERR_clear_error();
+			result = SSL_do_handshake(sess);
+			error = (result > 0 ? SSL_ERROR_NONE : SSL_get_error(sess, result));
+		}
+
+		void Finish() CXX11_OVERRIDE;
+	};
+}
+
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 {
 	/* XXX: This will allow self signed certificates.
@@ -540,7 +620,10 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 */
 	int ve = X509_STORE_CTX_get_error(ctx);
 
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+	// This can be called on a worker thread so the result is stored with the session
+	SSL* ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+	OpenSSL::Session* session = static_cast<OpenSSL::Session*>(SSL_get_ex_data(ssl, exdataindex));
+	session->selfsigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
 
 	return 1;
 }
@@ -549,12 +632,16 @@ class OpenSSLIOHook : public SSLIOHook
 {
  private:
 	SSL* sess;
+	OpenSSL::Session* session;
 	issl_status status;
 	bool data_to_write;
 
 	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
-	int Handshake(StreamSocket* user)
+	int Handshake(StreamSocket* user, bool mayoffload = true)
 	{
+		if (mayoffload && GetWorkerPool().IsEnabled())
+			return OffloadHandshake(user);
+
 		ERR_clear_error();
 		int ret = SSL_do_handshake(sess);
 		if (ret < 0)
@@ -597,14 +684,60 @@ class OpenSSLIOHook : public SSLIOHook
 		return -1;
 	}
 
+	// Gives the session to a worker thread if the peer has sent anything to process. Returns 0 if the
+	// handshake is in progress, -1 if it failed
+	int OffloadHandshake(StreamSocket* user)
+	{
+		status = ISSL_HANDSHAKING;
+
+		// A worker already has the session, OnWorkerDone() resumes the socket
+		if (session->working)
+			return 0;
+
+		char* buffer = ServerInstance->GetReadBuffer();
+		int ret = SocketEngine::Recv(user, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (ret > 0)
+		{
+			session->input.append(buffer, ret);
+		}
+		else if ((ret == 0) || (!SocketEngine::IgnoreError()))
+		{
+			CloseSession();
+			user->SetError(ret ? SocketEngine::LastError() : "Connection closed");
+			return -1;
+		}
+		else if (session->input.empty())
+		{
+			// Nothing to do until the peer sends more
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+			return 0;
+		}
+
+		// The socket is left alone until the worker is done
+		session->working = true;
+		SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		GetWorkerPool().Submit(session);
+		return 0;
+	}
+
 	void CloseSession()
 	{
-		if (sess)
+		if (session)
 		{
-			SSL_shutdown(sess);
-			SSL_free(sess);
+			if (session->working)
+			{
+				// The worker owns the session at the moment, it is freed when the worker is done with it
+				session->hook = NULL;
+			}
+			else
+			{
+				SSL_shutdown(sess);
+				SSL_free(sess);
+				delete session;
+			}
 		}
 		sess = NULL;
+		session = NULL;
 		certificate = NULL;
 		status = ISSL_NONE;
 	}
@@ -627,7 +760,7 @@ class OpenSSLIOHook : public SSLIOHook
 
 		certinfo->invalid = (SSL_get_verify_result(sess) != X509_V_OK);
 
-		if (!SelfSigned)
+		if (!session->selfsigned)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -677,9 +810,7 @@ class OpenSSLIOHook : public SSLIOHook
 			// The other side is trying to renegotiate, kill the connection and change status
 			// to ISSL_NONE so CheckRenego() closes the session
 			status = ISSL_NONE;
-			BIO* bio = SSL_get_rbio(sess);
-			EventHandler* eh = static_cast<StreamSocket*>(BIO_get_data(bio));
-			SocketEngine::Shutdown(eh, 2);
+			SocketEngine::Shutdown(session->sock, 2);
 		}
 	}
 
@@ -697,6 +828,30 @@ class OpenSSLIOHook : public SSLIOHook
 	// Returns 1 if application I/O should proceed, 0 if it must wait for the underlying protocol to progress, -1 on fatal error
 	int PrepareIO(StreamSocket* sock)
 	{
+		// The session must not be touched while a worker has it, OnWorkerDone() resumes the socket
+		if ((session) && (session->working))
+			return 0;
+
+		if ((session) && (!session->output.empty()))
+		{
+			// Whatever a worker wrote for the session has to be sent before anything else
+			int ret = session->Flush();
+			if (ret < 0)
+			{
+				CloseSession();
+				return -1;
+			}
+			if (ret == 0)
+			{
+				SocketEngine::ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				return 0;
+			}
+
+			// Data which came in after the handshake may be waiting in the session
+			if (!session->input.empty())
+				SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_READ);
+		}
+
 		if (status == ISSL_OPEN)
 			return 1;
 		else if (status == ISSL_HANDSHAKING)
@@ -713,9 +868,10 @@ class OpenSSLIOHook : public SSLIOHook
 	friend void StaticSSLInfoCallback(const SSL* ssl, int where, int rc);
 
  public:
-	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* sock, SSL* session)
+	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* sock, SSL* ssl)
 		: SSLIOHook(hookprov)
-		, sess(session)
+		, sess(ssl)
+		, session(new OpenSSL::Session(ssl, this, sock))
 		, status(ISSL_NONE)
 		, data_to_write(false)
 	{
@@ -725,12 +881,33 @@ class OpenSSLIOHook : public SSLIOHook
 #else
 		BIO* bio = BIO_new(&biomethods);
 #endif
-		BIO_set_data(bio, sock);
+		BIO_set_data(bio, session);
 		SSL_set_bio(sess, bio, bio);
 
-		SSL_set_ex_data(sess, exdataindex, this);
+		SSL_set_ex_data(sess, exdataindex, session);
 		sock->AddIOHook(this);
-		Handshake(sock);
+
+		// Nothing has been received yet so this is cheap, except for generating the client hello
+		Handshake(sock, false);
+	}
+
+	/** Called on the main thread when a worker has done a handshake step for the session. */
+	void OnWorkerDone()
+	{
+		StreamSocket* sock = session->sock;
+		if (session->result > 0)
+		{
+			VerifyCertificate();
+			status = ISSL_OPEN;
+		}
+		else if (session->error != SSL_ERROR_WANT_READ)
+		{
+			CloseSession();
+		}
+
+		// Continue via the usual event handlers, they send the output of the worker and
+		// read the next part of the handshake, the first application data or report the error
+		SocketEngine::ChangeEventMask(sock, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
@@ -759,8 +936,8 @@ class OpenSSLIOHook : public SSLIOHook
 			{
 				recvq.append(buffer, ret);
 				int mask = 0;
-				// Schedule a read if there is still data in the OpenSSL buffer
-				if (SSL_pending(sess) > 0)
+				// Schedule a read if there is still data in the OpenSSL buffer or left over from a worker
+				if ((SSL_pending(sess) > 0) || (!session->input.empty()))
 					mask |= FD_ADD_TRIAL_READ;
 				if (data_to_write)
 					mask |= FD_WANT_POLL_READ | FD_WANT_SINGLE_WRITE;
@@ -881,19 +1058,45 @@ class OpenSSLIOHook : public SSLIOHook
 
 	bool IsHandshakeDone() const { return (status == ISSL_OPEN); }
 	OpenSSL::Profile& GetProfile();
+	SSLWorkerPool& GetWorkerPool();
 };
 
+void OpenSSL::Session::Finish()
+{
+	working = false;
+	if (hook)
+	{
+		hook->OnWorkerDone();
+		return;
+	}
+
+	// The socket was closed while the session was with the worker
+	SSL_free(sess);
+	delete this;
+}
+
 static void StaticSSLInfoCallback(const SSL* ssl, int where, int rc)
 {
-	OpenSSLIOHook* hook = static_cast<OpenSSLIOHook*>(SSL_get_ex_data(ssl, exdataindex));
-	hook->SSLInfoCallback(where, rc);
+	// Renegotiation can only happen once the handshake is done so there is nothing to check while
+	// the session is with a worker, which is also the only time the hook may go away under us.
+	OpenSSL::Session* session = static_cast<OpenSSL::Session*>(SSL_get_ex_data(ssl, exdataindex));
+	if (!session->working)
+		session->hook->SSLInfoCallback(where, rc);
 }
 
 static int OpenSSL::BIOMethod::write(BIO* bio, const char* buffer, int size)
 {
 	BIO_clear_retry_flags(bio);
 
-	StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
+	OpenSSL::Session* session = static_cast<OpenSSL::Session*>(BIO_get_data(bio));
+	if (session->working)
+	{
+		// Called on a worker thread, the data is sent by the main thread when the worker is done
+		session->output.append(buffer, size);
+		return size;
+	}
+
+	StreamSocket* sock = session->sock;
 	if (sock->GetEventMask() & FD_WRITE_WILL_BLOCK)
 	{
 		// Writes blocked earlier, don't retry syscall
@@ -901,6 +1104,15 @@ static int OpenSSL::BIOMethod::write(BIO* bio, const char* buffer, int size)
 		return -1;
 	}
 
+	// Data written by a worker must go out first
+	int flushret = session->Flush();
+	if (flushret <= 0)
+	{
+		if (flushret == 0)
+			BIO_set_retry_write(bio);
+		return -1;
+	}
+
 	int ret = SocketEngine::Send(sock, buffer, size, 0);
 	if ((ret < size) && ((ret > 0) || (SocketEngine::IgnoreError())))
 	{
@@ -916,8 +1128,18 @@ static int OpenSSL::BIOMethod::read(BIO* bio, char* buffer, int size)
 {
 	BIO_clear_retry_flags(bio);
 
-	StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
-	if (sock->GetEventMask() & FD_READ_WILL_BLOCK)
+	OpenSSL::Session* session = static_cast<OpenSSL::Session*>(BIO_get_data(bio));
+	if (!session->input.empty())
+	{
+		// Data which was read from the socket while the session was with a worker
+		const size_t len = std::min<size_t>(size, session->input.size());
+		memcpy(buffer, session->input.data(), len);
+		session->input.erase(0, len);
+		return len;
+	}
+
+	StreamSocket* sock = session->sock;
+	if ((session->working) || (sock->GetEventMask() & FD_READ_WILL_BLOCK))
 	{
 		// Reads blocked earlier, don't retry syscall
 		BIO_set_retry_read(bio);
@@ -977,6 +1199,11 @@ class ModuleSSLOpenSSL : public Module
 
 	ProfileList profiles;
 
+ public:
+	SSLWorkerPool workers;
+
+ private:
+
 	void ReadProfiles()
 	{
 		ProfileList newprofiles;
@@ -1046,10 +1273,14 @@ class ModuleSSLOpenSSL : public Module
 		OPENSSL_init_ssl(0, NULL);
 #ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		biomethods = OpenSSL::BIOMethod::alloc();
+#endif
 	}
 
 	~ModuleSSLOpenSSL()
 	{
+		// Let the workers finish while the sessions they are working on can still be freed
+		workers.SetThreads(0);
+#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		BIO_meth_free(biomethods);
 #endif
 	}
@@ -1067,6 +1298,20 @@ class ModuleSSLOpenSSL : public Module
 		ReadProfiles();
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		unsigned long threads = ServerInstance->Config->ConfValue("sslworkers")->getUInt("threads", 0, 0, 64);
+#ifndef INSPIRCD_OPENSSL_OPAQUE_BIO
+		// Sharing an SSL_CTX between threads needs locking callbacks before OpenSSL 1.1
+		if (threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<sslworkers:threads> requires OpenSSL 1.1 or newer, handshakes will be done on the main thread");
+			threads = 0;
+		}
+#endif
+		workers.SetThreads(threads);
+	}
+
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
 	{
 		if (!irc::equals(param, "tls") && !irc::equals(param, "ssl"))
@@ -1112,4 +1357,10 @@ class ModuleSSLOpenSSL : public Module
 	}
 };
 
+SSLWorkerPool& OpenSSLIOHook::GetWorkerPool()
+{
+	Module* mod = prov->creator;
+	return static_cast<ModuleSSLOpenSSL*>(mod)->workers;
+}
+
 MODULE_INIT(ModuleSSLOpenSSL)
@@ -0,0 +1,406 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/// $CompilerFlags: find_compiler_flags("zlib" "")
+/// $LinkerFlags: find_linker_flags("zlib" "-lz")
+
+/// $PackageInfo: require_system("arch") pkgconf zlib
+/// $PackageInfo: require_system("centos") pkgconfig zlib-devel
+/// $PackageInfo: require_system("darwin") pkg-config zlib
+/// $PackageInfo: require_system("debian") pkg-config zlib1g-dev
+/// $PackageInfo: require_system("ubuntu") pkg-config zlib1g-dev
+
+
+#include "inspircd.h"
+#include "modules/compress.h"
+
+#include <zlib.h>
+
+class ZlibHook : public Compress::Hook
+{
+	/** The size of the buffer zlib writes its output into. */
+	static const size_t CHUNK_SIZE = 16384;
+
+	/** The maximum amount of data decompressed by a single read. */
+	static const size_t MAX_INFLATE_READ = 1024 * 1024;
+
+	/** The stream used to compress the data written to the socket. */
+	z_stream deflater;
+
+	/** The stream used to decompress the data read from the socket. */
+	z_stream inflater;
+
+	/** Whether both streams were initialized successfully. */
+	bool ready;
+
+	/** Compresses some data.
+	 * @param data The data to compress.
+	 * @param length The length of the data.
+	 * @param flush The zlib flush mode, Z_SYNC_FLUSH makes all data compressed so far available to the remote end.
+	 * @param out The send queue to append the compressed data to.
+	 * @return True on success, false on error.
+	 */
+	bool Deflate(const char* data, size_t length, int flush, StreamSocket::SendQueue& out)
+	{
+		char buffer[CHUNK_SIZE];
+		deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		deflater.avail_in = length;
+		do
+		{
+			deflater.next_out = reinterpret_cast<Bytef*>(buffer);
+			deflater.avail_out = sizeof(buffer);
+
+			int ret = deflate(&deflater, flush);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return false;
+
+			const size_t produced = sizeof(buffer) - deflater.avail_out;
+			if (produced)
+			{
+				out.push_back(StreamSocket::SendQueue::Element(buffer, produced));
+				outstats.compressed += produced;
+			}
+		}
+		// If zlib filled the entire buffer there may be more output pending.
+		while (deflater.avail_out == 0);
+
+		outstats.plain += length;
+		return true;
+	}
+
+	/** Decompresses some data. To limit the memory used by data which decompresses to a lot
+	 * more than was received at most MAX_INFLATE_READ bytes are produced at once, the rest of
+	 * the input is left to be decompressed by the next read.
+	 * @param sock The socket the data was read from.
+	 * @param data The data to decompress, the part which was decompressed is removed.
+	 * @param out The string to append the decompressed data to.
+	 * @return True on success, false on error.
+	 */
+	bool Inflate(StreamSocket* sock, std::string& data, std::string& out)
+	{
+		char buffer[CHUNK_SIZE];
+		inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		inflater.avail_in = data.length();
+		size_t total = 0;
+		do
+		{
+			inflater.next_out = reinterpret_cast<Bytef*>(buffer);
+			inflater.avail_out = sizeof(buffer);
+
+			int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return false;
+
+			const size_t produced = sizeof(buffer) - inflater.avail_out;
+			out.append(buffer, produced);
+			instats.plain += produced;
+			total += produced;
+
+			if ((total >= MAX_INFLATE_READ) && (inflater.avail_in != 0))
+			{
+				// Come back for the rest once the data produced so far has been processed.
+				SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_READ);
+				break;
+			}
+		}
+		while (inflater.avail_out == 0 || inflater.avail_in != 0);
+
+		const size_t consumed = data.length() - inflater.avail_in;
+		instats.compressed += consumed;
+		data.erase(0, consumed);
+		return true;
+	}
+
+ public:
+	ZlibHook(IOHookProvider* hookprov, int level)
+		: Compress::Hook(hookprov)
+	{
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+		ready = (deflateInit(&deflater, level) == Z_OK);
+		ready &= (inflateInit(&inflater) == Z_OK);
+	}
+
+	~ZlibHook()
+	{
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+	}
+
+	/** Determines whether the hook can be used. */
+	bool IsReady() const { return ready; }
+
+	void StartCompression(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		// Anything which was written before now has to be sent as is.
+		GetSendQ().moveall(sock->GetSendQ());
+		compressing = true;
+	}
+
+	bool StartDecompression(StreamSocket* sock, std::string& data) CXX11_OVERRIDE
+	{
+		decompressing = true;
+
+		std::string compressed;
+		compressed.swap(data);
+		const unsigned long long start = HookTimer::Now();
+		const bool ret = Inflate(sock, compressed, data);
+		instats.time += HookTimer::Now() - start;
+
+		// Anything which was not decompressed yet comes before what is read next.
+		GetRecvQ().insert(0, compressed);
+		return ret;
+	}
+
+	int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& uppersendq) CXX11_OVERRIDE
+	{
+		StreamSocket::SendQueue& mysendq = GetSendQ();
+		if (!compressing)
+		{
+			mysendq.moveall(uppersendq);
+			return 1;
+		}
+
+		if (uppersendq.empty())
+			return 1;
+
+		// All lines queued since the last write are compressed together and flushed
+		// once at the end so the remote end can always decompress complete lines.
+		const unsigned long long start = HookTimer::Now();
+		bool ret = true;
+		for (StreamSocket::SendQueue::const_iterator i = uppersendq.begin(); ret && i != uppersendq.end(); ++i)
+			ret = Deflate(i->data(), i->length(), Z_NO_FLUSH, mysendq);
+		uppersendq.clear();
+
+		if (ret)
+			ret = Deflate(NULL, 0, Z_SYNC_FLUSH, mysendq);
+		outstats.time += HookTimer::Now() - start;
+		return ret ? 1 : -1;
+	}
+
+	int OnStreamSocketRead(StreamSocket* sock, std::string& destrecvq) CXX11_OVERRIDE
+	{
+		std::string& myrecvq = GetRecvQ();
+		if (!decompressing)
+		{
+			destrecvq.append(myrecvq);
+			myrecvq.clear();
+			return 1;
+		}
+
+		const std::string::size_type prevsize = destrecvq.size();
+		const unsigned long long start = HookTimer::Now();
+		const bool ret = Inflate(sock, myrecvq, destrecvq);
+		instats.time += HookTimer::Now() - start;
+
+		if (!ret)
+			return -1;
+		return (destrecvq.size() > prevsize) ? 1 : 0;
+	}
+
+	void OnStreamSocketClose(StreamSocket* sock) CXX11_OVERRIDE
+	{
+	}
+};
+
+class ZlibMessageStream : public Compress::MessageStream
+{
+	/** The size of the buffer zlib writes its output into. */
+	static const size_t CHUNK_SIZE = 16384;
+
+	/** The stream used to compress messages. */
+	z_stream deflater;
+
+	/** The stream used to decompress messages. */
+	z_stream inflater;
+
+	/** Whether both streams were initialized successfully. */
+	bool ready;
+
+ public:
+	/** The number of message streams which currently exist. */
+	static size_t count;
+
+	ZlibMessageStream(Module* mod, int level, unsigned int compressbits, unsigned int decompressbits)
+		: Compress::MessageStream(mod)
+	{
+		// A negative window size makes zlib read and write raw deflate data.
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+		ready = (deflateInit2(&deflater, level, Z_DEFLATED, -static_cast<int>(compressbits), 8, Z_DEFAULT_STRATEGY) == Z_OK);
+		ready &= (inflateInit2(&inflater, -static_cast<int>(decompressbits)) == Z_OK);
+		count++;
+	}
+
+	~ZlibMessageStream()
+	{
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+		count--;
+	}
+
+	/** Determines whether the stream can be used. */
+	bool IsReady() const { return ready; }
+
+	bool Compress(const char* data, size_t length, std::string& out) CXX11_OVERRIDE
+	{
+		const unsigned long long start = HookTimer::Now();
+		const std::string::size_type prevsize = out.size();
+		char buffer[CHUNK_SIZE];
+		deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		deflater.avail_in = length;
+		do
+		{
+			deflater.next_out = reinterpret_cast<Bytef*>(buffer);
+			deflater.avail_out = sizeof(buffer);
+
+			int ret = deflate(&deflater, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return false;
+
+			out.append(buffer, sizeof(buffer) - deflater.avail_out);
+		}
+		// If zlib filled the entire buffer there may be more output pending.
+		while (deflater.avail_out == 0);
+
+		outstats.plain += length;
+		outstats.compressed += out.size() - prevsize;
+		outstats.time += HookTimer::Now() - start;
+		return true;
+	}
+
+	bool Decompress(const char* data, size_t length, size_t maxlength, std::string& out) CXX11_OVERRIDE
+	{
+		const unsigned long long start = HookTimer::Now();
+		const std::string::size_type prevsize = out.size();
+		char buffer[CHUNK_SIZE];
+		inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		inflater.avail_in = length;
+		do
+		{
+			inflater.next_out = reinterpret_cast<Bytef*>(buffer);
+			inflater.avail_out = sizeof(buffer);
+
+			int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+				return false;
+
+			out.append(buffer, sizeof(buffer) - inflater.avail_out);
+			if (out.size() - prevsize > maxlength)
+				return false;
+
+			// The remote end may end a message with a final block. The stream starts over with the
+			// next message and anything after the block, e.g. an empty sync flush block, is ignored.
+			if (ret == Z_STREAM_END)
+			{
+				inflateReset(&inflater);
+				break;
+			}
+
+			if (ret == Z_BUF_ERROR)
+				break;
+		}
+		while (inflater.avail_out == 0 || inflater.avail_in != 0);
+
+		instats.plain += out.size() - prevsize;
+		instats.compressed += length;
+		instats.time += HookTimer::Now() - start;
+		return true;
+	}
+
+	void ResetCompression() CXX11_OVERRIDE
+	{
+		deflateReset(&deflater);
+	}
+
+	void ResetDecompression() CXX11_OVERRIDE
+	{
+		inflateReset(&inflater);
+	}
+};
+
+size_t ZlibMessageStream::count = 0;
+
+class ZlibHookProvider : public Compress::HookProvider
+{
+ public:
+	int level;
+
+	ZlibHookProvider(Module* mod)
+		: Compress::HookProvider(mod, "zlib")
+		, level(Z_DEFAULT_COMPRESSION)
+	{
+	}
+
+	Compress::Hook* AddHook(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		ZlibHook* hook = new ZlibHook(this, level);
+		if (!hook->IsReady())
+		{
+			delete hook;
+			sock->SetError("Unable to initialize zlib compression");
+			return NULL;
+		}
+
+		sock->AddIOHookFront(hook);
+		return hook;
+	}
+
+	Compress::MessageStream* CreateMessageStream(unsigned int compressbits, unsigned int decompressbits) CXX11_OVERRIDE
+	{
+		ZlibMessageStream* stream = new ZlibMessageStream(creator, level, compressbits, decompressbits);
+		if (!stream->IsReady())
+		{
+			delete stream;
+			return NULL;
+		}
+		return stream;
+	}
+};
+
+class ModuleZlib : public Module
+{
+	reference<ZlibHookProvider> hookprov;
+
+ public:
+	ModuleZlib()
+		: hookprov(new ZlibHookProvider(this))
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("zlib");
+		hookprov->level = tag->getUInt("level", 6, 1, 9);
+	}
+
+	bool CanUnload(std::string& reason) CXX11_OVERRIDE
+	{
+		// The modules using message streams can't go on without them once they have been negotiated.
+		if (!ZlibMessageStream::count)
+			return true;
+
+		reason = ConvToStr(ZlibMessageStream::count) + " message streams are in use";
+		return false;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides support for compressing server links and WebSocket connections using zlib.", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZlib)
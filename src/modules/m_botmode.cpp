@@ -59,6 +59,11 @@ class BotTag : public ClientProtocol::MessageTagProvider
 	{
 		return ctctagcap.get(user);
 	}
+
+	bool IsProfileTag() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class ModuleBotMode
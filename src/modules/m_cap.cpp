@@ -228,7 +228,9 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 
 	void Set302Protocol(LocalUser* user)
 	{
-		capext.set(user, capext.get(user) | CAP_302_BIT);
+		const Ext usercaps = capext.get(user) | CAP_302_BIT;
+		capext.set(user, usercaps);
+		user->tagprofile = usercaps;
 	}
 
 	bool HandleReq(LocalUser* user, const std::string& reqlist)
@@ -252,6 +254,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 		}
 
 		capext.set(user, usercaps);
+		user->tagprofile = usercaps;
 		return true;
 	}
 
@@ -290,6 +293,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 	{
 		HandleList(result, user, false, false, true);
 		capext.unset(user);
+		user->tagprofile = 0;
 	}
 };
 
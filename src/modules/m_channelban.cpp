@@ -28,6 +28,11 @@
 class ModuleBadChannelExtban : public Module
 {
  public:
+	ModuleBadChannelExtban()
+	{
+		checkbanextbansonly = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds the j: extended ban which checks whether users are in a channel matching the specified glob pattern.", VF_OPTCOMMON|VF_VENDOR);
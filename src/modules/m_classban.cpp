@@ -23,6 +23,11 @@
 class ModuleClassBan : public Module
 {
  public:
+	ModuleClassBan()
+	{
+		checkbanextbansonly = true;
+	}
+
 	ModResult OnCheckBan(User* user, Channel* c, const std::string& mask) CXX11_OVERRIDE
 	{
 		LocalUser* localUser = IS_LOCAL(user);
@@ -30,6 +30,7 @@
 
 
 #include "inspircd.h"
+#include "listmode.h"
 #include "modules/hash.h"
 
 enum CloakMode
@@ -199,12 +200,16 @@ class ModuleCloaking : public Module
 	CommandCloak ck;
 	std::vector<CloakInfo> cloaks;
 	dynamic_reference<HashProvider> Hash;
+	ChanModeReference banmode;
 
 	ModuleCloaking()
 		: cu(this)
 		, ck(this)
 		, Hash(this, "hash/md5")
+		, banmode(this, "ban")
 	{
+		// Hostmasks are matched against the cloaks in OnCheckChannelBan() when checking a ban list.
+		checkbanextbansonly = true;
 	}
 
 	/** Takes a domain name and retrieves the subdomain which should be visible.
@@ -375,10 +380,48 @@ class ModuleCloaking : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnCheckChannelBan(User* user, Channel* chan) CXX11_OVERRIDE
+	{
+		// The core only matches the hostmasks on the ban list against the hosts of the user
+		// so the cloaks they are not using are looked up in the compiled ban list here.
+		LocalUser* lu = IS_LOCAL(user);
+		ListModeBase* banlm = static_cast<ListModeBase*>(*banmode);
+		if (!lu || !banlm)
+			return MOD_RES_PASSTHRU;
+
+		// The verdict cached for a member by Channel::IsBanned() already includes the cloaks.
+		Membership* memb = chan->GetUser(user);
+		const unsigned long serial = banlm->GetMatchSerial(chan);
+		if (memb && memb->banserial == serial && memb->banuserserial == user->GetCacheSerial())
+			return MOD_RES_PASSTHRU;
+
+		OnUserConnect(lu);
+		CloakList* cloaklist = cu.ext.get(user);
+		if (!cloaklist)
+			return MOD_RES_PASSTHRU;
+
+		for (CloakList::const_iterator iter = cloaklist->begin(); iter != cloaklist->end(); ++iter)
+		{
+			const std::string& cloak = *iter;
+			if (cloak != user->GetDisplayedHost() && banlm->MatchHost(chan, user->GetNickIdent(), cloak))
+			{
+				if (memb)
+				{
+					memb->banned = true;
+					memb->banserial = serial;
+					memb->banuserserial = user->GetCacheSerial();
+				}
+				return MOD_RES_DENY;
+			}
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	void Prioritize() CXX11_OVERRIDE
 	{
 		/* Needs to be after m_banexception etc. */
 		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnCheckChannelBan, PRIORITY_LAST);
 	}
 
 	// this unsets umode +x on every host change. If we are actually doing a +x
@@ -45,12 +45,13 @@ class CommandClones : public SplitCommand
 		, batch("inspircd.org/clones")
 	{
 		flags_needed = 'o';
-		syntax = "<limit>";
+		syntax = "<limit> [<count>]";
 	}
 
 	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE
 	{
 		unsigned int limit = ConvToNum<unsigned int>(parameters[0]);
+		size_t count = parameters.size() > 1 ? ConvToNum<size_t>(parameters[1]) : 0;
 
 		// Syntax of a CLONES reply:
 		// :irc.example.com BATCH +<id> inspircd.org/clones :<min-count>
@@ -63,17 +64,17 @@ class CommandClones : public SplitCommand
 			batch.GetBatchStartMessage().PushParam(ConvToStr(limit));
 		}
 
-		const UserManager::CloneMap& clonemap = ServerInstance->Users->GetCloneMap();
-		for (UserManager::CloneMap::const_iterator i = clonemap.begin(); i != clonemap.end(); ++i)
+		// The ranges are found in descending order of clone count so only the
+		// ranges which are shown have to be looked at.
+		CloneTree::RangeList ranges;
+		ServerInstance->Users->GetCloneTree().GetTop(ServerInstance->Config->c_ipv4_range, ServerInstance->Config->c_ipv6_range, limit, count, ranges);
+		for (CloneTree::RangeList::const_iterator i = ranges.begin(); i != ranges.end(); ++i)
 		{
-			const UserManager::CloneCounts& counts = i->second;
-			if (counts.global < limit)
-				continue;
-
+			const UserManager::CloneCounts& counts = i->counts;
 			Numeric::Numeric numeric(RPL_CLONES);
 			numeric.push(counts.local);
 			numeric.push(counts.global);
-			numeric.push(i->first.str());
+			numeric.push(i->mask.str());
 
 			ClientProtocol::Messages::Numeric numericmsg(numeric, user);
 			batch.AddToBatch(numericmsg);
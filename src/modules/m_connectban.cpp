@@ -32,8 +32,7 @@ class ModuleConnectBan
 	: public Module
 	, public WebIRC::EventListener
 {
-	typedef std::map<irc::sockets::cidr_mask, unsigned int> ConnectMap;
-	ConnectMap connects;
+	CloneTree connects;
 	unsigned int threshold;
 	unsigned int banduration;
 	unsigned int ipv4_cidr;
@@ -97,10 +96,7 @@ class ModuleConnectBan
 		// HACK: Lower the connection attempts for the gateway IP address. The user
 		// will be rechecked for connect spamming shortly after when their IP address
 		// is changed and OnSetUserIP is called.
-		irc::sockets::cidr_mask mask(user->client_sa, GetRange(user));
-		ConnectMap::iterator iter = connects.find(mask);
-		if (iter != connects.end() && iter->second)
-			iter->second--;
+		connects.Remove(user->client_sa, false);
 	}
 
 	void OnSetUserIP(LocalUser* u) CXX11_OVERRIDE
@@ -108,40 +104,31 @@ class ModuleConnectBan
 		if (u->exempt || u->quitting)
 			return;
 
-		irc::sockets::cidr_mask mask(u->client_sa, GetRange(u));
-		ConnectMap::iterator i = connects.find(mask);
+		connects.Add(u->client_sa, false);
 
-		if (i != connects.end())
+		irc::sockets::cidr_mask mask(u->client_sa, GetRange(u));
+		if (connects.Get(mask).global >= threshold)
 		{
-			i->second++;
-
-			if (i->second >= threshold)
+			// Create Z-line for set duration.
+			ZLine* zl = new ZLine(ServerInstance->Time(), banduration, ServerInstance->Config->ServerName, banmessage, mask.str());
+			if (!ServerInstance->XLines->AddLine(zl, NULL))
 			{
-				// Create Z-line for set duration.
-				ZLine* zl = new ZLine(ServerInstance->Time(), banduration, ServerInstance->Config->ServerName, banmessage, mask.str());
-				if (!ServerInstance->XLines->AddLine(zl, NULL))
-				{
-					delete zl;
-					return;
-				}
-				ServerInstance->XLines->ApplyLines();
-				std::string maskstr = mask.str();
-				ServerInstance->SNO->WriteGlobalSno('x', "Z-line added by module m_connectban on %s to expire in %s (on %s): Connect flooding",
-					maskstr.c_str(), InspIRCd::DurationString(zl->duration).c_str(), InspIRCd::TimeString(zl->expiry).c_str());
-				ServerInstance->SNO->WriteGlobalSno('a', "Connect flooding from IP range %s (%d)", maskstr.c_str(), threshold);
-				connects.erase(i);
+				delete zl;
+				return;
 			}
-		}
-		else
-		{
-			connects[mask] = 1;
+			ServerInstance->XLines->ApplyLines();
+			std::string maskstr = mask.str();
+			ServerInstance->SNO->WriteGlobalSno('x', "Z-line added by module m_connectban on %s to expire in %s (on %s): Connect flooding",
+				maskstr.c_str(), InspIRCd::DurationString(zl->duration).c_str(), InspIRCd::TimeString(zl->expiry).c_str());
+			ServerInstance->SNO->WriteGlobalSno('a', "Connect flooding from IP range %s (%d)", maskstr.c_str(), threshold);
+			connects.Erase(mask);
 		}
 	}
 
 	void OnGarbageCollect() CXX11_OVERRIDE
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Clearing map.");
-		connects.clear();
+		connects.Clear();
 	}
 };
 
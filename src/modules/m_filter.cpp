@@ -195,7 +195,32 @@ class ModuleFilter
 	bool notifyuser;
 	bool warnonselfmsg;
 	RegexFactory* factory;
+
+	/** The patterns of the filters without and with the 'c' flag compiled into sets, or NULL if
+	 * there are no such filters. Only valid while setsvalid is true.
+	 */
+	RegexSet* textset;
+	RegexSet* strippedset;
+
+	/** The positions in filters of the patterns in textset and strippedset. */
+	std::vector<size_t> textfilters;
+	std::vector<size_t> strippedfilters;
+
+	/** Whether the sets have been compiled since the filters last changed. */
+	bool setsvalid;
+
+	/** Whether the regex engine can not compile the filters into sets, if so every filter is
+	 * matched separately.
+	 */
+	bool setsfailed;
+
+	/** Indexes of the patterns which matched in the current call to FilterMatch(). */
+	std::vector<size_t> sethits;
+
 	void FreeFilters();
+	void ResetSets();
+	void BuildSets();
+	size_t FindFirstHit(User* user, RegexSet* set, const std::vector<size_t>& positions, const std::string& text, int flags, size_t best);
 
  public:
 	CommandFilter filtcommand;
@@ -349,6 +374,10 @@ ModuleFilter::ModuleFilter()
 	: ServerProtocol::SyncEventListener(this)
 	, Stats::EventListener(this)
 	, initing(true)
+	, textset(NULL)
+	, strippedset(NULL)
+	, setsvalid(false)
+	, setsfailed(false)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -371,6 +400,61 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	ResetSets();
+}
+
+void ModuleFilter::ResetSets()
+{
+	delete textset;
+	delete strippedset;
+	textset = strippedset = NULL;
+	textfilters.clear();
+	strippedfilters.clear();
+	setsvalid = setsfailed = false;
+}
+
+void ModuleFilter::BuildSets()
+{
+	ResetSets();
+	setsvalid = true;
+	if (!RegexEngine)
+		return;
+
+	std::vector<std::string> textpatterns;
+	std::vector<std::string> strippedpatterns;
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		if (filters[i].flag_strip_color)
+		{
+			strippedpatterns.push_back(filters[i].freeform);
+			strippedfilters.push_back(i);
+		}
+		else
+		{
+			textpatterns.push_back(filters[i].freeform);
+			textfilters.push_back(i);
+		}
+	}
+
+	try
+	{
+		if (!textpatterns.empty())
+			setsfailed = !(textset = RegexEngine->CreateSet(textpatterns));
+		if (!setsfailed && !strippedpatterns.empty())
+			setsfailed = !(strippedset = RegexEngine->CreateSet(strippedpatterns));
+	}
+	catch (ModuleException& e)
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to compile the filters into a set, matching them separately: %s", e.GetReason().c_str());
+		setsfailed = true;
+	}
+
+	if (setsfailed)
+	{
+		delete textset;
+		delete strippedset;
+		textset = strippedset = NULL;
+	}
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -745,10 +829,43 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 	}
 }
 
+size_t ModuleFilter::FindFirstHit(User* user, RegexSet* set, const std::vector<size_t>& positions, const std::string& text, int flgs, size_t best)
+{
+	if (!set || !set->Matches(text, sethits))
+		return best;
+
+	// The hits are in the same order as the filters so the first one which applies wins.
+	for (std::vector<size_t>::const_iterator i = sethits.begin(); i != sethits.end(); ++i)
+	{
+		const size_t pos = positions[*i];
+		if (pos >= best)
+			break;
+
+		if (AppliesToMe(user, &filters[pos], flgs))
+			return pos;
+	}
+	return best;
+}
+
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
-	static std::string stripped_text;
-	stripped_text.clear();
+	if (!setsvalid)
+		BuildSets();
+
+	std::string stripped_text;
+	if (!setsfailed)
+	{
+		// Match all filters in one pass over the text (or two if some strip formatting)
+		// and pick the first filter that matched, like the loop below would have.
+		size_t best = FindFirstHit(user, textset, textfilters, text, flgs, filters.size());
+		if (strippedset)
+		{
+			stripped_text = text;
+			InspIRCd::StripColor(stripped_text);
+			best = FindFirstHit(user, strippedset, strippedfilters, stripped_text, flgs, best);
+		}
+		return (best < filters.size() ? &filters[best] : NULL);
+	}
 
 	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
 	{
@@ -779,6 +896,7 @@ bool ModuleFilter::DeleteFilter(const std::string& freeform, std::string& reason
 			reason.assign(i->reason);
 			delete i->regex;
 			filters.erase(i);
+			ResetSets();
 			return true;
 		}
 	}
@@ -798,6 +916,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, config));
+		ResetSets();
 	}
 	catch (ModuleException &e)
 	{
@@ -857,6 +976,7 @@ void ModuleFilter::ReadFilters()
 			removedfilters.insert(filter->freeform);
 			delete filter->regex;
 			filter = filters.erase(filter);
+			ResetSets();
 			continue;
 		}
 
@@ -28,6 +28,11 @@
 class ModuleGecosBan : public Module
 {
  public:
+	ModuleGecosBan()
+	{
+		checkbanextbansonly = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds the r: extended ban which checks whether users have a real name (gecos) matching the specified glob pattern.", VF_OPTCOMMON|VF_VENDOR);
@@ -40,6 +40,7 @@ class ModuleGeoBan
 		: Whois::EventListener(this)
 		, geoapi(this)
 	{
+		checkbanextbansonly = true;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -292,6 +292,11 @@ class C2CTags : public ClientProtocol::MessageTagProvider
 	{
 		return cap.get(user);
 	}
+
+	bool IsProfileTag() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class ModuleIRCv3CTCTags
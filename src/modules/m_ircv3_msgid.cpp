@@ -45,6 +45,11 @@ class MsgIdTag : public ClientProtocol::MessageTagProvider
 	{
 		return ctctagcap.get(user);
 	}
+
+	bool IsProfileTag() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class MsgIdGenerator
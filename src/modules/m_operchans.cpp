@@ -44,6 +44,7 @@ class ModuleOperChans : public Module
 		, space(" ")
 		, underscore("_")
 	{
+		checkbanextbansonly = true;
 	}
 
 	ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven) CXX11_OVERRIDE
@@ -28,6 +28,11 @@
 class ModuleServerBan : public Module
 {
  public:
+	ModuleServerBan()
+	{
+		checkbanextbansonly = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds the s: extended ban which check whether users are on a server matching the specified glob pattern.", VF_OPTCOMMON|VF_VENDOR);
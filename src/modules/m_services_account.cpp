@@ -171,6 +171,7 @@ class ModuleServicesAccount
 		, accountname(this)
 		, checking_ban(false)
 	{
+		checkbanextbansonly = true;
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
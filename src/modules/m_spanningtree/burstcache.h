@@ -0,0 +1,90 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Keeps the serialized netburst lines of users and channels so every netburst sent while a
+ * user or channel is unchanged can reuse them instead of building them again. An entry is
+ * created when a user or channel is first sent in a netburst and dropped as soon as it changes.
+ */
+class BurstCache
+{
+ public:
+	/** The netburst lines of a user or channel */
+	struct Entry
+	{
+		/** The lines, each terminated by a new line character */
+		reference<const StreamSocket::SendQueue::Buffer> lines;
+
+		/** The number of lines */
+		unsigned long count;
+
+		/** A summary of the state the lines were built from. It is compared before the lines are
+		 * reused to catch changes which are not announced by an event, e.g. nick collisions.
+		 */
+		std::string state;
+	};
+
+ private:
+	/** Cached UID lines of users */
+	SimpleExtItem<Entry> userext;
+
+	/** Cached FJOIN and list mode FMODE lines of channels */
+	SimpleExtItem<Entry> chanext;
+
+	/** The number of times an entry was reused */
+	unsigned long hits;
+
+	/** The number of times an entry had to be built */
+	unsigned long misses;
+
+	/** Get a valid entry, building it if there is none
+	 * @param ext Extension item holding the entries
+	 * @param container User or channel the entry belongs to
+	 * @param state Current state of the user or channel
+	 * @param build Function which serializes the lines of the user or channel
+	 */
+	template <typename T>
+	const Entry& Get(SimpleExtItem<Entry>& ext, T* container, const std::string& state, void (*build)(T*, std::string&));
+
+	/** Build the lines sent for a user */
+	static void BuildUser(User* user, std::string& out);
+
+	/** Build the lines sent for a channel */
+	static void BuildChannel(Channel* chan, std::string& out);
+
+ public:
+	BurstCache(Module* mod);
+
+	/** Get the lines sent for a user in a netburst */
+	const Entry& Get(User* user);
+
+	/** Get the lines sent for a channel in a netburst */
+	const Entry& Get(Channel* chan);
+
+	/** Drop the cached lines of a user, must be called whenever something they contain changes */
+	void Invalidate(User* user) { userext.unset(user); }
+
+	/** Drop the cached lines of a channel, must be called whenever something they contain changes */
+	void Invalidate(Channel* chan) { chanext.unset(chan); }
+
+	/** Get the number of times cached lines were reused */
+	unsigned long GetHits() const { return hits; }
+
+	/** Get the number of times lines had to be built */
+	unsigned long GetMisses() const { return misses; }
+};
@@ -127,6 +127,28 @@ std::string TreeSocket::BuildModeList(ModeType mtype)
 	return stdalgo::string::join(modes);
 }
 
+/** Build a comma separated list of the compression methods which can be used on server links. */
+static std::string BuildCompressionList()
+{
+	const std::string prefix = "compress/";
+	std::string methods;
+	typedef std::multimap<std::string, ServiceProvider*, irc::insensitive_swo> DataProviderMap;
+	const DataProviderMap& providers = ServerInstance->Modules->DataProviders;
+	for (DataProviderMap::const_iterator i = providers.lower_bound(prefix); i != providers.end(); ++i)
+	{
+		if (i->first.compare(0, prefix.length(), prefix))
+			break;
+
+		if (i->second->service != SERVICE_IOHOOK)
+			continue;
+
+		if (!methods.empty())
+			methods.push_back(',');
+		methods.append(i->first, prefix.length(), std::string::npos);
+	}
+	return methods;
+}
+
 void TreeSocket::SendCapabilities(int phase)
 {
 	if (capab->capab_phase >= phase)
@@ -199,6 +221,10 @@ void TreeSocket::SendCapabilities(int phase)
 			.append(" PREFIX="+ ServerInstance->Modes->BuildPrefixes());
 	}
 
+	const std::string compression = BuildCompressionList();
+	if (!compression.empty())
+		extra.append(" COMPRESSION=" + compression);
+
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
 			" CHANMAX="+ConvToStr(ServerInstance->Config->Limits.ChanMax)+
@@ -416,6 +442,7 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 			if (!this->GetTheirChallenge().empty() && (this->LinkState == CONNECTING))
 			{
 				this->SendCapabilities(2);
+				this->StartCompression(capab->link);
 				this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+this->MakePass(capab->link->SendPass, capab->theirchallenge)+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
 			}
 		}
@@ -425,6 +452,7 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 			if (this->LinkState == CONNECTING)
 			{
 				this->SendCapabilities(2);
+				this->StartCompression(capab->link);
 				this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+capab->link->SendPass+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
 			}
 		}
@@ -461,6 +489,16 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 	{
 		capab->UserModes = params[1];
 	}
+	else if ((params[0] == "COMPRESS") && (params.size() == 2))
+	{
+		// The remote server compresses everything it sends after this line.
+		if (!AttachCompressHook(params[1]))
+		{
+			this->SendError("CAPAB negotiation failed: Compression method " + params[1] + " is not available");
+			return false;
+		}
+		startdecompress = true;
+	}
 	else if ((params[0] == "CAPABILITIES") && (params.size() == 2))
 	{
 		irc::spacesepstream capabs(params[1]);
@@ -479,3 +517,56 @@ bool TreeSocket::Capab(const CommandBase::Params& params)
 	}
 	return true;
 }
+
+Compress::Hook* TreeSocket::AttachCompressHook(const std::string& method)
+{
+	if (compresshook)
+	{
+		// Both directions of a link share a single hook so they have to use the same method.
+		return (compresshook->GetMethod() == method ? compresshook : NULL);
+	}
+
+	ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, "compress/" + method);
+	if (!prov)
+		return NULL;
+
+	compresshook = static_cast<Compress::HookProvider*>(prov)->AddHook(this);
+	return compresshook;
+}
+
+void TreeSocket::StartCompression(const Link* link)
+{
+	if (link->Compress.empty())
+		return;
+
+	bool supported = false;
+	std::map<std::string, std::string>::const_iterator it = capab->CapKeys.find("COMPRESSION");
+	if (it != capab->CapKeys.end())
+	{
+		irc::commasepstream methods(it->second);
+		for (std::string method; methods.GetToken(method);)
+		{
+			if (method == link->Compress)
+			{
+				supported = true;
+				break;
+			}
+		}
+	}
+
+	if (!supported)
+	{
+		ServerInstance->SNO->WriteToSnoMask('l', "Not compressing link to %s: the remote server does not support %s compression", link->Name.c_str(), link->Compress.c_str());
+		return;
+	}
+
+	Compress::Hook* hook = AttachCompressHook(link->Compress);
+	if (!hook)
+	{
+		ServerInstance->SNO->WriteToSnoMask('l', "Not compressing link to %s: %s compression is not available on this server", link->Name.c_str(), link->Compress.c_str());
+		return;
+	}
+
+	this->WriteLine("CAPAB COMPRESS " + link->Compress);
+	hook->StartCompression(this);
+}
@@ -34,9 +34,66 @@ void TreeSocket::WriteLineNoCompat(const std::string& line)
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
 	this->WriteData(line);
 	this->WriteData(newline);
+	linessent++;
+	bytessent += line.length() + 1;
+}
+
+void TreeSocket::WriteSerialized(const StreamSocket::SendQueue::Element& data, unsigned long lines)
+{
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %.*s", this->GetFd(), (int)data.length() - 1, data.data());
+	this->WriteData(data);
+	linessent += lines;
+	bytessent += data.length();
+}
+
+unsigned int TreeSocket::GetLineVariant() const
+{
+	if ((LinkState != CONNECTED) || (proto_version == PROTO_NEWEST))
+		return 0;
+
+	// The translation of SERVER for 1202 protocol servers depends on whether our burst was sent
+	return (proto_version << 1) | (burstsent ? 1 : 0);
 }
 
 void TreeSocket::WriteLine(const std::string& original_line)
+{
+	if ((burst) && (DeferLine(original_line)))
+		return;
+
+	if (!GetLineVariant())
+	{
+		WriteLineNoCompat(original_line);
+		return;
+	}
+
+	std::string out;
+	TranslateLine(original_line, out);
+	if (!out.empty())
+		WriteSerialized(StreamSocket::SendQueue::Element(out));
+}
+
+void TreeSocket::WriteLine(SharedLine& shared)
+{
+	if ((burst) && (DeferLine(shared.line)))
+		return;
+
+	reference<const StreamSocket::SendQueue::Buffer>& buffer = shared.buffers[GetLineVariant()];
+	if (buffer)
+	{
+		linesshared++;
+	}
+	else
+	{
+		std::string out;
+		TranslateLine(shared.line, out);
+		buffer = new StreamSocket::SendQueue::Buffer(out);
+	}
+
+	if (!buffer->data.empty())
+		WriteSerialized(StreamSocket::SendQueue::Element(buffer));
+}
+
+void TreeSocket::TranslateLine(const std::string& original_line, std::string& out)
 {
 	if (LinkState == CONNECTED)
 	{
@@ -287,7 +344,7 @@ void TreeSocket::WriteLine(const std::string& original_line)
 
 					if (burstsent)
 					{
-						WriteLineNoCompat(line);
+						out.append(line).append(newline);
 
 						// Synthesize a :<newserver> BURST <time> message
 						spcolon = line.find(" :");
@@ -324,12 +381,12 @@ void TreeSocket::WriteLine(const std::string& original_line)
 					return;
 				}
 			}
-			WriteLineNoCompat(line);
+			out.append(line).append(newline);
 			return;
 		}
 	}
 
-	WriteLineNoCompat(original_line);
+	out.append(original_line).append(newline);
 }
 
 namespace
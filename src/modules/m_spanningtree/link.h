@@ -42,6 +42,8 @@ class Link : public refcountbase
 	unsigned int Timeout;
 	std::string Bind;
 	bool Hidden;
+	/** The compression method to use for data sent over this link, or empty for none. */
+	std::string Compress;
 	Link(ConfigTag* Tag) : tag(Tag) {}
 };
 
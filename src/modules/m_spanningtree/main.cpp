@@ -57,6 +57,7 @@ ModuleSpanningTree::ModuleSpanningTree()
 	, servicetag(this)
 	, DNS(this, "DNS")
 	, tagevprov(this)
+	, burstcache(this)
 	, loopCall(false)
 {
 }
@@ -498,6 +499,8 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 
 void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by_local, CUList& excepts)
 {
+	burstcache.Invalidate(memb->chan);
+
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
 		return;
@@ -528,14 +531,23 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 
 void ModuleSpanningTree::OnChangeHost(User* user, const std::string &newhost)
 {
+	burstcache.Invalidate(user);
+
 	if (user->registered != REG_ALL || !IS_LOCAL(user))
 		return;
 
 	CmdBuilder(user, "FHOST").push(newhost).Broadcast();
 }
 
+void ModuleSpanningTree::OnChangeRealHost(User* user, const std::string& newhost)
+{
+	burstcache.Invalidate(user);
+}
+
 void ModuleSpanningTree::OnChangeRealName(User* user, const std::string& real)
 {
+	burstcache.Invalidate(user);
+
 	if (user->registered != REG_ALL || !IS_LOCAL(user))
 		return;
 
@@ -544,6 +556,8 @@ void ModuleSpanningTree::OnChangeRealName(User* user, const std::string& real)
 
 void ModuleSpanningTree::OnChangeIdent(User* user, const std::string &ident)
 {
+	burstcache.Invalidate(user);
+
 	if ((user->registered != REG_ALL) || (!IS_LOCAL(user)))
 		return;
 
@@ -552,6 +566,8 @@ void ModuleSpanningTree::OnChangeIdent(User* user, const std::string &ident)
 
 void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage, CUList& excepts)
 {
+	burstcache.Invalidate(memb->chan);
+
 	if (IS_LOCAL(memb->user))
 	{
 		CmdBuilder params(memb->user, "PART");
@@ -564,6 +580,9 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
 {
+	for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+		burstcache.Invalidate((*i)->chan);
+
 	if (IS_LOCAL(user))
 	{
 		if (oper_message != reason)
@@ -591,6 +610,8 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 
 void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 {
+	burstcache.Invalidate(user);
+
 	if (IS_LOCAL(user))
 	{
 		// The nick TS is updated by the core, we don't do it
@@ -607,6 +628,8 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	burstcache.Invalidate(memb->chan);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
@@ -770,6 +793,11 @@ void ModuleSpanningTree::OnUserBack(User* user)
 
 void ModuleSpanningTree::OnMode(User* source, User* u, Channel* c, const Modes::ChangeList& modes, ModeParser::ModeProcessFlag processflags)
 {
+	if (u)
+		burstcache.Invalidate(u);
+	else
+		burstcache.Invalidate(c);
+
 	if (processflags & ModeParser::MODE_LOCALONLY)
 		return;
 
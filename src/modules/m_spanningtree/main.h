@@ -39,6 +39,7 @@
 #include "commands.h"
 #include "protocolinterface.h"
 #include "tags.h"
+#include "burstcache.h"
 
 /** An enumeration of all known protocol versions.
  *
@@ -124,6 +125,9 @@ class ModuleSpanningTree
 	/** Event provider for message tags. */
 	ClientProtocol::MessageTagEvent tagevprov;
 
+	/** Netburst lines of users and channels kept for reuse in the next netburst */
+	BurstCache burstcache;
+
 	ServerCommandManager CmdManager;
 
 	/** Set to true if inside a spanningtree call, to prevent sending
@@ -203,6 +207,7 @@ class ModuleSpanningTree
 	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE;
 	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& excepts) CXX11_OVERRIDE;
 	void OnChangeHost(User* user, const std::string &newhost) CXX11_OVERRIDE;
+	void OnChangeRealHost(User* user, const std::string& newhost) CXX11_OVERRIDE;
 	void OnChangeRealName(User* user, const std::string& real) CXX11_OVERRIDE;
 	void OnChangeIdent(User* user, const std::string &ident) CXX11_OVERRIDE;
 	void OnUserPart(Membership* memb, std::string &partmessage, CUList& excepts) CXX11_OVERRIDE;
@@ -93,16 +93,103 @@ class FModeBuilder : public CmdBuilder
 	}
 };
 
+/** While a netburst is being sent the send queue is only filled up to this many bytes. */
+static const size_t BURST_SENDQ_HIGH = 256 * 1024;
+
+/** The netburst is resumed when the send queue drains below this many bytes. */
+static const size_t BURST_SENDQ_LOW = 64 * 1024;
+
+/** If more than this many bytes would be held back while a netburst is being sent then the rest of the burst is sent at once. */
+static const size_t BURST_DEFERRED_MAX = 1024 * 1024;
+
+namespace
+{
+	/** Determines whether a line has to be sent right away even though a netburst is being sent.
+	 * PING, PONG and ERROR don't refer to anything in the burst and holding back the replies to
+	 * pings until the end of a long burst would make the server time the link out.
+	 * @param line The line to check
+	 * @return True if the line must not be held back, false otherwise
+	 */
+	bool IsUrgentLine(const std::string& line)
+	{
+		// Skip the tags and the source
+		std::string::size_type start = 0;
+		while ((start < line.length()) && ((line[start] == '@') || (line[start] == ':')))
+		{
+			start = line.find(' ', start);
+			if (start == std::string::npos)
+				return false;
+			start = line.find_first_not_of(' ', start);
+			if (start == std::string::npos)
+				return false;
+		}
+
+		const std::string::size_type end = line.find(' ', start);
+		const std::string command(line, start, (end == std::string::npos) ? end : end - start);
+		return ((command == "PING") || (command == "PONG") || (command == "ERROR"));
+	}
+}
+
 struct TreeSocket::BurstState
 {
+	enum Stage
+	{
+		STAGE_USERS,
+		STAGE_CHANNELS,
+		STAGE_NETWORK,
+		STAGE_DONE
+	};
+
 	SpanningTreeProtocolInterface::Server server;
-	BurstState(TreeSocket* sock) : server(sock) { }
+
+	/** The part of the netburst which is currently being sent. */
+	Stage stage;
+
+	/** UUIDs of the users to send, taken when the burst was started. */
+	std::vector<std::string> users;
+
+	/** Names of the channels to send, taken when the burst was started. */
+	std::vector<std::string> channels;
+
+	/** Index of the next user or channel to send in the current stage. */
+	size_t position;
+
+	/** True while lines belonging to the burst are being written. */
+	bool generating;
+
+	/** True if the rest of the burst has to be sent regardless of the size of the send queue. */
+	bool flush;
+
+	/** Lines written while the burst was being sent which are not part of it. These are held
+	 * back until the burst is complete so they can't refer to anything that hasn't been sent yet.
+	 */
+	std::vector<std::string> deferred;
+
+	/** The total length of the lines in deferred. */
+	size_t deferredsize;
+
+	/** The time at which the burst was started. */
+	time_t started;
+
+	BurstState(TreeSocket* sock)
+		: server(sock)
+		, stage(STAGE_USERS)
+		, position(0)
+		, generating(false)
+		, flush(false)
+		, deferredsize(0)
+		, started(ServerInstance->Time())
+	{
+	}
 };
 
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
  * users to exist. You get the idea.
+ *
+ * Only the servers are sent right away, users, channels and X-lines
+ * are sent by ContinueBurst() whenever the send queue has room.
  */
 void TreeSocket::DoBurst(TreeServer* s)
 {
@@ -115,22 +202,148 @@ void TreeSocket::DoBurst(TreeServer* s)
 	// Introduce all servers behind us
 	this->SendServers(Utils->TreeRoot, s);
 
-	BurstState bs(this);
-	// Introduce all users
-	this->SendUsers(bs);
+	// Remember which users and channels exist now. Anything created later is introduced by the
+	// lines which are held back until the burst is complete.
+	burst = new BurstState(this);
+	const user_hash& users = ServerInstance->Users->GetUsers();
+	burst->users.reserve(users.size());
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			burst->users.push_back(i->second->uuid);
+	}
 
-	// Sync all channels
 	const chan_hash& chans = ServerInstance->GetChans();
+	burst->channels.reserve(chans.size());
 	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-		SyncChannel(i->second, bs);
+		burst->channels.push_back(i->first);
+
+	ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	BurstState& bs = *burst;
+	bs.generating = true;
+	while ((bs.stage != BurstState::STAGE_DONE) && ((bs.flush) || (getSendQSize() < BURST_SENDQ_HIGH)))
+	{
+		switch (bs.stage)
+		{
+			case BurstState::STAGE_USERS:
+			{
+				if (bs.position >= bs.users.size())
+				{
+					bs.stage = BurstState::STAGE_CHANNELS;
+					bs.position = 0;
+					break;
+				}
+
+				// Users who quit since the burst was started are skipped
+				User* user = ServerInstance->FindUUID(bs.users[bs.position++]);
+				if ((user) && (!user->quitting))
+					SendUser(user, bs);
+				break;
+			}
+
+			case BurstState::STAGE_CHANNELS:
+			{
+				if (bs.position >= bs.channels.size())
+				{
+					bs.stage = BurstState::STAGE_NETWORK;
+					break;
+				}
+
+				Channel* chan = ServerInstance->FindChan(bs.channels[bs.position++]);
+				if (chan)
+					SyncChannel(chan, bs);
+				break;
+			}
+
+			case BurstState::STAGE_NETWORK:
+			{
+				// Send all xlines
+				this->SendXLines();
+				FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncNetwork, (bs.server));
+				bs.stage = BurstState::STAGE_DONE;
+				break;
+			}
+
+			case BurstState::STAGE_DONE:
+				break;
+		}
+	}
+	bs.generating = false;
+
+	if (bs.stage == BurstState::STAGE_DONE)
+		FinishBurst();
+}
+
+void TreeSocket::FinishBurst()
+{
+	std::vector<std::string> deferred;
+	deferred.swap(burst->deferred);
+	AbortBurst();
 
-	// Send all xlines
-	this->SendXLines();
-	FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncNetwork, (bs.server));
 	this->WriteLine(CmdBuilder("ENDBURST"));
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \002"+ s->GetName()+"\002.");
+	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \002"+ MyRoot->GetName()+"\002.");
 
 	this->burstsent = true;
+
+	for (std::vector<std::string>::const_iterator i = deferred.begin(); i != deferred.end(); ++i)
+		this->WriteLine(*i);
+}
+
+bool TreeSocket::DeferLine(const std::string& line)
+{
+	if ((burst->generating) || (IsUrgentLine(line)))
+		return false;
+
+	if (burst->deferredsize + line.length() > BURST_DEFERRED_MAX)
+	{
+		// Finish the burst now so the held back lines go out and this line can follow them
+		burst->flush = true;
+		ContinueBurst();
+		return false;
+	}
+
+	burst->deferred.push_back(line);
+	burst->deferredsize += line.length();
+	return true;
+}
+
+void TreeSocket::AbortBurst()
+{
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::OnEventHandlerWrite()
+{
+	BufferedSocket::OnEventHandlerWrite();
+	if ((burst) && (getSendQSize() < BURST_SENDQ_LOW))
+		ContinueBurst();
+}
+
+std::string TreeSocket::GetBurstProgress() const
+{
+	if (!burst)
+		return std::string();
+
+	size_t sentusers = burst->users.size();
+	size_t sentchans = burst->channels.size();
+	if (burst->stage == BurstState::STAGE_USERS)
+	{
+		sentusers = burst->position;
+		sentchans = 0;
+	}
+	else if (burst->stage == BurstState::STAGE_CHANNELS)
+		sentchans = burst->position;
+
+	return InspIRCd::Format("%s users %lu/%lu channels %lu/%lu deferred %lu sendq %lu time %lu",
+		MyRoot->GetName().c_str(), static_cast<unsigned long>(sentusers), static_cast<unsigned long>(burst->users.size()),
+		static_cast<unsigned long>(sentchans), static_cast<unsigned long>(burst->channels.size()),
+		static_cast<unsigned long>(burst->deferred.size()), static_cast<unsigned long>(getSendQSize()),
+		static_cast<unsigned long>(ServerInstance->Time() - burst->started));
 }
 
 void TreeSocket::SendServerInfo(TreeServer* from)
@@ -168,10 +381,16 @@ void TreeSocket::SendServers(TreeServer* Current, TreeServer* s)
 	}
 }
 
-/** Send one or more FJOINs for a channel of users.
+/** Append a line to a string of serialized lines */
+static void AppendLine(std::string& out, const std::string& line)
+{
+	out.append(line).push_back('\n');
+}
+
+/** Build one or more FJOINs for a channel of users.
  * If the length of a single line is too long, it is split over multiple lines.
  */
-void TreeSocket::SendFJoins(Channel* c)
+static void BuildFJoins(Channel* c, std::string& out)
 {
 	CommandFJoin::Builder fjoin(c);
 
@@ -182,12 +401,12 @@ void TreeSocket::SendFJoins(Channel* c)
 		if (!fjoin.has_room(memb))
 		{
 			// No room for this user, send the line and prepare a new one
-			this->WriteLine(fjoin.finalize());
+			AppendLine(out, fjoin.finalize());
 			fjoin.clear();
 		}
 		fjoin.add(memb);
 	}
-	this->WriteLine(fjoin.finalize());
+	AppendLine(out, fjoin.finalize());
 }
 
 /** Send all XLines we know about */
@@ -217,7 +436,8 @@ void TreeSocket::SendXLines()
 	}
 }
 
-void TreeSocket::SendListModes(Channel* chan)
+/** Build FMODEs for all list modes set on the channel */
+static void BuildListModes(Channel* chan, std::string& out)
 {
 	FModeBuilder fmode(chan);
 	const ModeParser::ListModeList& listmodes = ServerInstance->Modes->GetListModes();
@@ -237,7 +457,7 @@ void TreeSocket::SendListModes(Channel* chan)
 			{
 				// No room for this mask, send the current line as-is then add the mask to a
 				// new, empty FMODE message
-				this->WriteLine(fmode.finalize());
+				AppendLine(out, fmode.finalize());
 				fmode.clear();
 			}
 			fmode.push_mode(modeletter, mask);
@@ -245,21 +465,20 @@ void TreeSocket::SendListModes(Channel* chan)
 	}
 
 	if (!fmode.empty())
-		this->WriteLine(fmode.finalize());
+		AppendLine(out, fmode.finalize());
 }
 
 /** Send channel users, topic, modes and global metadata */
 void TreeSocket::SyncChannel(Channel* chan, BurstState& bs)
 {
-	SendFJoins(chan);
+	// Members and list modes
+	WriteCached(Utils->Creator->burstcache.Get(chan));
 
 	// If the topic was ever set, send it, even if it's empty now
 	// because a new empty topic should override an old non-empty topic
 	if (chan->topicset != 0)
 		this->WriteLine(CommandFTopic::Builder(chan));
 
-	SendListModes(chan);
-
 	for (Extensible::ExtensibleStore::const_iterator i = chan->GetExtList().begin(); i != chan->GetExtList().end(); i++)
 	{
 		ExtensionItem* item = i->first;
@@ -277,33 +496,96 @@ void TreeSocket::SyncChannel(Channel* chan)
 	SyncChannel(chan, bs);
 }
 
-/** Send all users and their state, including oper and away status and global metadata */
-void TreeSocket::SendUsers(BurstState& bs)
+/** Send a user and their state, including oper and away status and global metadata */
+void TreeSocket::SendUser(User* user, BurstState& bs)
 {
-	const user_hash& users = ServerInstance->Users->GetUsers();
-	for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
+	WriteCached(Utils->Creator->burstcache.Get(user));
+
+	if (user->IsOper())
+		this->WriteLine(CommandOpertype::Builder(user));
+
+	if (user->IsAway())
+		this->WriteLine(CommandAway::Builder(user));
+
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
 	{
-		User* user = u->second;
-		if (user->registered != REG_ALL)
-			continue;
+		ExtensionItem* item = i->first;
+		std::string value = item->ToNetwork(user, i->second);
+		if (!value.empty())
+			this->WriteLine(CommandMetadata::Builder(user, item->name, value));
+	}
 
-		this->WriteLine(CommandUID::Builder(user));
+	FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncUser, (user, bs.server));
+}
 
-		if (user->IsOper())
-			this->WriteLine(CommandOpertype::Builder(user));
+void TreeSocket::WriteCached(const BurstCache::Entry& entry)
+{
+	if ((!GetLineVariant()) && ((!burst) || (burst->generating)))
+	{
+		// Share the cached buffer, nothing has to be copied
+		WriteSerialized(StreamSocket::SendQueue::Element(entry.lines), entry.count);
+		return;
+	}
 
-		if (user->IsAway())
-			this->WriteLine(CommandAway::Builder(user));
+	// The lines have to be translated or held back one by one
+	irc::sepstream lines(entry.lines->data, '\n');
+	for (std::string line; lines.GetToken(line);)
+		this->WriteLine(line);
+}
 
-		const Extensible::ExtensibleStore& exts = user->GetExtList();
-		for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->ToNetwork(u->second, i->second);
-			if (!value.empty())
-				this->WriteLine(CommandMetadata::Builder(user, item->name, value));
-		}
+BurstCache::BurstCache(Module* mod)
+	: userext("user_burst_cache", ExtensionItem::EXT_USER, mod)
+	, chanext("chan_burst_cache", ExtensionItem::EXT_CHANNEL, mod)
+	, hits(0)
+	, misses(0)
+{
+}
 
-		FOREACH_MOD_CUSTOM(Utils->Creator->GetSyncEventProvider(), ServerProtocol::SyncEventListener, OnSyncUser, (user, bs.server));
+template <typename T>
+const BurstCache::Entry& BurstCache::Get(SimpleExtItem<Entry>& ext, T* container, const std::string& state, void (*build)(T*, std::string&))
+{
+	Entry* entry = ext.get(container);
+	if ((entry) && (entry->state == state))
+	{
+		hits++;
+		return *entry;
 	}
+
+	misses++;
+	std::string lines;
+	build(container, lines);
+
+	entry = new Entry;
+	entry->lines = new StreamSocket::SendQueue::Buffer(lines);
+	entry->count = std::count(lines.begin(), lines.end(), '\n');
+	entry->state = state;
+	ext.set(container, entry);
+	return *entry;
+}
+
+void BurstCache::BuildUser(User* user, std::string& out)
+{
+	AppendLine(out, CommandUID::Builder(user));
+}
+
+void BurstCache::BuildChannel(Channel* chan, std::string& out)
+{
+	BuildFJoins(chan, out);
+	BuildListModes(chan, out);
+}
+
+const BurstCache::Entry& BurstCache::Get(User* user)
+{
+	std::string state = ConvToStr(user->age);
+	state.append(1, ' ').append(user->nick).append(1, ' ').append(user->GetIPString());
+	state.append(1, ' ').append(user->GetModeLetters(true));
+	return Get(userext, user, state, BuildUser);
+}
+
+const BurstCache::Entry& BurstCache::Get(Channel* chan)
+{
+	std::string state = ConvToStr(chan->age);
+	state.append(1, ' ').append(ConvToStr(chan->GetUserCounter())).append(1, ' ').append(chan->ChanModes(true));
+	return Get(chanext, chan, state, BuildChannel);
 }
@@ -25,6 +25,16 @@
 #include "main.h"
 #include "utils.h"
 #include "link.h"
+#include "treeserver.h"
+#include "treesocket.h"
+
+/** Describe the data which went through a compression hook in one direction. */
+static std::string DescribeCompression(const char* direction, const Compress::Hook::Stats& cs)
+{
+	const double ratio = (cs.compressed ? static_cast<double>(cs.plain) / cs.compressed : 0);
+	return InspIRCd::Format("%s %llu/%llu bytes ratio %.2f time %llums", direction, cs.plain, cs.compressed,
+		ratio, cs.time / 1000000);
+}
 
 ModResult ModuleSpanningTree::OnStats(Stats::Context& stats)
 {
@@ -57,5 +67,42 @@ ModResult ModuleSpanningTree::OnStats(Stats::Context& stats)
 		}
 		return MOD_RES_DENY;
 	}
+	else if (stats.GetSymbol() == 'B')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			const std::string progress = (*i)->GetSocket()->GetBurstProgress();
+			if (!progress.empty())
+				stats.AddRow(249, progress);
+		}
+		stats.AddRow(249, InspIRCd::Format("Burst cache hits %lu misses %lu", burstcache.GetHits(), burstcache.GetMisses()));
+		return MOD_RES_DENY;
+	}
+	else if (stats.GetSymbol() == 'V')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			const TreeSocket* sock = (*i)->GetSocket();
+			stats.AddRow(249, InspIRCd::Format("%s lines %lu shared %lu bytes %llu sendq %lu", (*i)->GetName().c_str(),
+				sock->GetLinesSent(), sock->GetLinesShared(), sock->GetBytesSent(), (unsigned long)sock->getSendQSize()));
+		}
+		return MOD_RES_DENY;
+	}
+	else if (stats.GetSymbol() == 'X')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			const Compress::Hook* hook = (*i)->GetSocket()->GetCompressHook();
+			if (!hook)
+				continue;
+
+			stats.AddRow(249, (*i)->GetName() + " " + hook->GetMethod() + " " + DescribeCompression("sent", hook->GetOutStats())
+				+ " " + DescribeCompression("received", hook->GetInStats()));
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
@@ -28,8 +28,10 @@
 #pragma once
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "utils.h"
+#include "burstcache.h"
 
 /*
  * The server list in InspIRCd is maintained as two structures
@@ -66,6 +68,24 @@
  */
 enum ServerState { CONNECTING, WAIT_AUTH_1, WAIT_AUTH_2, CONNECTED, DYING };
 
+/** A line which is sent to more than one server. It is serialized once for every protocol
+ * variant in use and the resulting buffer is shared by the send queues of all servers which
+ * expect that variant.
+ */
+struct SharedLine
+{
+	/** The line in the newest protocol version without a new line character at the end */
+	const std::string& line;
+
+	/** The serialized forms of the line, keyed by TreeSocket::GetLineVariant() */
+	std::map<unsigned int, reference<const StreamSocket::SendQueue::Buffer> > buffers;
+
+	SharedLine(const std::string& Line)
+		: line(Line)
+	{
+	}
+};
+
 struct CapabData
 {
 	reference<Link> link;			/* Link block used for this connection */
@@ -109,19 +129,70 @@ class TreeSocket : public BufferedSocket
 	 */
 	bool burstsent;
 
-	/** Checks if the given servername and sid are both free
+	/** State of the netburst being sent to this server, or NULL if it is not currently
+	 * being sent. The burst is generated a bit at a time as the send queue drains.
 	 */
-	bool CheckDuplicate(const std::string& servername, const std::string& sid);
+	BurstState* burst;
+
+	/** The hook which compresses the data sent over this link and decompresses the data
+	 * received from it, or NULL if neither direction is compressed.
+	 */
+	Compress::Hook* compresshook;
+
+	/** True if the remote server has started compressing the data it sends, the rest of
+	 * the receive queue has to be decompressed before it can be processed.
+	 */
+	bool startdecompress;
 
-	/** Send all ListModeBase modes set on the channel
+	/** The number of lines written to this server */
+	unsigned long linessent;
+
+	/** The number of lines written to this server which reused a buffer that was serialized for another server */
+	unsigned long linesshared;
+
+	/** The number of bytes written to this server, including line terminators */
+	unsigned long long bytessent;
+
+	/** Checks if the given servername and sid are both free
 	 */
-	void SendListModes(Channel* chan);
+	bool CheckDuplicate(const std::string& servername, const std::string& sid);
 
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan, BurstState& bs);
 
-	/** Send all users and their oper state, away state and metadata */
-	void SendUsers(BurstState& bs);
+	/** Send a user and their oper state, away state and metadata */
+	void SendUser(User* user, BurstState& bs);
+
+	/** Send the next part of the netburst, stopping when the send queue is full enough
+	 * or when the burst is complete.
+	 */
+	void ContinueBurst();
+
+	/** Send ENDBURST followed by all lines that were held back while bursting */
+	void FinishBurst();
+
+	/** Hold back a line which is not part of the netburst being sent until the burst is complete.
+	 * PING, PONG and ERROR are never held back. If too much has been held back already the rest
+	 * of the burst is sent right away, followed by everything that was held back.
+	 * @param line The line to hold back
+	 * @return True if the line was held back, false if it must be sent now
+	 */
+	bool DeferLine(const std::string& line);
+
+	/** Stop sending the netburst and throw away everything that was held back */
+	void AbortBurst();
+
+	/** Get the hook used to compress this link, adding a new one to the socket if there is none yet.
+	 * @param method The compression method to use.
+	 * @return The compression hook or NULL if the method is not available or differs from the one already in use.
+	 */
+	Compress::Hook* AttachCompressHook(const std::string& method);
+
+	/** Start compressing the data sent to the remote server if the link block asks for it
+	 * and the remote server supports the requested compression method.
+	 * @param link The link block of the remote server.
+	 */
+	void StartCompression(const Link* link);
 
 	/** Send all additional info about the given server to this server */
 	void SendServerInfo(TreeServer* from);
@@ -162,6 +233,29 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLineNoCompat(const std::string& line);
 
+	/** Write one or more serialized lines on this socket
+	 * @param data Lines to write, each terminated by a new line character
+	 * @param lines Number of lines in data
+	 */
+	void WriteSerialized(const StreamSocket::SendQueue::Element& data, unsigned long lines = 1);
+
+	/** Write the cached netburst lines of a user or channel on this socket
+	 * @param entry Cached lines to write
+	 */
+	void WriteCached(const BurstCache::Entry& entry);
+
+	/** Translate a line to the protocol version of this server
+	 * @param line Line in the newest protocol version without a new line character at the end
+	 * @param out String to append the translated lines to, each terminated by a new line character.
+	 * Left unchanged if the line can not be sent to this server.
+	 */
+	void TranslateLine(const std::string& line, std::string& out);
+
+	/** Get the variant of the protocol lines sent to this server are serialized to
+	 * @return 0 if lines are sent without translation, a value identifying the translation otherwise
+	 */
+	unsigned int GetLineVariant() const;
+
  public:
 	const time_t age;
 
@@ -259,12 +353,6 @@ class TreeSocket : public BufferedSocket
 
 	bool Capab(const CommandBase::Params& params);
 
-	/** Send one or more FJOINs for a channel of users.
-	 * If the length of a single line is more than 480-NICKMAX
-	 * in length, it is split over multiple lines.
-	 */
-	void SendFJoins(Channel* c);
-
 	/** Send G-, Q-, Z- and E-lines */
 	void SendXLines();
 
@@ -278,6 +366,21 @@ class TreeSocket : public BufferedSocket
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Get a description of the progress of the netburst being sent to this server.
+	 * @return Progress of the netburst, or an empty string if it is not being sent
+	 */
+	std::string GetBurstProgress() const;
+
+	/** Get the hook compressing this link.
+	 * @return The compression hook or NULL if this link is not compressed
+	 */
+	const Compress::Hook* GetCompressHook() const { return compresshook; }
+
+	/** Called by the socket engine when the socket is writable, resumes the netburst
+	 * if the send queue has drained enough.
+	 */
+	void OnEventHandlerWrite() CXX11_OVERRIDE;
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -287,6 +390,20 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line which is also sent to other servers down the socket, sharing
+	 * its serialized form with all other servers which use the same protocol variant
+	 */
+	void WriteLine(SharedLine& shared);
+
+	/** Get the number of lines written to this server */
+	unsigned long GetLinesSent() const { return linessent; }
+
+	/** Get the number of lines written to this server which were serialized for another server */
+	unsigned long GetLinesShared() const { return linesshared; }
+
+	/** Get the number of bytes written to this server */
+	unsigned long long GetBytesSent() const { return bytessent; }
+
 	/** Handle ERROR command */
 	void Error(CommandBase::Params& params);
 
@@ -45,6 +45,12 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const irc::sockets::sockad
 	, MyRoot(NULL)
 	, proto_version(0)
 	, burstsent(false)
+	, burst(NULL)
+	, compresshook(NULL)
+	, startdecompress(false)
+	, linessent(0)
+	, linesshared(0)
+	, bytessent(0)
 	, age(ServerInstance->Time())
 {
 	capab = new CapabData;
@@ -87,6 +93,12 @@ TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* cl
 	, MyRoot(NULL)
 	, proto_version(0)
 	, burstsent(false)
+	, burst(NULL)
+	, compresshook(NULL)
+	, startdecompress(false)
+	, linessent(0)
+	, linesshared(0)
+	, bytessent(0)
 	, age(ServerInstance->Time())
 {
 	capab = new CapabData;
@@ -133,6 +145,7 @@ CullResult TreeSocket::cull()
 TreeSocket::~TreeSocket()
 {
 	delete capab;
+	AbortBurst();
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -172,6 +185,8 @@ void TreeSocket::OnError(BufferedSocketError e)
 
 void TreeSocket::SendError(const std::string &errormessage)
 {
+	// Don't hold the error back until the rest of the burst is sent
+	AbortBurst();
 	WriteLine("ERROR :"+errormessage);
 	DoWrite();
 	LinkState = DYING;
@@ -212,8 +227,10 @@ void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
 	std::string line;
-	while (GetNextLine(line))
+	RecvQLineReader reader(recvq);
+	while (reader.GetNextLine())
 	{
+		line.assign(reader.line, reader.length);
 		std::string::size_type rline = line.find('\r');
 		if (rline != std::string::npos)
 			line.erase(rline);
@@ -236,7 +253,20 @@ void TreeSocket::OnDataReady()
 
 		if (!getError().empty())
 			break;
+
+		if (startdecompress)
+		{
+			// Everything after the line which announced compression has to be decompressed.
+			startdecompress = false;
+			reader.Compact();
+			if (!compresshook->StartDecompression(this, recvq))
+			{
+				SendError("Unable to decompress the data sent by the remote server");
+				break;
+			}
+		}
 	}
+	reader.Compact();
 	if (LinkState != CONNECTED && recvq.length() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
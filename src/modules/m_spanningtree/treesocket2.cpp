@@ -411,7 +411,10 @@ void TreeSocket::Close()
 		return;
 
 	ServerInstance->GlobalCulls.AddItem(this);
+	AbortBurst();
 	this->BufferedSocket::Close();
+	// The compression hook was deleted together with all other hooks of the socket.
+	compresshook = NULL;
 	SetError("Remote host closed connection");
 
 	// Connection closed.
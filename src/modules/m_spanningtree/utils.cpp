@@ -182,7 +182,7 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
-	const std::string& FullLine = params.str();
+	SharedLine FullLine(params.str());
 
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
@@ -277,6 +277,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->Hook = tag->getString("ssl");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
+		L->Compress = tag->getString("compress");
 
 		if (L->Name.empty())
 			throw ModuleException("Invalid configuration, found a link tag without a name!" + (!L->IPAddr.empty() ? " IP address: "+L->IPAddr : ""));
@@ -365,12 +366,13 @@ void SpanningTreeUtilities::SendChannelMessage(User* source, Channel* target, co
 	if (!text.empty())
 		msg.push_last(text);
 
+	SharedLine line(msg.str());
 	TreeSocketSet list;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
-			Sock->WriteLine(msg);
+			Sock->WriteLine(line);
 	}
 }
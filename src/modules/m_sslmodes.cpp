@@ -160,6 +160,7 @@ class ModuleSSLModes
 		, sslm(this, api)
 		, sslquery(this, api)
 	{
+		checkbanextbansonly = true;
 	}
 
 	ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven) CXX11_OVERRIDE
@@ -23,13 +23,16 @@
 
 #include "inspircd.h"
 #include "iohook.h"
+#include "modules/compress.h"
 #include "modules/hash.h"
+#include "modules/stats.h"
 
 #include <utf8.h>
 
 static const char MagicGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 static const char whitespace[] = " \t\r\n";
 static dynamic_reference_nocheck<HashProvider>* sha1;
+static dynamic_reference_nocheck<Compress::HookProvider>* zlib;
 
 struct WebSocketConfig
 {
@@ -44,6 +47,21 @@ struct WebSocketConfig
 
 	// Whether to send as UTF-8 text instead of binary data.
 	bool sendastext;
+
+	// Whether to compress messages using the permessage-deflate extension if the client supports it.
+	bool compress;
+
+	// The base two logarithm of the largest window the server uses to compress messages.
+	unsigned int servermaxwindowbits;
+
+	// The base two logarithm of the largest window clients are asked to use to compress messages.
+	unsigned int clientmaxwindowbits;
+
+	// Whether the server may refer to previous messages when compressing a message.
+	bool servercontexttakeover;
+
+	// Whether clients may refer to previous messages when compressing a message.
+	bool clientcontexttakeover;
 };
 
 class WebSocketHookProvider : public IOHookProvider
@@ -92,6 +110,12 @@ class WebSocketHook : public IOHookMiddle
 		{
 			return std::string(req, bpos, len);
 		}
+
+		std::string ExtractLine(const std::string& req) const
+		{
+			const std::string::size_type epos = req.find_first_of("\r\n", bpos);
+			return std::string(req, bpos, epos - bpos);
+		}
 	};
 
 	enum OpCode
@@ -112,6 +136,8 @@ class WebSocketHook : public IOHookMiddle
 
 	static const unsigned char WS_MASKBIT = (1 << 7);
 	static const unsigned char WS_FINBIT = (1 << 7);
+	static const unsigned char WS_RSV1BIT = (1 << 6);
+	static const unsigned char WS_OPCODEMASK = 0x0f;
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_LARGE = 126;
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_HUGE = 127;
 	static const size_t WS_MAX_PAYLOAD_LENGTH_SMALL = 125;
@@ -121,14 +147,32 @@ class WebSocketHook : public IOHookMiddle
 	// Clients sending ping or pong frames faster than this are killed
 	static const time_t MINPINGPONGDELAY = 10;
 
+	// The trailer of a sync flush which is removed from the end of compressed messages
+	static const char DeflateTrailer[4];
+
 	State state;
 	time_t lastpingpong;
 	WebSocketConfig& config;
 
-	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode)
+	// The stream used to compress and decompress messages or NULL if compression is not available
+	Compress::MessageStream* deflatestream;
+
+	// Whether the client and server agreed to use the permessage-deflate extension
+	bool deflateenabled;
+
+	// Whether the compression context is reset after every message sent
+	bool resetdeflate;
+
+	// Whether the decompression context is reset after every message received
+	bool resetinflate;
+
+	// Whether the message currently being received is compressed
+	bool inflating;
+
+	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode, bool compressed = false)
 	{
 		size_t pos = 0;
-		outbuf[pos++] = WS_FINBIT | opcode;
+		outbuf[pos++] = WS_FINBIT | (compressed ? WS_RSV1BIT : 0) | opcode;
 
 		if (sendlength <= WS_MAX_PAYLOAD_LENGTH_SMALL)
 		{
@@ -159,15 +203,143 @@ class WebSocketHook : public IOHookMiddle
 		return StreamSocket::SendQueue::Element(reinterpret_cast<const char*>(header), n);
 	}
 
-	int HandleAppData(StreamSocket* sock, std::string& appdataout, bool allowlarge)
+	/** Finds the first byte which is not ASCII, checking a machine word at a time.
+	 * @param data The data to search.
+	 * @param length The length of the data.
+	 * @return The first byte with the high bit set or the end of the data if there is none.
+	 */
+	static const char* FindNonASCII(const char* data, size_t length)
 	{
-		std::string& myrecvq = GetRecvQ();
+		const uint64_t highbits = 0x8080808080808080ULL;
+		size_t pos = 0;
+		for (; pos + sizeof(uint64_t) <= length; pos += sizeof(uint64_t))
+		{
+			uint64_t word;
+			memcpy(&word, data + pos, sizeof(word));
+			if (word & highbits)
+				break;
+		}
+
+		for (; pos < length; ++pos)
+		{
+			if (data[pos] & 0x80)
+				break;
+		}
+		return data + pos;
+	}
+
+	/** The frames built from the upper sendq, the length of the frame header and the payload. */
+	typedef std::vector<std::pair<size_t, StreamSocket::SendQueue::Element> > FrameList;
+
+	/** Builds a frame for a line which is about to be sent.
+	 * @param line The line without the trailing line feed. It is only copied if it has to be changed.
+	 * @param frames The list to add the payload of the frame to.
+	 * @param headers The string to append the header of the frame to.
+	 */
+	void AddFrame(const StreamSocket::SendQueue::Element& line, FrameList& frames, std::string& headers)
+	{
+		StreamSocket::SendQueue::Element payload(line);
+
+		// Carriage returns are not sent. Usually there is one at the end of the line which
+		// can be left out of the slice, anywhere else the line has to be copied.
+		if (!payload.empty() && payload.data()[payload.length() - 1] == '\r')
+			payload = payload.substr(0, payload.length() - 1);
+		if (memchr(payload.data(), '\r', payload.length()))
+		{
+			std::string stripped(payload.begin(), payload.end());
+			stripped.erase(std::remove(stripped.begin(), stripped.end(), '\r'), stripped.end());
+			payload = StreamSocket::SendQueue::Element(stripped);
+		}
+
+		OpCode opcode = OP_BINARY;
+		if (config.sendastext)
+		{
+			// If we send messages as text then we need to ensure they are valid UTF-8.
+			opcode = OP_TEXT;
+			// Plain ASCII is always valid so the slower check only starts at the first other byte.
+			const char* nonascii = FindNonASCII(payload.data(), payload.length());
+			if (!utf8::is_valid(nonascii, payload.end()))
+			{
+				std::string encoded;
+				utf8::replace_invalid(payload.begin(), payload.end(), std::back_inserter(encoded));
+				payload = StreamSocket::SendQueue::Element(encoded);
+			}
+		}
+
+		bool compressed = false;
+		if (deflatestream)
+		{
+			std::string data;
+			if (!deflatestream->Compress(payload.data(), payload.length(), data) || data.length() < sizeof(DeflateTrailer))
+			{
+				// The state of the stream is unknown now so messages can not be compressed anymore.
+				delete deflatestream;
+				deflatestream = NULL;
+			}
+			else
+			{
+				// The client adds the trailer of the sync flush back before decompressing.
+				data.erase(data.length() - sizeof(DeflateTrailer));
+				payload = StreamSocket::SendQueue::Element(data);
+				compressed = true;
+
+				if (resetdeflate)
+					deflatestream->ResetCompression();
+			}
+		}
+
+		unsigned char header[MAXHEADERSIZE];
+		const size_t headerlength = FillHeader(header, payload.length(), opcode, compressed);
+		headers.append(reinterpret_cast<const char*>(header), headerlength);
+		frames.push_back(std::make_pair(headerlength, payload));
+	}
+
+	/** Applies the masking key of a client frame to its payload. The payload is processed a
+	 * machine word at a time with the key repeated to fill a word, only the bytes after the
+	 * last full word are handled one at a time.
+	 * @param data The payload to unmask in place.
+	 * @param length The length of the payload.
+	 * @param maskkey The 4 byte masking key of the frame.
+	 */
+	static void Unmask(char* data, size_t length, const unsigned char* maskkey)
+	{
+		unsigned char keybytes[sizeof(uint64_t)];
+		for (size_t i = 0; i < sizeof(keybytes); ++i)
+			keybytes[i] = maskkey[i % 4];
+
+		uint64_t key;
+		memcpy(&key, keybytes, sizeof(key));
+
+		size_t pos = 0;
+		for (; pos + sizeof(uint64_t) <= length; pos += sizeof(uint64_t))
+		{
+			uint64_t word;
+			memcpy(&word, data + pos, sizeof(word));
+			word ^= key;
+			memcpy(data + pos, &word, sizeof(word));
+		}
+
+		// The words are a multiple of the key length so the key starts over here.
+		for (; pos < length; ++pos)
+			data[pos] ^= maskkey[pos % 4];
+	}
+
+	/** Reads the payload of the frame at a position in the recvq.
+	 * @param sock The socket the frame was read from.
+	 * @param pos The position of the frame in the recvq, advanced past the frame if it is complete.
+	 * @param appdataout The string to append the unmasked payload to.
+	 * @param allowlarge Whether frames with a payload longer than 125 bytes are allowed.
+	 * @return 1 if a frame was read, 0 if it is not complete yet or -1 on error.
+	 */
+	int HandleAppData(StreamSocket* sock, std::string::size_type& pos, std::string& appdataout, bool allowlarge)
+	{
+		const std::string& cmyrecvq = GetRecvQ();
+		const std::string::size_type available = cmyrecvq.length() - pos;
 		// Need 1 byte opcode, minimum 1 byte len, 4 bytes masking key
-		if (myrecvq.length() < 6)
+		if (available < 6)
 			return 0;
 
-		const std::string& cmyrecvq = myrecvq;
-		unsigned char len1 = (unsigned char)cmyrecvq[1];
+		unsigned char len1 = (unsigned char)cmyrecvq[pos + 1];
 		if (!(len1 & WS_MASKBIT))
 		{
 			sock->SetError("WebSocket protocol violation: unmasked client frame");
@@ -179,7 +351,7 @@ class WebSocketHook : public IOHookMiddle
 		// Assume the length is a single byte, if not, update values later
 		unsigned int len = len1;
 		unsigned int payloadstartoffset = 6;
-		const unsigned char* maskkey = reinterpret_cast<const unsigned char*>(&cmyrecvq[2]);
+		const unsigned char* maskkey = reinterpret_cast<const unsigned char*>(&cmyrecvq[pos + 2]);
 
 		if (len1 == WS_PAYLOAD_LENGTH_MAGIC_LARGE)
 		{
@@ -192,11 +364,11 @@ class WebSocketHook : public IOHookMiddle
 
 			// Large frame, has 2 bytes len after the magic byte indicating the length
 			// Need 1 byte opcode, 3 bytes len, 4 bytes masking key
-			if (myrecvq.length() < 8)
+			if (available < 8)
 				return 0;
 
-			unsigned char len2 = (unsigned char)cmyrecvq[2];
-			unsigned char len3 = (unsigned char)cmyrecvq[3];
+			unsigned char len2 = (unsigned char)cmyrecvq[pos + 2];
+			unsigned char len3 = (unsigned char)cmyrecvq[pos + 3];
 			len = (len2 << 8) | len3;
 
 			if (len <= WS_MAX_PAYLOAD_LENGTH_SMALL)
@@ -214,23 +386,55 @@ class WebSocketHook : public IOHookMiddle
 			return -1;
 		}
 
-		if (myrecvq.length() < payloadstartoffset + len)
+		if (available < payloadstartoffset + len)
 			return 0;
 
-		unsigned int maskkeypos = 0;
-		const std::string::iterator endit = myrecvq.begin() + payloadstartoffset + len;
-		for (std::string::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
+		const std::string::size_type outpos = appdataout.length();
+		appdataout.append(cmyrecvq, pos + payloadstartoffset, len);
+		if (len)
+			Unmask(&appdataout[outpos], len, maskkey);
+
+		pos += payloadstartoffset + len;
+		return 1;
+	}
+
+	/** Reads the payload of a frame of a compressed message at a position in the recvq.
+	 * @param sock The socket the frame was read from.
+	 * @param pos The position of the frame in the recvq, advanced past the frame if it is complete.
+	 * @param appdataout The string to append the decompressed payload to.
+	 * @param final Whether this is the last frame of the message.
+	 * @return 1 if a frame was read, 0 if it is not complete yet or -1 on error.
+	 */
+	int HandleCompressedAppData(StreamSocket* sock, std::string::size_type& pos, std::string& appdataout, bool final)
+	{
+		std::string payload;
+		const int result = HandleAppData(sock, pos, payload, true);
+		if (result != 1)
+			return result;
+
+		if (!deflatestream)
+		{
+			sock->SetError("WebSocket: Received a compressed message but compression is not available");
+			return -1;
+		}
+
+		// The trailer of the sync flush at the end of the message is not sent by the client.
+		if (final)
+			payload.append(DeflateTrailer, sizeof(DeflateTrailer));
+
+		// Compressed frames may not expand to more than the largest uncompressed frame.
+		if (!deflatestream->Decompress(payload.data(), payload.length(), WS_MAX_PAYLOAD_LENGTH_LARGE, appdataout))
 		{
-			const unsigned char c = (unsigned char)*i;
-			appdataout.push_back(c ^ maskkey[maskkeypos++]);
-			maskkeypos %= 4;
+			sock->SetError("WebSocket: Invalid or oversized compressed message");
+			return -1;
 		}
 
-		myrecvq.erase(myrecvq.begin(), endit);
+		if (final && resetinflate)
+			deflatestream->ResetDecompression();
 		return 1;
 	}
 
-	int HandlePingPongFrame(StreamSocket* sock, bool isping)
+	int HandlePingPongFrame(StreamSocket* sock, std::string::size_type& pos, bool isping)
 	{
 		if (lastpingpong + MINPINGPONGDELAY >= ServerInstance->Time())
 		{
@@ -241,42 +445,60 @@ class WebSocketHook : public IOHookMiddle
 		lastpingpong = ServerInstance->Time();
 
 		std::string appdata;
-		const int result = HandleAppData(sock, appdata, false);
+		const int result = HandleAppData(sock, pos, appdata, false);
 		// If it's a pong stop here regardless of the result so we won't generate a reply
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
-		elem.append(appdata);
-		GetSendQ().push_back(elem);
+		GetSendQ().push_back(PrepareSendQElem(appdata.length(), OP_PONG));
+		GetSendQ().push_back(appdata);
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
 		return 1;
 	}
 
-	int HandleWS(StreamSocket* sock, std::string& destrecvq)
+	static bool IsLineTerminator(char chr)
 	{
-		if (GetRecvQ().empty())
+		return chr == '\r' || chr == '\n';
+	}
+
+	int HandleWS(StreamSocket* sock, std::string::size_type& pos, std::string& destrecvq)
+	{
+		if (pos >= GetRecvQ().length())
 			return 0;
 
-		unsigned char opcode = (unsigned char)GetRecvQ().c_str()[0];
-		switch (opcode & ~WS_FINBIT)
+		unsigned char opcode = (unsigned char)GetRecvQ()[pos];
+		if (opcode & WS_RSV1BIT)
+		{
+			// Only the first frame of a data message may be marked as compressed.
+			const unsigned char type = opcode & WS_OPCODEMASK;
+			if (!deflateenabled || (type != OP_TEXT && type != OP_BINARY))
+			{
+				sock->SetError("WebSocket protocol violation: unexpected compressed frame");
+				return -1;
+			}
+		}
+
+		switch (opcode & ~(WS_FINBIT | WS_RSV1BIT))
 		{
 			case OP_CONTINUATION:
 			case OP_TEXT:
 			case OP_BINARY:
 			{
-				std::string appdata;
-				const int result = HandleAppData(sock, appdata, true);
+				if ((opcode & WS_OPCODEMASK) != OP_CONTINUATION)
+					inflating = (opcode & WS_RSV1BIT);
+
+				// The payload is unmasked directly at the end of the destination recvq.
+				const std::string::size_type start = destrecvq.length();
+				const int result = inflating
+					? HandleCompressedAppData(sock, pos, destrecvq, opcode & WS_FINBIT)
+					: HandleAppData(sock, pos, destrecvq, true);
 				if (result != 1)
 					return result;
 
 				// Strip out any CR+LF which may have been erroneously sent.
-				for (std::string::const_iterator iter = appdata.begin(); iter != appdata.end(); ++iter)
-				{
-					if (*iter != '\r' && *iter != '\n')
-						destrecvq.push_back(*iter);
-				}
+				if (destrecvq.find_first_of("\r\n", start) != std::string::npos)
+					destrecvq.erase(std::remove_if(destrecvq.begin() + start, destrecvq.end(), IsLineTerminator), destrecvq.end());
 
 				// If we are on the final message of this block append a line terminator.
 				if (opcode & WS_FINBIT)
@@ -287,14 +509,14 @@ class WebSocketHook : public IOHookMiddle
 
 			case OP_PING:
 			{
-				return HandlePingPongFrame(sock, true);
+				return HandlePingPongFrame(sock, pos, true);
 			}
 
 			case OP_PONG:
 			{
 				// A pong frame may be sent unsolicited, so we have to handle it.
 				// It may carry application data which we need to remove from the recvq as well.
-				return HandlePingPongFrame(sock, false);
+				return HandlePingPongFrame(sock, pos, false);
 			}
 
 			case OP_CLOSE:
@@ -311,6 +533,113 @@ class WebSocketHook : public IOHookMiddle
 		}
 	}
 
+	/** Removes leading and trailing whitespace and quotes from a parameter of an extension. */
+	static std::string TrimParam(const std::string& str)
+	{
+		static const char trimchars[] = " \t\"";
+		const std::string::size_type begin = str.find_first_not_of(trimchars);
+		if (begin == std::string::npos)
+			return std::string();
+
+		const std::string::size_type end = str.find_last_not_of(trimchars);
+		return str.substr(begin, end - begin + 1);
+	}
+
+	/** Parses a window size parameter of the permessage-deflate extension.
+	 * @return The base two logarithm of the window size or 0 if it is not valid.
+	 */
+	static unsigned int ParseWindowBits(const std::string& value)
+	{
+		if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+			return 0;
+
+		unsigned int bits = ConvToNum<unsigned int>(value);
+		return (bits >= 8 && bits <= 15) ? bits : 0;
+	}
+
+	/** Accepts the first permessage-deflate offer of the client which the server supports.
+	 * @param offers The value of the Sec-WebSocket-Extensions header sent by the client.
+	 * @param response The string to append the Sec-WebSocket-Extensions header of the response to.
+	 */
+	void NegotiateDeflate(const std::string& offers, std::string& response)
+	{
+		irc::sepstream offerstream(offers, ',');
+		for (std::string offer; offerstream.GetToken(offer); )
+		{
+			irc::sepstream paramstream(offer, ';');
+			std::string name;
+			if (!paramstream.GetToken(name) || !stdalgo::string::equalsci(TrimParam(name), "permessage-deflate"))
+				continue;
+
+			bool valid = true;
+			bool servernocontexttakeover = false;
+			unsigned int serverbits = 0;
+			bool clientbitsoffered = false;
+			unsigned int clientbits = 15;
+			std::set<std::string> seen;
+			for (std::string param; valid && paramstream.GetToken(param); )
+			{
+				const std::string::size_type eqpos = param.find('=');
+				const std::string key = TrimParam(param.substr(0, eqpos));
+				const std::string value = (eqpos == std::string::npos ? std::string() : TrimParam(param.substr(eqpos + 1)));
+
+				// Offers with unknown or repeated parameters have to be declined.
+				if (!seen.insert(key).second)
+					valid = false;
+				else if (key == "server_no_context_takeover")
+					servernocontexttakeover = true;
+				else if (key == "client_no_context_takeover")
+				{
+					// This is only a hint, it does not change anything unless the server asks for it too.
+				}
+				else if (key == "server_max_window_bits")
+					valid = ((serverbits = ParseWindowBits(value)) != 0);
+				else if (key == "client_max_window_bits")
+				{
+					clientbitsoffered = true;
+					if (!value.empty())
+						valid = ((clientbits = ParseWindowBits(value)) != 0);
+				}
+				else
+					valid = false;
+			}
+
+			// zlib can not compress raw deflate streams with a window of 256 bytes.
+			if (!valid || serverbits == 8)
+				continue;
+
+			std::string params;
+			const unsigned int compressbits = serverbits ? std::min(serverbits, config.servermaxwindowbits) : config.servermaxwindowbits;
+			if (serverbits)
+				params.append("; server_max_window_bits=").append(ConvToStr(compressbits));
+
+			// If the client does not allow limiting its window it may use the largest one.
+			unsigned int decompressbits = 15;
+			if (clientbitsoffered)
+			{
+				clientbits = std::min(clientbits, config.clientmaxwindowbits);
+				params.append("; client_max_window_bits=").append(ConvToStr(clientbits));
+				decompressbits = std::max(clientbits, 9U);
+			}
+
+			resetdeflate = servernocontexttakeover || !config.servercontexttakeover;
+			if (resetdeflate)
+				params.append("; server_no_context_takeover");
+
+			resetinflate = !config.clientcontexttakeover;
+			if (resetinflate)
+				params.append("; client_no_context_takeover");
+
+			deflatestream = (*zlib)->CreateMessageStream(compressbits, decompressbits);
+			if (!deflatestream)
+				return;
+
+			deflateenabled = true;
+			response.append("Sec-WebSocket-Extensions: permessage-deflate").append(params).append("\r\n");
+			return;
+		}
+	}
+
 	void FailHandshake(StreamSocket* sock, const char* httpreply, const char* sockerror)
 	{
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(httpreply));
@@ -399,7 +728,12 @@ class WebSocketHook : public IOHookMiddle
 		key.append(MagicGUID);
 
 		std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
-		reply.append(BinToBase64((*sha1)->GenerateRaw(key), NULL, '=')).append("\r\n\r\n");
+		reply.append(BinToBase64((*sha1)->GenerateRaw(key), NULL, '=')).append("\r\n");
+
+		HTTPHeaderFinder extensionsheader;
+		if (config.compress && *zlib && !(*zlib)->creator->dying && extensionsheader.Find(recvq, "Sec-WebSocket-Extensions:", 25, reqend))
+			NegotiateDeflate(extensionsheader.ExtractLine(recvq), reply);
+		reply.append("\r\n");
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(reply));
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
@@ -415,10 +749,32 @@ class WebSocketHook : public IOHookMiddle
 		, state(STATE_HTTPREQ)
 		, lastpingpong(0)
 		, config(cfg)
+		, deflatestream(NULL)
+		, deflateenabled(false)
+		, resetdeflate(false)
+		, resetinflate(false)
+		, inflating(false)
 	{
 		sock->AddIOHook(this);
 	}
 
+	~WebSocketHook()
+	{
+		delete deflatestream;
+	}
+
+	/** Retrieves the stream used to compress and decompress messages or NULL if there is none. */
+	const Compress::MessageStream* GetDeflateStream() const { return deflatestream; }
+
+	/** Stops using a compression stream, e.g. because the module providing it is being unloaded.
+	 * Messages are sent uncompressed afterwards and receiving a compressed message is an error.
+	 */
+	void DropDeflateStream()
+	{
+		delete deflatestream;
+		deflatestream = NULL;
+	}
+
 	int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& uppersendq) CXX11_OVERRIDE
 	{
 		StreamSocket::SendQueue& mysendq = GetSendQ();
@@ -427,35 +783,51 @@ class WebSocketHook : public IOHookMiddle
 		if (state != STATE_ESTABLISHED)
 			return (mysendq.empty() ? 0 : 1);
 
+		// Lines which are entirely within one element of the upper sendq are sent as a slice
+		// of that element without copying them, only lines which span several elements are
+		// copied. The headers of all frames are written into a single buffer.
+		FrameList frames;
+		std::string headers;
 		std::string message;
 		for (StreamSocket::SendQueue::const_iterator elem = uppersendq.begin(); elem != uppersendq.end(); ++elem)
 		{
-			for (StreamSocket::SendQueue::Element::const_iterator chr = elem->begin(); chr != elem->end(); ++chr)
+			const char* const data = elem->data();
+			const size_t length = elem->length();
+			size_t start = 0;
+			while (start < length)
 			{
-				if (*chr == '\n')
+				const char* const eol = static_cast<const char*>(memchr(data + start, '\n', length - start));
+				if (!eol)
 				{
-					// We have found an entire message. Send it in its own frame.
-					if (config.sendastext)
-					{
-						// If we send messages as text then we need to ensure they are valid UTF-8.
-						std::string encoded;
-						utf8::replace_invalid(message.begin(), message.end(), std::back_inserter(encoded));
-
-						mysendq.push_back(PrepareSendQElem(encoded.length(), OP_TEXT));
-						mysendq.push_back(encoded);
-					}
-					else
-					{
-						// Otherwise, send the raw message as a binary frame.
-						mysendq.push_back(PrepareSendQElem(message.length(), OP_BINARY));
-						mysendq.push_back(message);
-					}
-					message.clear();
+					message.append(data + start, length - start);
+					break;
+				}
+
+				// We have found an entire message. Send it in its own frame.
+				const size_t linelength = eol - (data + start);
+				if (message.empty())
+				{
+					AddFrame(elem->substr(start, linelength), frames, headers);
 				}
-				else if (*chr != '\r')
+				else
 				{
-					message.push_back(*chr);
+					message.append(data + start, linelength);
+					AddFrame(StreamSocket::SendQueue::Element(message), frames, headers);
+					message.clear();
 				}
+				start += linelength + 1;
+			}
+		}
+
+		if (!frames.empty())
+		{
+			reference<const StreamSocket::SendQueue::Buffer> headerbuf = new StreamSocket::SendQueue::Buffer(headers);
+			size_t headerpos = 0;
+			for (FrameList::const_iterator frame = frames.begin(); frame != frames.end(); ++frame)
+			{
+				mysendq.push_back(StreamSocket::SendQueue::Element(headerbuf, headerpos, frame->first));
+				mysendq.push_back(frame->second);
+				headerpos += frame->first;
 			}
 		}
 
@@ -479,13 +851,18 @@ class WebSocketHook : public IOHookMiddle
 				return httpret;
 		}
 
+		// Frames are read from the recvq in place and the consumed data is only
+		// removed once all complete frames have been handled.
+		std::string::size_type pos = 0;
 		int wsret;
 		do
 		{
-			wsret = HandleWS(sock, destrecvq);
+			wsret = HandleWS(sock, pos, destrecvq);
 		}
-		while ((!GetRecvQ().empty()) && (wsret > 0));
+		while ((pos < GetRecvQ().length()) && (wsret > 0));
 
+		if (wsret >= 0)
+			GetRecvQ().erase(0, pos);
 		return wsret;
 	}
 
@@ -494,22 +871,41 @@ class WebSocketHook : public IOHookMiddle
 	}
 };
 
+const char WebSocketHook::DeflateTrailer[4] = { 0x00, 0x00, '\xff', '\xff' };
+
 void WebSocketHookProvider::OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 {
 	new WebSocketHook(this, sock, config);
 }
 
-class ModuleWebSocket : public Module
+/** Describe the data which was compressed or decompressed in one direction. */
+static std::string DescribeCompression(const char* direction, const Compress::Stats& cs)
+{
+	const double ratio = (cs.compressed ? static_cast<double>(cs.plain) / cs.compressed : 0);
+	return InspIRCd::Format("%s %llu/%llu bytes ratio %.2f time %llums", direction, cs.plain, cs.compressed,
+		ratio, cs.time / 1000000);
+}
+
+class ModuleWebSocket : public Module, public Stats::EventListener
 {
 	dynamic_reference_nocheck<HashProvider> hash;
+	dynamic_reference_nocheck<Compress::HookProvider> compress;
 	reference<WebSocketHookProvider> hookprov;
 
+	WebSocketHook* GetHook(LocalUser* user)
+	{
+		return static_cast<WebSocketHook*>(user->eh.GetModHook(this));
+	}
+
  public:
 	ModuleWebSocket()
-		: hash(this, "hash/sha1")
+		: Stats::EventListener(this)
+		, hash(this, "hash/sha1")
+		, compress(this, "compress/zlib")
 		, hookprov(new WebSocketHookProvider(this))
 	{
 		sha1 = &hash;
+		zlib = &compress;
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -533,6 +929,11 @@ class ModuleWebSocket : public Module
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("websocket");
 		config.sendastext = tag->getBool("sendastext", true);
+		config.compress = tag->getBool("compress", true);
+		config.servermaxwindowbits = tag->getUInt("servermaxwindowbits", 15, 9, 15);
+		config.clientmaxwindowbits = tag->getUInt("clientmaxwindowbits", 15, 9, 15);
+		config.servercontexttakeover = tag->getBool("servercontexttakeover", true);
+		config.clientcontexttakeover = tag->getBool("clientcontexttakeover", true);
 
 		irc::spacesepstream proxyranges(tag->getString("proxyranges"));
 		for (std::string proxyrange; proxyranges.GetToken(proxyrange); )
@@ -542,6 +943,37 @@ class ModuleWebSocket : public Module
 		hookprov->config = config;
 	}
 
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		// The streams of the compression module have to be gone before its code is.
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			WebSocketHook* hook = GetHook(*i);
+			if (hook && hook->GetDeflateStream() && hook->GetDeflateStream()->creator == mod)
+				hook->DropDeflateStream();
+		}
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'W')
+			return MOD_RES_PASSTHRU;
+
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			WebSocketHook* hook = GetHook(*i);
+			const Compress::MessageStream* stream = hook ? hook->GetDeflateStream() : NULL;
+			if (!stream)
+				continue;
+
+			stats.AddRow(249, (*i)->nick + " " + DescribeCompression("sent", stream->GetOutStats())
+				+ " " + DescribeCompression("received", stream->GetInStats()));
+		}
+		return MOD_RES_DENY;
+	}
+
 	void OnCleanup(ExtensionItem::ExtensibleType type, Extensible* item) CXX11_OVERRIDE
 	{
 		if (type != ExtensionItem::EXT_USER)
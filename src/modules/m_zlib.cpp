@@ -0,0 +1 @@
+/root/repo/src/modules/extra/m_zlib.cpp
\ No newline at end of file
@@ -241,6 +241,9 @@ int SocketEngine::RecvFrom(EventHandler* fd, void *buf, size_t len, int flags, s
 	return nbRecvd;
 }
 
+// Socket engines which send and receive data themselves provide Send(), Recv(), WriteV() and
+// Shutdown(EventHandler*, int).
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::Send(EventHandler* fd, const void *buf, size_t len, int flags)
 {
 	int nbSent = send(fd->GetFd(), (const char*)buf, len, flags);
@@ -254,6 +257,7 @@ int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
 	stats.UpdateReadCounters(nbRecvd);
 	return nbRecvd;
 }
+#endif
 
 int SocketEngine::SendTo(EventHandler* fd, const void* buf, size_t len, int flags, const irc::sockets::sockaddrs& address)
 {
@@ -262,12 +266,14 @@ int SocketEngine::SendTo(EventHandler* fd, const void* buf, size_t len, int flag
 	return nbSent;
 }
 
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
 {
 	int sent = writev(fd->GetFd(), iovec, count);
 	stats.UpdateWriteCounters(sent);
 	return sent;
 }
+#endif
 
 #ifdef _WIN32
 int SocketEngine::WriteV(EventHandler* fd, const iovec* iovec, int count)
@@ -298,10 +304,12 @@ int SocketEngine::Connect(EventHandler* fd, const irc::sockets::sockaddrs& addre
 	return ret;
 }
 
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::Shutdown(EventHandler* fd, int how)
 {
 	return shutdown(fd->GetFd(), how);
 }
+#endif
 
 int SocketEngine::Bind(int fd, const irc::sockets::sockaddrs& addr)
 {
@@ -40,6 +40,11 @@ namespace
 	/** These are used by epoll() to hold socket events
 	 */
 	std::vector<struct epoll_event> events(16);
+
+	/** Handlers which became writable in the current batch of events along with their fd,
+	 * these are dispatched after all reads of the batch
+	 */
+	std::vector<std::pair<int, EventHandler*> > writers;
 }
 
 void SocketEngine::Init()
@@ -159,13 +164,16 @@ void SocketEngine::DelFd(EventHandler* eh)
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(bool wait)
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), wait ? 1000 : 0);
 	ServerInstance->UpdateTime();
 
 	stats.TotalEvents += i;
 
+	// Reads are dispatched for the whole batch first, anything they queue up for a socket
+	// which is writable in this batch then goes out in a single write further down
+	writers.clear();
 	for (int j = 0; j < i; j++)
 	{
 		// Copy these in case the vector gets resized and ev invalidated
@@ -217,10 +225,20 @@ int SocketEngine::DispatchEvents()
 				continue;
 		}
 		if (ev.events & EPOLLOUT)
-		{
+			writers.push_back(std::make_pair(fd, eh));
+	}
+
+	for (std::vector<std::pair<int, EventHandler*> >::const_iterator j = writers.begin(); j != writers.end(); ++j)
+	{
+		// The handler may have been deleted by a read handler or by an earlier write handler
+		EventHandler* const eh = j->second;
+		if (eh == GetRef(j->first))
 			eh->OnEventHandlerWrite();
-		}
 	}
 
+	// The batch filled the array, make room for more events next time
+	if (i == static_cast<int>(events.size()))
+		events.resize(events.size() * 2);
+
 	return i;
 }
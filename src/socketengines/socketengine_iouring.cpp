@@ -0,0 +1,960 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/** A specialisation of the SocketEngine class, designed to use Linux io_uring.
+ *
+ * All requests are queued in the submission ring and are handed to the kernel in a single
+ * io_uring_enter() call once per main loop iteration, together with waiting for completions,
+ * rather than making a system call for every event mask change, read and write.
+ *
+ * Stream sockets are read and written through the ring. A read is a one-shot poll request
+ * linked to a receive which takes a buffer from a provided buffer ring, so idle sockets do
+ * not hold any memory; the received data is returned by the next call to Recv(). Data
+ * passed to Send() and WriteV() is copied and sent without waiting when the ring is next
+ * submitted, so the result of the send is known as soon as io_uring_enter() returns. Only
+ * sockets which use FD_WANT_FAST_READ are read through the ring as sockets which are read
+ * by libraries (e.g. libpq) are polled with FD_WANT_POLL_READ. Other file descriptors such
+ * as listeners are only polled.
+ *
+ * Polling needs Linux 5.5. Reading and writing through the ring also needs provided buffer
+ * rings from Linux 5.19; when they are not available recv() and writev() are used instead.
+ */
+namespace
+{
+	/** The number of entries in the submission ring. If this fills up before the
+	 * next call to DispatchEvents() the queued entries are submitted early.
+	 */
+	const unsigned int RING_ENTRIES = 4096;
+
+	/** The number of buffers in the provided buffer ring, must be a power of two. If all of
+	 * them are in use receives fail with ENOBUFS and the socket is read with recv() instead.
+	 */
+	const unsigned int RECV_BUFFERS = 1024;
+
+	/** The size of each of the buffers in the provided buffer ring. */
+	const unsigned int RECV_BUFFER_SIZE = 8192;
+
+	/** The group id of the provided buffer ring. */
+	const uint16_t RECV_BUFFER_GROUP = 0;
+
+	/** User data of the timeout request used to bound the time spent waiting for events. */
+	const uint64_t TIMEOUT_DATA = ~static_cast<uint64_t>(0);
+
+	/** User data of requests whose completion does not need any handling. */
+	const uint64_t IGNORE_DATA = TIMEOUT_DATA - 1;
+
+	/** The bits of the generation of a file descriptor which are stored in the user data of its requests. */
+	const uint32_t GENERATION_MASK = 0x3FFFFFFF;
+
+	/** The types of request made for a file descriptor. */
+	enum RequestType
+	{
+		/** Waits for the file descriptor to become readable. */
+		REQUEST_POLL_READ,
+
+		/** Receives into a provided buffer once the REQUEST_POLL_READ it is linked to completes. */
+		REQUEST_RECV,
+
+		/** Waits for the file descriptor to become writable. */
+		REQUEST_POLL_WRITE,
+
+		/** Sends the data queued by Send() or WriteV(). */
+		REQUEST_SEND
+	};
+
+	/** The state of the requests of a file descriptor. */
+	struct FdState
+	{
+		/** Incremented when the file descriptor is removed so that the completions of its
+		 * requests which are still in the completion ring can be ignored.
+		 */
+		uint32_t generation;
+
+		/** Whether the file descriptor is a connected stream socket whose writes go through the ring. */
+		bool stream;
+
+		/** Whether reads of the file descriptor go through the ring. */
+		bool ringread;
+
+		/** Whether a read request is in flight. */
+		bool reading;
+
+		/** Whether the read request in flight has a receive linked to it. */
+		bool readlinked;
+
+		/** Whether the read request in flight has been cancelled. */
+		bool readcancelled;
+
+		/** Whether a write poll request is in flight. */
+		bool writing;
+
+		/** Whether the write poll request in flight has been cancelled. */
+		bool writecancelled;
+
+		/** Whether a send is in flight. */
+		bool sending;
+
+		/** Whether the last receive filled its buffer which means more data is probably waiting. */
+		bool inputfull;
+
+		/** Whether the input ended because of end of file or an error. */
+		bool inputend;
+
+		/** The error which ended the input or 0 for end of file. */
+		int inputerror;
+
+		/** Data which was received through the ring and has not been returned by Recv() yet. */
+		std::string input;
+
+		/** The position in input of the first byte which has not been returned yet. */
+		size_t inputpos;
+
+		/** Data which is being sent through the ring. */
+		std::vector<char> output;
+
+		/** The number of bytes of output which have been sent. */
+		size_t outputpos;
+
+		FdState() : generation(0) { Reset(); }
+
+		/** Resets everything but the generation. */
+		void Reset()
+		{
+			stream = ringread = false;
+			reading = readlinked = readcancelled = writing = writecancelled = sending = false;
+			inputfull = inputend = false;
+			inputerror = 0;
+			input.clear();
+			inputpos = 0;
+			output.clear();
+			outputpos = 0;
+		}
+
+		/** Checks whether there is input which Recv() has not returned yet. */
+		bool HasInput() const { return inputpos < input.size() || inputend; }
+
+		/** Checks whether there is output which has not been sent yet. */
+		bool HasOutput() const { return outputpos < output.size(); }
+	};
+
+	/** Layout of struct __kernel_timespec which is not available in older kernel headers. */
+	struct KernelTimespec
+	{
+		int64_t tv_sec;
+		long long tv_nsec;
+	};
+
+	int EngineHandle = -1;
+
+	/** Mappings of the submission ring, the completion ring and the submission entries. */
+	void* sq_ptr = MAP_FAILED;
+	size_t sq_size;
+	void* cq_ptr = MAP_FAILED;
+	size_t cq_size;
+	struct io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqes_size;
+
+	/** Fields of the submission ring. */
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int sq_entries;
+
+	/** Fields of the completion ring. */
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/** Whether stream sockets are read and written through the ring. */
+	bool ringio = false;
+
+	/** The entries of the provided buffer ring. The entries are accessed directly rather than through
+	 * struct io_uring_buf_ring whose flexible array is at the wrong offset when compiled as C++.
+	 */
+	struct io_uring_buf* bufring = static_cast<io_uring_buf*>(MAP_FAILED);
+
+	/** The memory of the buffers in the provided buffer ring. */
+	char* recvbuffers = NULL;
+
+	/** The tail of the provided buffer ring. */
+	uint16_t bufring_tail = 0;
+
+	/** Request state, indexed by file descriptor. */
+	std::vector<FdState> fdstate(16);
+
+	/** The output of sends which were in flight when their file descriptor was removed, indexed by user data. */
+	std::map<uint64_t, std::vector<char> > orphans;
+
+	/** Completions copied out of the completion ring before being dispatched. */
+	std::vector<struct io_uring_cqe> events(16);
+
+	/** The maximum amount of time to wait for events. */
+	KernelTimespec timeout = { 1, 0 };
+
+	/** Whether a timeout request is currently in flight. */
+	bool timeout_pending = false;
+}
+
+static int EnterRing(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, NULL, 0);
+}
+
+static unsigned int GetPendingSubmissions()
+{
+	return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void UnmapRing()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_size);
+	if (bufring != MAP_FAILED)
+		munmap(bufring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+
+	delete[] recvbuffers;
+	recvbuffers = NULL;
+	bufring = static_cast<io_uring_buf*>(MAP_FAILED);
+	sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	cq_ptr = sq_ptr = MAP_FAILED;
+	ringio = false;
+}
+
+/** Makes sure that there is space for the given number of entries in the submission ring.
+ * Entries which are linked together have to be submitted together so space for all of
+ * them has to be reserved before any of them are queued.
+ */
+static bool ReserveSubmissionEntries(unsigned int count)
+{
+	if (GetPendingSubmissions() + count <= sq_entries)
+		return true;
+
+	// The submission ring is full; hand the queued entries to the kernel now.
+	if (EnterRing(GetPendingSubmissions(), 0, 0) < 0 || GetPendingSubmissions() + count > sq_entries)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Unable to submit io_uring requests: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/** Retrieves the next entry in the submission ring. ReserveSubmissionEntries() must have been called first. */
+static struct io_uring_sqe* GetSubmissionEntry(uint64_t user_data)
+{
+	const unsigned int index = *sq_tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	sq_array[index] = index;
+	return sqe;
+}
+
+static void QueueSubmissionEntry()
+{
+	__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t MakeUserData(int fd, uint32_t generation, RequestType type)
+{
+	return (static_cast<uint64_t>(generation & GENERATION_MASK) << 34) | (static_cast<uint64_t>(type) << 32) | static_cast<uint32_t>(fd);
+}
+
+/** Gives a buffer back to the provided buffer ring. */
+static void RecycleBuffer(uint16_t bid)
+{
+	struct io_uring_buf& buf = bufring[bufring_tail & (RECV_BUFFERS - 1)];
+	buf.addr = reinterpret_cast<uintptr_t>(recvbuffers + bid * RECV_BUFFER_SIZE);
+	buf.len = RECV_BUFFER_SIZE;
+	buf.bid = bid;
+
+	// The tail of the ring is stored in the reserved field of the first entry.
+	__atomic_store_n(&bufring[0].resv, ++bufring_tail, __ATOMIC_RELEASE);
+}
+
+/** Sets up reading and writing stream sockets through the ring if the kernel supports it.
+ * @return True if stream sockets can be read and written through the ring, false otherwise.
+ */
+static bool SetupRingIO()
+{
+	std::vector<char> probebuf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&probebuf[0]);
+	if (syscall(__NR_io_uring_register, EngineHandle, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return false;
+
+	if (probe->last_op < IORING_OP_RECV || !(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) || !(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED))
+		return false;
+
+	void* ring = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return false;
+
+	bufring = static_cast<io_uring_buf*>(ring);
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(ring);
+	reg.ring_entries = RECV_BUFFERS;
+	reg.bgid = RECV_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, EngineHandle, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+
+	recvbuffers = new char[RECV_BUFFERS * RECV_BUFFER_SIZE];
+	bufring_tail = 0;
+	for (unsigned int bid = 0; bid < RECV_BUFFERS; bid++)
+		RecycleBuffer(bid);
+	return true;
+}
+
+/** Checks whether a file descriptor is a connected stream socket which can be written through the ring. */
+static bool IsStreamSocket(int fd)
+{
+	int type;
+	socklen_t typesize = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typesize) < 0 || type != SOCK_STREAM)
+		return false;
+
+	int listening;
+	socklen_t listeningsize = sizeof(listening);
+	return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listeningsize) == 0 && !listening;
+}
+
+/** Cancels a poll request, and the receive linked to it if there is one. */
+static void CancelRequest(int fd, const FdState& state, RequestType type)
+{
+	if (!ReserveSubmissionEntries(1))
+		return;
+
+	struct io_uring_sqe* sqe = GetSubmissionEntry(IGNORE_DATA);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = MakeUserData(fd, state.generation, type);
+	QueueSubmissionEntry();
+}
+
+/** Queues a send of the output of a file descriptor which has not been sent yet. */
+static bool QueueSend(int fd, FdState& state)
+{
+	if (!ReserveSubmissionEntries(1))
+		return false;
+
+	// The send does not wait for the socket to become writable so it completes during the submission.
+	struct io_uring_sqe* sqe = GetSubmissionEntry(MakeUserData(fd, state.generation, REQUEST_SEND));
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(&state.output[state.outputpos]);
+	sqe->len = state.output.size() - state.outputpos;
+	sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	QueueSubmissionEntry();
+	state.sending = true;
+	return true;
+}
+
+/** Makes the requests in flight for a file descriptor match the events its handler wants.
+ * @param fd The file descriptor to update the requests of.
+ * @param mask The event mask of the handler of the file descriptor.
+ * @return True if the handler wants to read and has to be given a trial read for data which
+ * was already received, false otherwise.
+ */
+static bool SyncRequests(int fd, int mask)
+{
+	FdState& state = fdstate[fd];
+	if (state.stream && ringio && (mask & FD_WANT_FAST_READ))
+		state.ringread = true;
+
+	const bool wantread = (mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ));
+	if (!wantread && state.reading && !state.readcancelled)
+	{
+		CancelRequest(fd, state, REQUEST_POLL_READ);
+		state.readcancelled = true;
+	}
+	else if (wantread && !state.reading && !state.HasInput() && ReserveSubmissionEntries(2))
+	{
+		struct io_uring_sqe* sqe = GetSubmissionEntry(MakeUserData(fd, state.generation, REQUEST_POLL_READ));
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll_events = POLLIN;
+		if (state.ringread)
+			sqe->flags = IOSQE_IO_LINK;
+		QueueSubmissionEntry();
+
+		if (state.ringread)
+		{
+			sqe = GetSubmissionEntry(MakeUserData(fd, state.generation, REQUEST_RECV));
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = fd;
+			sqe->len = RECV_BUFFER_SIZE;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = RECV_BUFFER_GROUP;
+			sqe->msg_flags = MSG_DONTWAIT;
+			QueueSubmissionEntry();
+		}
+
+		state.reading = true;
+		state.readlinked = state.ringread;
+		state.readcancelled = false;
+	}
+
+	// While output is being sent the handler is told about writes when the send completes. Output
+	// which did not fit into the socket is sent once the socket becomes writable again.
+	bool wantwrite = (mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE));
+	if (state.HasOutput())
+		wantwrite = !state.sending;
+
+	if (!wantwrite && state.writing && !state.writecancelled)
+	{
+		CancelRequest(fd, state, REQUEST_POLL_WRITE);
+		state.writecancelled = true;
+	}
+	else if (wantwrite && !state.writing && ReserveSubmissionEntries(1))
+	{
+		struct io_uring_sqe* sqe = GetSubmissionEntry(MakeUserData(fd, state.generation, REQUEST_POLL_WRITE));
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll_events = POLLOUT;
+		QueueSubmissionEntry();
+		state.writing = true;
+		state.writecancelled = false;
+	}
+
+	return wantread && state.HasInput();
+}
+
+/** Checks whether a poll request completed because of an error.
+ * @param fd The file descriptor which was polled.
+ * @param res The result of the poll request.
+ * @param error Set to the error which occurred or 0 if the connection was closed.
+ * @return True if an error occurred, false otherwise.
+ */
+static bool GetPollError(int fd, int res, int& error)
+{
+	if (res < 0)
+	{
+		error = -res;
+		return true;
+	}
+
+	if (res & POLLHUP)
+	{
+		error = 0;
+		return true;
+	}
+
+	if (res & POLLERR)
+	{
+		socklen_t codesize = sizeof(int);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &codesize) < 0)
+			error = errno;
+		return true;
+	}
+	return false;
+}
+
+void SocketEngine::Init()
+{
+	LookupMaxFds();
+	RecoverFromFork();
+}
+
+void SocketEngine::RecoverFromFork()
+{
+	// Requests are owned by the task which submitted them so create a new ring for the
+	// child process. No requests have been submitted at the point where we fork.
+	if (EngineHandle != -1)
+		Deinit();
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	EngineHandle = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (EngineHandle == -1)
+		InitError();
+
+	// Completions must not be dropped when the completion ring overflows.
+	if (!(params.features & IORING_FEAT_NODROP))
+	{
+		errno = ENOSYS;
+		InitError();
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = std::max(sq_size, cq_size);
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		InitError();
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+	if (cq_ptr == MAP_FAILED)
+		InitError();
+
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<io_uring_sqe*>(mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED)
+		InitError();
+
+	char* const sq = static_cast<char*>(sq_ptr);
+	sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+	sq_entries = params.sq_entries;
+
+	char* const cq = static_cast<char*>(cq_ptr);
+	cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	ringio = SetupRingIO();
+	timeout_pending = false;
+}
+
+void SocketEngine::Deinit()
+{
+	UnmapRing();
+	Close(EngineHandle);
+	EngineHandle = -1;
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d)", fd);
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	while (static_cast<unsigned int>(fd) >= fdstate.size())
+		fdstate.resize(fdstate.size() * 2);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	eh->SetEventMask(event_mask);
+	fdstate[fd].stream = ringio && IsStreamSocket(fd);
+	SyncRequests(fd, event_mask);
+	ResizeDouble(events);
+
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstate.size())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SetEvents() on unknown fd: %d", eh->GetFd());
+		return;
+	}
+
+	if (SyncRequests(fd, new_mask))
+	{
+		eh->SetEventMask((new_mask | FD_ADD_TRIAL_READ) & ~FD_READ_WILL_BLOCK);
+		trials.insert(fd);
+	}
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstate.size())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d)", fd);
+		return;
+	}
+
+	FdState& state = fdstate[fd];
+	if (state.reading && !state.readcancelled)
+		CancelRequest(fd, state, REQUEST_POLL_READ);
+	if (state.writing && !state.writecancelled)
+		CancelRequest(fd, state, REQUEST_POLL_WRITE);
+
+	// The kernel may still be reading the output of a send which is in flight.
+	if (state.sending)
+		orphans[MakeUserData(fd, state.generation, REQUEST_SEND)].swap(state.output);
+
+	state.generation++;
+	state.Reset();
+
+	// Requests in flight hold a reference to the file so the cancellations have to be
+	// submitted before the file descriptor is closed and its number can be reused.
+	if (GetPendingSubmissions())
+		EnterRing(GetPendingSubmissions(), 0, 0);
+
+	SocketEngine::DelFdRef(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents(bool wait)
+{
+	if (wait && !timeout_pending && ReserveSubmissionEntries(1))
+	{
+		// Wait for at most one second, or until any other request completes.
+		struct io_uring_sqe* sqe = GetSubmissionEntry(TIMEOUT_DATA);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = reinterpret_cast<uintptr_t>(&timeout);
+		sqe->len = 1;
+		sqe->off = 1;
+		QueueSubmissionEntry();
+		timeout_pending = true;
+	}
+
+	// Submit all of the queued requests and wait for events in a single call.
+	if (EnterRing(GetPendingSubmissions(), wait ? 1 : 0, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "io_uring_enter() failed: %s", strerror(errno));
+	ServerInstance->UpdateTime();
+
+	// Copy the completions out of the ring as dispatching them can submit new requests.
+	const unsigned int head = *cq_head;
+	const unsigned int count = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - head;
+	if (count > events.size())
+		events.resize(count * 2);
+	for (unsigned int j = 0; j < count; j++)
+		events[j] = cqes[(head + j) & *cq_mask];
+	__atomic_store_n(cq_head, head + count, __ATOMIC_RELEASE);
+
+	int i = 0;
+	for (unsigned int j = 0; j < count; j++)
+	{
+		const struct io_uring_cqe& cqe = events[j];
+		if (cqe.user_data == TIMEOUT_DATA)
+		{
+			timeout_pending = false;
+			continue;
+		}
+
+		if (cqe.user_data == IGNORE_DATA)
+			continue;
+
+		const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+		const RequestType type = static_cast<RequestType>((cqe.user_data >> 32) & 3);
+		const uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 34);
+
+		// The buffer a receive was read into has to be given back even if the data is not wanted.
+		const uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		const char* const buffer = (cqe.flags & IORING_CQE_F_BUFFER) ? recvbuffers + bid * RECV_BUFFER_SIZE : NULL;
+
+		// Skip the completions of requests for file descriptors which were removed.
+		EventHandler* const eh = GetRef(fd);
+		if (!eh || (fdstate[fd].generation & GENERATION_MASK) != generation)
+		{
+			if (type == REQUEST_SEND)
+				orphans.erase(cqe.user_data);
+			if (buffer)
+				RecycleBuffer(bid);
+			continue;
+		}
+
+		const int mask = eh->GetEventMask();
+		int error;
+		switch (type)
+		{
+			case REQUEST_POLL_READ:
+			{
+				// The result of a poll request which has a receive linked to it is reported by the receive.
+				FdState& state = fdstate[fd];
+				if (state.readlinked)
+				{
+					// If the poll request failed the receive is cancelled.
+					if (cqe.res < 0 && cqe.res != -ECANCELED)
+					{
+						state.inputend = true;
+						state.inputerror = -cqe.res;
+					}
+					break;
+				}
+
+				state.reading = false;
+				if (cqe.res == -ECANCELED)
+					break;
+
+				if (!(mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ)))
+					break;
+
+				i++;
+				if (GetPollError(fd, cqe.res, error))
+				{
+					stats.ErrorEvents++;
+					eh->OnEventHandlerError(error);
+					break;
+				}
+
+				eh->SetEventMask(mask & ~FD_READ_WILL_BLOCK);
+				eh->OnEventHandlerRead();
+				break;
+			}
+
+			case REQUEST_RECV:
+			{
+				FdState& state = fdstate[fd];
+				state.reading = false;
+
+				bool notify = true;
+				if (cqe.res > 0 && buffer)
+				{
+					state.input.append(buffer, cqe.res);
+					state.inputfull = (cqe.res == static_cast<int>(RECV_BUFFER_SIZE));
+				}
+				else if (cqe.res == 0)
+				{
+					state.inputend = true;
+					state.inputerror = 0;
+				}
+				else if (cqe.res == -EAGAIN || cqe.res == -ECANCELED)
+				{
+					notify = state.inputend;
+				}
+				else if (cqe.res != -ENOBUFS)
+				{
+					// If there was no buffer left the handler is notified anyway and reads with recv().
+					state.inputend = true;
+					state.inputerror = -cqe.res;
+				}
+
+				if (buffer)
+					RecycleBuffer(bid);
+
+				if (notify && (mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ)))
+				{
+					i++;
+					eh->SetEventMask(mask & ~FD_READ_WILL_BLOCK);
+					eh->OnEventHandlerRead();
+				}
+				break;
+			}
+
+			case REQUEST_POLL_WRITE:
+			{
+				FdState& state = fdstate[fd];
+				state.writing = false;
+				if (cqe.res == -ECANCELED)
+					break;
+
+				if (GetPollError(fd, cqe.res, error))
+				{
+					i++;
+					stats.ErrorEvents++;
+					eh->OnEventHandlerError(error);
+				}
+				else if (state.HasOutput())
+				{
+					// The socket can take more of the output which did not fit into it before.
+					QueueSend(fd, state);
+				}
+				else if (mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+				{
+					i++;
+					eh->SetEventMask(mask & ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE));
+					eh->OnEventHandlerWrite();
+				}
+				break;
+			}
+
+			case REQUEST_SEND:
+			{
+				FdState& state = fdstate[fd];
+				state.sending = false;
+				if (cqe.res > 0)
+				{
+					state.outputpos += cqe.res;
+					if (state.HasOutput())
+						break;
+
+					state.output.clear();
+					state.outputpos = 0;
+
+					// Writes were reported as blocking while the output was being sent.
+					if (mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+					{
+						i++;
+						eh->SetEventMask(mask & ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE));
+						eh->OnEventHandlerWrite();
+					}
+				}
+				else if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -ECANCELED)
+				{
+					state.output.clear();
+					state.outputpos = 0;
+
+					i++;
+					stats.ErrorEvents++;
+					eh->OnEventHandlerError(-cqe.res);
+				}
+				break;
+			}
+		}
+
+		// Poll requests are one-shot so new ones are needed if the handler is still interested in
+		// events. This is a no-op if the handler changed its event mask while handling the event.
+		if (eh == GetRef(fd) && (fdstate[fd].generation & GENERATION_MASK) == generation && SyncRequests(fd, eh->GetEventMask()))
+		{
+			eh->SetEventMask((eh->GetEventMask() | FD_ADD_TRIAL_READ) & ~FD_READ_WILL_BLOCK);
+			trials.insert(fd);
+		}
+	}
+
+	stats.TotalEvents += i;
+	return i;
+}
+
+int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
+{
+	const int sock = fd->GetFd();
+	FdState* const state = (sock >= 0 && static_cast<unsigned int>(sock) < fdstate.size() && fdstate[sock].ringread) ? &fdstate[sock] : NULL;
+	if (!state || (!state->HasInput() && !state->reading))
+	{
+		int nbRecvd = recv(sock, (char*)buf, len, flags);
+		stats.UpdateReadCounters(nbRecvd);
+		return nbRecvd;
+	}
+
+	if (state->inputpos == state->input.size())
+	{
+		if (state->inputend)
+		{
+			stats.UpdateReadCounters(state->inputerror ? -1 : 0);
+			errno = state->inputerror;
+			return state->inputerror ? -1 : 0;
+		}
+
+		// Data which arrives now is received by the read request in flight, reading it here could reorder it.
+		stats.UpdateReadCounters(-1);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	size_t nbRecvd = std::min(len, state->input.size() - state->inputpos);
+	memcpy(buf, state->input.data() + state->inputpos, nbRecvd);
+	state->inputpos += nbRecvd;
+	if (state->inputpos == state->input.size())
+	{
+		state->input.clear();
+		state->inputpos = 0;
+
+		// A receive which filled its buffer probably left more data in the socket.
+		if (state->inputfull && nbRecvd < len)
+		{
+			const int ret = recv(sock, static_cast<char*>(buf) + nbRecvd, len - nbRecvd, flags);
+			if (ret > 0)
+			{
+				nbRecvd += ret;
+			}
+			else if (ret == 0 || !SocketEngine::IgnoreError())
+			{
+				state->inputend = true;
+				state->inputerror = ret ? errno : 0;
+			}
+		}
+		state->inputfull = false;
+
+		// Everything which was received has been read so the next read can be requested.
+		if (SyncRequests(sock, fd->GetEventMask()))
+		{
+			fd->SetEventMask((fd->GetEventMask() | FD_ADD_TRIAL_READ) & ~FD_READ_WILL_BLOCK);
+			trials.insert(sock);
+		}
+	}
+
+	stats.UpdateReadCounters(nbRecvd);
+	return nbRecvd;
+}
+
+int SocketEngine::Send(EventHandler* fd, const void *buf, size_t len, int flags)
+{
+	const int sock = fd->GetFd();
+	if (sock < 0 || static_cast<unsigned int>(sock) >= fdstate.size() || !fdstate[sock].stream)
+	{
+		int nbSent = send(sock, (const char*)buf, len, flags);
+		stats.UpdateWriteCounters(nbSent);
+		return nbSent;
+	}
+
+	IOVector iov;
+	iov.iov_base = const_cast<void*>(buf);
+	iov.iov_len = len;
+	return WriteV(fd, &iov, 1);
+}
+
+int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
+{
+	const int sock = fd->GetFd();
+	FdState* const state = (sock >= 0 && static_cast<unsigned int>(sock) < fdstate.size() && fdstate[sock].stream) ? &fdstate[sock] : NULL;
+	if (state && (state->HasOutput() || state->sending))
+	{
+		// The output is only replaced once all of it has been sent.
+		stats.UpdateWriteCounters(-1);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (!state || !ReserveSubmissionEntries(1))
+	{
+		int sent = writev(sock, iovec, count);
+		stats.UpdateWriteCounters(sent);
+		return sent;
+	}
+
+	state->output.clear();
+	state->outputpos = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const char* const base = static_cast<const char*>(iovec[i].iov_base);
+		state->output.insert(state->output.end(), base, base + iovec[i].iov_len);
+	}
+
+	if (state->output.empty())
+		return 0;
+
+	QueueSend(sock, *state);
+	stats.UpdateWriteCounters(state->output.size());
+	return state->output.size();
+}
+
+int SocketEngine::Shutdown(EventHandler* fd, int how)
+{
+	// Output which is queued for sending has to reach the socket before it is shut down.
+	const int sock = fd->GetFd();
+	if (sock >= 0 && static_cast<unsigned int>(sock) < fdstate.size() && fdstate[sock].sending && GetPendingSubmissions())
+		EnterRing(GetPendingSubmissions(), 0, 0);
+
+	return shutdown(sock, how);
+}
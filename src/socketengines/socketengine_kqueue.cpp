@@ -163,11 +163,11 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 	}
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(bool wait)
 {
 	struct timespec ts;
 	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_sec = wait ? 1 : 0;
 
 	int i = kevent(EngineHandle, &changelist.front(), ChangePos, &ke_list.front(), ke_list.size(), &ts);
 	ChangePos = 0;
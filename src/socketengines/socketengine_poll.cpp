@@ -154,9 +154,9 @@ void SocketEngine::DelFd(EventHandler* eh)
 			"(Filled gap with: %d (index: %d))", fd, index, last_fd, last_index);
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(bool wait)
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, wait ? 1000 : 0);
 	int processed = 0;
 	ServerInstance->UpdateTime();
 
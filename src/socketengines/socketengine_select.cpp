@@ -127,10 +127,10 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 	}
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(bool wait)
 {
 	timeval tval;
-	tval.tv_sec = 1;
+	tval.tv_sec = wait ? 1 : 0;
 	tval.tv_usec = 0;
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
@@ -38,6 +38,7 @@ Timer::Timer(unsigned int secs_from_now, bool repeating)
 	: trigger(ServerInstance->Time() + secs_from_now)
 	, secs(secs_from_now)
 	, repeat(repeating)
+	, slot(NULL)
 {
 }
 
@@ -46,42 +47,152 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
+TimerManager::TimerManager()
+	: current(0)
+	, count(0)
+{
+}
+
+static void MoveTimers(insp::intrusive_list<Timer>& from, insp::intrusive_list<Timer>& to)
+{
+	while (!from.empty())
+	{
+		Timer* t = from.front();
+		from.pop_front();
+		to.push_front(t);
+	}
+}
+
 void TimerManager::TickTimers(time_t TIME)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	// If the clock has gone backwards or jumped far forward rebuild the wheel around
+	// the new time instead of walking through every second in between.
+	if (count && (TIME < current - 1 || TIME - current > (1 << ROOT_BITS)))
+		Rebuild(TIME);
+
+	while (current <= TIME)
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
+		if (!count)
+		{
+			// Nothing is scheduled so there is no need to walk the wheel second by second.
+			current = TIME + 1;
 			break;
+		}
 
-		Timers.erase(i++);
+		const size_t index = current & ((1 << ROOT_BITS) - 1);
+		if (!index)
+		{
+			// The lowest level has wrapped around, pull the timers of the next slot of each
+			// higher level down until we reach a level which has not wrapped around itself.
+			for (unsigned int level = 0; level < LEVELS; level++)
+			{
+				const size_t slot = (current >> (ROOT_BITS + level * LEVEL_BITS)) & ((1 << LEVEL_BITS) - 1);
+				Cascade(levels[level][slot]);
+				if (slot)
+					break;
+			}
+		}
 
-		if (!t->Tick(TIME))
-			continue;
+		// Move the timers out of the slot first as a timer added while ticking might go into it.
+		MoveTimers(root[index], expiring);
+		for (TimerList::iterator i = expiring.begin(); i != expiring.end(); ++i)
+			(*i)->slot = &expiring;
+		current++;
 
-		if (t->GetRepeat())
+		while (!expiring.empty())
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			Timer* t = expiring.front();
+			DelTimer(t);
+
+			if (!t->Tick(TIME))
+				continue;
+
+			if (t->GetRepeat())
+			{
+				t->SetTrigger(TIME + t->GetInterval());
+				AddTimer(t);
+			}
 		}
 	}
 }
 
-void TimerManager::DelTimer(Timer* t)
+void TimerManager::Cascade(TimerList& list)
+{
+	TimerList pending;
+	MoveTimers(list, pending);
+	while (!pending.empty())
+	{
+		Timer* t = pending.front();
+		pending.pop_front();
+		count--;
+		Schedule(t);
+	}
+}
+
+void TimerManager::Rebuild(time_t TIME)
+{
+	TimerList pending;
+	for (size_t i = 0; i < (1 << ROOT_BITS); i++)
+		MoveTimers(root[i], pending);
+	for (unsigned int level = 0; level < LEVELS; level++)
+		for (size_t i = 0; i < (1 << LEVEL_BITS); i++)
+			MoveTimers(levels[level][i], pending);
+
+	current = TIME;
+	Cascade(pending);
+}
+
+void TimerManager::Schedule(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	// Timers which are already due go into the slot which will be processed next.
+	time_t expires = std::max(t->GetTrigger(), current);
+	const time_t delta = expires - current;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	TimerList* list;
+	if (delta < (1 << ROOT_BITS))
 	{
-		if (i->second == t)
-		{
-			Timers.erase(i);
-			break;
-		}
+		list = &root[expires & ((1 << ROOT_BITS) - 1)];
+	}
+	else
+	{
+		unsigned int level = 0;
+		while (level < LEVELS - 1 && delta >= (static_cast<time_t>(1) << (ROOT_BITS + (level + 1) * LEVEL_BITS)))
+			level++;
+
+		// Clamp timers which are further in the future than the wheel covers, they will be
+		// rescheduled based on their real trigger time once their slot is cascaded.
+		const time_t range = static_cast<time_t>(1) << (ROOT_BITS + LEVELS * LEVEL_BITS);
+		if (delta >= range)
+			expires = current + range - 1;
+
+		list = &levels[level][(expires >> (ROOT_BITS + level * LEVEL_BITS)) & ((1 << LEVEL_BITS) - 1)];
 	}
+
+	list->push_front(t);
+	t->slot = list;
+	count++;
+}
+
+void TimerManager::DelTimer(Timer* t)
+{
+	if (!t->slot)
+		return;
+
+	t->slot->erase(t);
+	t->slot = NULL;
+	count--;
 }
 
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	// Timers can not be scheduled more than once.
+	DelTimer(t);
+
+	// If there are no timers then there is nothing for the wheel to be consistent with so
+	// skip ahead to the current time rather than walking through all of the seconds since
+	// the last timer was removed.
+	if (!count && current < ServerInstance->Time())
+		current = ServerInstance->Time();
+
+	Schedule(t);
 }
@@ -201,7 +201,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	BanCacheHit* const b = ServerInstance->BanCache.GetHit(New->GetIPString());
+	BanCacheHit* const b = ServerInstance->BanCache.GetHit(New->client_sa);
 	if (b)
 	{
 		if (!b->Type.empty() && !New->exempt)
@@ -319,50 +319,17 @@ void UserManager::QuitUser(User* user, const std::string& quitmessage, const std
 
 void UserManager::AddClone(User* user)
 {
-	CloneCounts& counts = clonemap[user->GetCIDRMask()];
-	counts.global++;
-	if (IS_LOCAL(user))
-		counts.local++;
+	clones.Add(user->client_sa, IS_LOCAL(user));
 }
 
 void UserManager::RemoveCloneCounts(User *user)
 {
-	CloneMap::iterator it = clonemap.find(user->GetCIDRMask());
-	if (it != clonemap.end())
-	{
-		CloneCounts& counts = it->second;
-		counts.global--;
-		if (counts.global == 0)
-		{
-			// No more users from this IP, remove entry from the map
-			clonemap.erase(it);
-			return;
-		}
-
-		if (IS_LOCAL(user))
-			counts.local--;
-	}
-}
-
-void UserManager::RehashCloneCounts()
-{
-	clonemap.clear();
-
-	const user_hash& hash = ServerInstance->Users.GetUsers();
-	for (user_hash::const_iterator i = hash.begin(); i != hash.end(); ++i)
-	{
-		User* u = i->second;
-		AddClone(u);
-	}
+	clones.Remove(user->client_sa, IS_LOCAL(user));
 }
 
 const UserManager::CloneCounts& UserManager::GetCloneCounts(User* user) const
 {
-	CloneMap::const_iterator it = clonemap.find(user->GetCIDRMask());
-	if (it != clonemap.end())
-		return it->second;
-	else
-		return zeroclonecounts;
+	return clones.Get(user->GetCIDRMask());
 }
 
 void UserManager::ServerNoticeAll(const char* text, ...)
@@ -379,43 +346,33 @@ void UserManager::ServerNoticeAll(const char* text, ...)
 	}
 }
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the users, e.g. do
- * ping checks, registration timeouts, etc.
- */
-void UserManager::DoBackgroundUserStuff()
+void UserManager::DoBackgroundUserStuff(LocalUser* curr)
 {
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); )
+	if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
 	{
-		// It's possible that we quit the user below due to ping timeout etc. and QuitUser() removes it from the list
-		LocalUser* curr = *i;
-		++i;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
+		unsigned int rate = curr->MyClass->GetCommandRate();
+		if (curr->CommandFloodPenalty > rate)
+			curr->CommandFloodPenalty -= rate;
+		else
+			curr->CommandFloodPenalty = 0;
+		curr->eh.OnDataReady();
+		if (curr->quitting)
+			return;
+	}
 
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				CheckPingTimeout(curr);
-				break;
+	switch (curr->registered)
+	{
+		case REG_ALL:
+			CheckPingTimeout(curr);
+			break;
 
-			case REG_NICKUSER:
-				CheckModulesReady(curr);
-				break;
+		case REG_NICKUSER:
+			CheckModulesReady(curr);
+			break;
 
-			default:
-				CheckRegistrationTimeout(curr);
-				break;
-		}
+		default:
+			CheckRegistrationTimeout(curr);
+			break;
 	}
 }
 
@@ -77,7 +77,8 @@ std::string User::GetModeLetters(bool includeparams) const
 }
 
 User::User(const std::string& uid, Server* srv, UserType type)
-	: age(ServerInstance->Time())
+	: cacheserial(0)
+	, age(ServerInstance->Time())
 	, signon(0)
 	, uuid(uid)
 	, server(srv)
@@ -103,7 +104,9 @@ User::User(const std::string& uid, Server* srv, UserType type)
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL)
 	, eh(this)
+	, bgtimer(this)
 	, serializer(NULL)
+	, tagprofile(0)
 	, bytes_in(0)
 	, bytes_out(0)
 	, cmds_in(0)
@@ -124,15 +127,18 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	memcpy(&client_sa, client, sizeof(irc::sockets::sockaddrs));
 	memcpy(&server_sa, servaddr, sizeof(irc::sockets::sockaddrs));
 	ChangeRealHost(GetIPString(), true);
+	ServerInstance->Timers.AddTimer(&bgtimer);
 }
 
 LocalUser::LocalUser(int myfd, const std::string& uid, Serializable::Data& data)
 	: User(uid, ServerInstance->FakeClient->server, USERTYPE_LOCAL)
 	, eh(this)
+	, bgtimer(this)
 	, already_sent(0)
 {
 	eh.SetFd(myfd);
 	Deserialize(data);
+	ServerInstance->Timers.AddTimer(&bgtimer);
 }
 
 User::~User()
@@ -175,6 +181,15 @@ const std::string& User::GetFullRealHost()
 	return this->cached_fullrealhost;
 }
 
+const std::string& User::GetNickIdent()
+{
+	if (!this->cached_nickident.empty())
+		return this->cached_nickident;
+
+	this->cached_nickident = nick + "!" + ident;
+	return this->cached_nickident;
+}
+
 bool User::HasModePermission(const ModeHandler* mh) const
 {
 	return true;
@@ -265,27 +280,25 @@ void UserIOHandler::OnDataReady()
 	// The cleaned message sent by the user or empty if not found yet.
 	std::string line;
 
-	// The position of the most \n character or npos if not found yet.
-	std::string::size_type eolpos;
-
-	// The position within the recvq of the current character.
-	std::string::size_type qpos;
+	// The position within the line of the current character.
+	size_t qpos;
 
+	RecvQLineReader reader(recvq);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
 		// Check the newly received data for an EOL.
-		eolpos = recvq.find('\n', checked_until);
-		if (eolpos == std::string::npos)
+		if (!reader.GetNextLine('\n', checked_until))
 		{
-			checked_until = recvq.length();
-			return;
+			checked_until = reader.GetUnreadSize();
+			break;
 		}
+		checked_until = 0;
 
 		// We've found a line! Clean it up and move it to the line buffer.
-		line.reserve(eolpos);
-		for (qpos = 0; qpos < eolpos; ++qpos)
+		line.reserve(reader.length);
+		for (qpos = 0; qpos < reader.length; ++qpos)
 		{
-			char c = recvq[qpos];
+			char c = reader.line[qpos];
 			switch (c)
 			{
 				case '\0':
@@ -298,10 +311,6 @@ void UserIOHandler::OnDataReady()
 			line.push_back(c);
 		}
 
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, eolpos + 1);
-		checked_until = 0;
-
 		// TODO should this be moved to when it was inserted in recvq?
 		ServerInstance->stats.Recv += qpos;
 		user->bytes_in += qpos;
@@ -316,10 +325,23 @@ void UserIOHandler::OnDataReady()
 	}
 
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
+	{
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+		return;
+	}
+
+	// Commands may have raised the penalty or changed the registration state of the user.
+	user->bgtimer.Update();
+}
+
+void UserIOHandler::OnEventHandlerWrite()
+{
+	StreamSocket::OnEventHandlerWrite();
+	if (!user->quitting)
+		FOREACH_MOD(OnUserWriteReady, (user));
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::AddWriteBuf(const StreamSocket::SendQueue::Element& data)
 {
 	if (user->quitting_sendq)
 		return;
@@ -337,6 +359,53 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 	WriteData(data);
 }
 
+bool UserBackgroundTimer::Tick(time_t currtime)
+{
+	// The timer is not repeating so it is only rescheduled by Update() below.
+	if (user->quitting)
+		return true;
+
+	ServerInstance->Users->DoBackgroundUserStuff(user);
+	if (!user->quitting)
+		Update(true);
+	return true;
+}
+
+void UserBackgroundTimer::Update(bool force)
+{
+	if (user->quitting)
+		return;
+
+	const time_t now = ServerInstance->Time();
+	time_t due = now + 1;
+	if (!user->CommandFloodPenalty && !user->eh.getSendQSize())
+	{
+		switch (user->registered)
+		{
+			case REG_ALL:
+				// The ping time is pushed back by every command the user sends, if the
+				// timer fires before it is due it will simply be rescheduled.
+				due = std::max(user->nextping, due);
+				break;
+
+			case REG_NICKUSER:
+				// Modules may be holding the registration so check them every second.
+				break;
+
+			default:
+				if (user->GetClass())
+					due = std::max<time_t>(user->signon + user->GetClass()->GetRegTimeout() + 1, due);
+				break;
+		}
+	}
+
+	if (force || due < GetTrigger())
+	{
+		SetTrigger(due);
+		ServerInstance->Timers.AddTimer(this);
+	}
+}
+
 void UserIOHandler::SwapInternals(UserIOHandler& other)
 {
 	StreamSocket::SwapInternals(other);
@@ -554,6 +623,7 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nextping = ServerInstance->Time() + a->GetPingTime();
+	bgtimer.Update();
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -612,7 +682,7 @@ void LocalUser::FullConnect()
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->server_sa.port(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString().c_str(), this->GetRealName().c_str());
 	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
-	ServerInstance->BanCache.AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache.AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
 }
@@ -625,6 +695,8 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	cached_nickident.clear();
+	cacheserial++;
 }
 
 bool User::ChangeNick(const std::string& newnick, time_t newts)
@@ -805,7 +877,7 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa)
 		FOREACH_MOD(OnSetUserIP, (this));
 }
 
-void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
+void LocalUser::Write(const StreamSocket::SendQueue::Element& text)
 {
 	if (!SocketEngine::BoundsCheckFd(&eh))
 		return;
@@ -815,11 +887,9 @@ void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
 		if (text.empty())
 			return;
 
-		std::string::size_type nlpos = text.find_first_of("\r\n", 0, 2);
-		if (nlpos == std::string::npos)
-			nlpos = text.length(); // TODO is this ok, test it
-
-		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.c_str());
+		static const char eol[] = { '\r', '\n' };
+		const char* nlpos = std::find_first_of(text.begin(), text.end(), eol, eol + sizeof(eol));
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)(nlpos - text.begin()), text.data());
 	}
 
 	eh.AddWriteBuf(text);
@@ -30,6 +30,143 @@
 #include "xline.h"
 #include "modules/stats.h"
 
+namespace
+{
+	enum MaskType
+	{
+		// The mask has to be checked against everything.
+		MASK_WILDCARD,
+
+		// The mask only matches hosts which are equal to it.
+		MASK_LITERAL,
+
+		// The mask is a CIDR range, it also matches hosts which are equal to it.
+		MASK_CIDR,
+
+		// The mask is a literal followed by a single *.
+		MASK_PREFIX,
+
+		// The mask is a single * followed by a literal.
+		MASK_SUFFIX
+	};
+
+	/** Checks whether a string only contains characters which compare the same with every
+	 * case mapping X-lines use and which are not special to Match() or MatchCIDR().
+	 */
+	bool IsLiteral(const std::string& str, std::string::size_type pos, std::string::size_type len)
+	{
+		if (!len)
+			return false;
+
+		for (std::string::const_iterator i = str.begin() + pos; i != str.begin() + pos + len; ++i)
+		{
+			const char chr = *i;
+			if ((chr < 'a' || chr > 'z') && (chr < 'A' || chr > 'Z') && (chr < '0' || chr > '9') && !strchr(".:-_/", chr))
+				return false;
+		}
+		return true;
+	}
+
+	/** Checks whether irc::sockets::MatchCIDR() treats a host mask as a CIDR mask. */
+	bool IsCIDRMask(const std::string& mask)
+	{
+		const std::string::size_type per_pos = mask.rfind('/');
+		return ((per_pos != std::string::npos) && (per_pos != mask.length() - 1)
+			&& (mask.find_first_not_of("0123456789", per_pos + 1) == std::string::npos)
+			&& (mask.find_first_not_of("0123456789abcdefABCDEF.:") >= per_pos));
+	}
+
+	std::string MakeKey(const std::string& str, std::string::size_type pos = 0, std::string::size_type len = std::string::npos)
+	{
+		std::string key(str, pos, len);
+		for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+			*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return key;
+	}
+
+	/** Works out how a host mask can be indexed.
+	 * @param mask The host mask of a line or NULL if the line has none.
+	 * @param key Set to the lowercased literal part of the mask.
+	 * @param cidr Set to the parsed mask if the mask is a CIDR range.
+	 */
+	MaskType GetMaskType(const std::string* mask, std::string& key, irc::sockets::cidr_mask& cidr)
+	{
+		if (!mask || mask->empty())
+			return MASK_WILDCARD;
+
+		const std::string::size_type len = mask->length();
+		if ((*mask)[0] == '*' && IsLiteral(*mask, 1, len - 1))
+		{
+			key = MakeKey(*mask, 1);
+			return MASK_SUFFIX;
+		}
+
+		if ((*mask)[len - 1] == '*' && IsLiteral(*mask, 0, len - 1))
+		{
+			key = MakeKey(*mask, 0, len - 1);
+			return MASK_PREFIX;
+		}
+
+		if (!IsLiteral(*mask, 0, len))
+			return MASK_WILDCARD;
+
+		key = MakeKey(*mask);
+		if (!IsCIDRMask(*mask))
+			return MASK_LITERAL;
+
+		// MatchCIDR() would compare against an uninitialised address if it can't be parsed.
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(mask->substr(0, mask->rfind('/')), 0, sa))
+			return MASK_WILDCARD;
+
+		cidr = irc::sockets::cidr_mask(*mask);
+		return MASK_CIDR;
+	}
+
+	template <typename Map, typename Key>
+	bool RemoveFromMap(Map& map, const Key& key, XLine* line)
+	{
+		typename Map::iterator it = map.find(key);
+		if (it == map.end() || !stdalgo::vector::swaperase(it->second, line))
+			return false;
+
+		if (it->second.empty())
+			map.erase(it);
+		return true;
+	}
+
+	template <typename Key>
+	void ReleaseLength(std::map<Key, size_t>& lengths, const Key& key)
+	{
+		typename std::map<Key, size_t>::iterator it = lengths.find(key);
+		if (it != lengths.end() && !--it->second)
+			lengths.erase(it);
+	}
+
+	template <typename Map, typename Key>
+	void FindInMap(const Map& map, const Key& key, XLineIndex::LineList& out)
+	{
+		typename Map::const_iterator it = map.find(key);
+		if (it != map.end())
+			out.insert(out.end(), it->second.begin(), it->second.end());
+	}
+
+	/** Orders lines the same way as XLineManager::lookup_lines, by type and then by mask. */
+	bool LineOrder(XLine* first, XLine* second)
+	{
+		if (first->type != second->type)
+			return first->type < second->type;
+		return first->Displayable() < second->Displayable();
+	}
+
+	void RemoveDuplicates(XLineIndex::LineList& list)
+	{
+		// Sort by mask rather than by address so lines are checked in the same order every time.
+		std::sort(list.begin(), list.end(), LineOrder);
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+	}
+}
+
 /** An XLineFactory specialized to generate GLine* pointers
  */
 class GLineFactory : public XLineFactory
@@ -146,6 +283,129 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+void XLineIndex::Add(XLine* line)
+{
+	std::string key;
+	irc::sockets::cidr_mask cidr;
+	switch (GetMaskType(line->GetHostMask(), key, cidr))
+	{
+		case MASK_WILDCARD:
+			wildcards.push_back(line);
+			break;
+
+		case MASK_CIDR:
+			cidrmasks[cidr].push_back(line);
+			cidrlengths[std::make_pair(cidr.type, cidr.length)]++;
+			literals[key].push_back(line);
+			break;
+
+		case MASK_LITERAL:
+			literals[key].push_back(line);
+			break;
+
+		case MASK_PREFIX:
+			prefixes[key].push_back(line);
+			prefixlengths[key.length()]++;
+			break;
+
+		case MASK_SUFFIX:
+			suffixes[key].push_back(line);
+			suffixlengths[key.length()]++;
+			break;
+	}
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	std::string key;
+	irc::sockets::cidr_mask cidr;
+	switch (GetMaskType(line->GetHostMask(), key, cidr))
+	{
+		case MASK_WILDCARD:
+			stdalgo::vector::swaperase(wildcards, line);
+			break;
+
+		case MASK_CIDR:
+			if (RemoveFromMap(cidrmasks, cidr, line))
+				ReleaseLength(cidrlengths, std::make_pair(cidr.type, cidr.length));
+			RemoveFromMap(literals, key, line);
+			break;
+
+		case MASK_LITERAL:
+			RemoveFromMap(literals, key, line);
+			break;
+
+		case MASK_PREFIX:
+			if (RemoveFromMap(prefixes, key, line))
+				ReleaseLength(prefixlengths, key.length());
+			break;
+
+		case MASK_SUFFIX:
+			if (RemoveFromMap(suffixes, key, line))
+				ReleaseLength(suffixlengths, key.length());
+			break;
+	}
+}
+
+void XLineIndex::FindHost(const std::string& host, LineList& out) const
+{
+	const std::string key = MakeKey(host);
+	FindInMap(literals, key, out);
+
+	for (LengthMap::const_iterator i = prefixlengths.begin(); i != prefixlengths.end() && i->first <= key.length(); ++i)
+		FindInMap(prefixes, key.substr(0, i->first), out);
+
+	for (LengthMap::const_iterator i = suffixlengths.begin(); i != suffixlengths.end() && i->first <= key.length(); ++i)
+		FindInMap(suffixes, key.substr(key.length() - i->first), out);
+
+	if (cidrlengths.empty())
+		return;
+
+	// MatchCIDR() only compares the part after the last @ against CIDR masks.
+	const std::string::size_type atpos = host.rfind('@');
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(atpos == std::string::npos ? host : host.substr(atpos + 1), 0, sa))
+		return;
+
+	for (CIDRLengthMap::const_iterator i = cidrlengths.begin(); i != cidrlengths.end(); ++i)
+	{
+		if (i->first.first == sa.family())
+			FindInMap(cidrmasks, irc::sockets::cidr_mask(sa, i->first.second), out);
+	}
+}
+
+void XLineIndex::Find(User* user, LineList& out) const
+{
+	out.insert(out.end(), wildcards.begin(), wildcards.end());
+
+	const std::string& realhost = user->GetRealHost();
+	const std::string& ip = user->GetIPString();
+	FindHost(realhost, out);
+	if (ip != realhost)
+		FindHost(ip, out);
+
+	// Lines can be found through both the host and the IP address of the user.
+	RemoveDuplicates(out);
+}
+
+bool XLineIndex::Find(const std::string& pattern, LineList& out) const
+{
+	// Depending on the type of the line the host mask is either matched against the whole
+	// pattern or against the host part of an ident@host pattern. With more than one @ it is
+	// not clear what the host part is.
+	const std::string::size_type atpos = pattern.find('@');
+	if (atpos != std::string::npos && pattern.find('@', atpos + 1) != std::string::npos)
+		return false;
+
+	out.insert(out.end(), wildcards.begin(), wildcards.end());
+	FindHost(pattern, out);
+	if (atpos != std::string::npos)
+		FindHost(pattern.substr(atpos + 1), out);
+
+	RemoveDuplicates(out);
+	return true;
+}
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -161,25 +421,25 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
+	const XLineIndex& index = line_indexes["E"];
+	XLineIndex::LineList candidates;
+
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
 	{
 		LocalUser* u = *u2;
 		u->exempt = false;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
+		candidates.clear();
+		index.Find(u, candidates);
+		for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
+			XLine *e = *i;
 			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
+			{
 				u->exempt = true;
-
-			i = safei;
+				break;
+			}
 		}
 	}
 }
@@ -309,6 +569,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	line_indexes[line->type].Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -341,10 +602,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string& type, std::s
 
 	y->second->Unset();
 
-	stdalgo::erase(pending_lines, y->second);
-
-	delete y->second;
-	x->second.erase(y);
+	RemoveLine(x, y);
 
 	return true;
 }
@@ -366,27 +624,21 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 
 	const time_t current = ServerInstance->Time();
 
-	LookupIter safei;
+	XLineIndex::LineList candidates;
+	line_indexes[type].Find(user, candidates);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
+		XLine* line = *i;
+		if (line->duration && current > line->expiry)
 		{
 			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
+			ExpireLine(x, x->second.find(line->Displayable()));
 			continue;
 		}
 
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
-
-		i = safei;
+		if (line->Matches(user))
+			return line;
 	}
 	return NULL;
 }
@@ -400,28 +652,28 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 
 	const time_t current = ServerInstance->Time();
 
-	 LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	XLineIndex::LineList candidates;
+	if (!line_indexes[type].Find(pattern, candidates))
 	{
-		safei = i;
-		safei++;
+		// The index can't be used for this pattern so check every line.
+		for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
+			candidates.push_back(i->second);
+	}
 
-		if (i->second->Matches(pattern))
+	for (XLineIndex::LineList::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* line = *i;
+		if (line->Matches(pattern))
 		{
-			if (i->second->duration && current > i->second->expiry)
+			if (line->duration && current > line->expiry)
 			{
 				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
+				ExpireLine(x, x->second.find(line->Displayable()));
 				continue;
 			}
 			else
-				return i->second;
+				return line;
 		}
-
-		i = safei;
 	}
 	return NULL;
 }
@@ -436,13 +688,23 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item, bool sil
 
 	item->second->Unset();
 
+	RemoveLine(container, item);
+}
+
+void XLineManager::RemoveLine(ContainerIter container, LookupIter item)
+{
+	XLine* line = item->second;
+
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
 	 * is pending, cleared when it is no longer pending, so we skip over this loop if its not pending?
 	 * -- Brain
 	 */
-	stdalgo::erase(pending_lines, item->second);
+	stdalgo::erase(pending_lines, line);
+	applying_lines.Remove(line);
+
+	line_indexes[container->first].Remove(line);
 
-	delete item->second;
+	delete line;
 	container->second.erase(item);
 }
 
@@ -450,16 +712,61 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item, bool sil
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); )
+	if (pending_lines.empty())
+		return;
+
+	// Start applying the lines right away, only the users which do not fit
+	// into the first slice are left to the main loop.
+	apply_requested = true;
+	if (applying_users.empty())
+		ContinueApplyLines();
+}
+
+void XLineManager::ContinueApplyLines()
+{
+	// Lines added while a pass is in progress wait for it to finish so the users
+	// which have already been checked are not all checked again every time.
+	if (applying_users.empty() && apply_requested)
 	{
-		LocalUser* u = *j++;
+		apply_requested = false;
+		if (pending_lines.empty())
+			return;
+
+		for (std::vector<XLine *>::const_iterator i = pending_lines.begin(); i != pending_lines.end(); ++i)
+			applying_lines.Add(*i);
+		pending_lines.clear();
+
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+			applying_users.push_back((*i)->uuid);
+	}
+
+	if (!applying_users.empty())
+		ApplyLinesSlice();
+}
 
-		// Don't ban people who are exempt.
-		if (u->exempt)
+void XLineManager::ApplyLinesSlice()
+{
+	// The number of users plus the number of lines checked against them in one slice.
+	static const size_t maxwork = 50000;
+
+	size_t work = 0;
+	XLineIndex::LineList candidates;
+	while (!applying_users.empty() && work < maxwork)
+	{
+		LocalUser* u = IS_LOCAL(ServerInstance->FindUUID(applying_users.back()));
+		applying_users.pop_back();
+		work++;
+
+		// Don't ban people who are exempt or who have left since the lines were added.
+		if (!u || u->quitting || u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		candidates.clear();
+		applying_lines.Find(u, candidates);
+		work += candidates.size();
+
+		for (XLineIndex::LineList::iterator i = candidates.begin(); i != candidates.end(); i++)
 		{
 			XLine *x = *i;
 			if (x->Matches(u))
@@ -474,7 +781,8 @@ void XLineManager::ApplyLines()
 		}
 	}
 
-	pending_lines.clear();
+	if (applying_users.empty())
+		applying_lines = XLineIndex();
 }
 
 void XLineManager::InvokeStats(const std::string& type, unsigned int numeric, Stats::Context& stats)
@@ -530,6 +838,7 @@ bool XLineManager::InvokeStats(const std::string& type, Stats::Context& context)
 }
 
 XLineManager::XLineManager()
+	: apply_requested(false)
 {
 	GLineFactory* GFact;
 	ELineFactory* EFact;
@@ -594,8 +903,15 @@ void XLine::DefaultApply(User* u, const std::string &line, bool bancache)
 
 	if (bancache)
 	{
-		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding positive hit (" + line + ") for " + u->GetIPString());
-		ServerInstance->BanCache.AddHit(u->GetIPString(), this->type, banReason, (this->duration > 0 ? (this->expiry - ServerInstance->Time()) : 0));
+		// If the line bans a whole CIDR range then cache the ban for all of it.
+		std::string key;
+		irc::sockets::cidr_mask cidr;
+		unsigned char range = 128;
+		if ((GetMaskType(GetHostMask(), key, cidr) == MASK_CIDR) && (cidr.type == u->client_sa.family()))
+			range = cidr.length;
+
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding positive hit (" + line + ") for " + irc::sockets::cidr_mask(u->client_sa, range).str());
+		ServerInstance->BanCache.AddHit(u->client_sa, this->type, banReason, (this->duration > 0 ? (this->expiry - ServerInstance->Time()) : 0), range);
 	}
 }
 
@@ -762,6 +1078,26 @@ const std::string& ZLine::Displayable()
 	return ipaddr;
 }
 
+const std::string* ELine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* KLine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* GLine::GetHostMask()
+{
+	return &hostmask;
+}
+
+const std::string* ZLine::GetHostMask()
+{
+	return &ipaddr;
+}
+
 const std::string& QLine::Displayable()
 {
 	return nick;